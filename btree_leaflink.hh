@@ -94,6 +94,33 @@ template <typename N> struct btree_leaflink<N, true> {
         fence();
         prev->next_.ptr = next;
     }
+
+    /** @brief Replace @a n in the list with its copy @a nn.
+        @pre @a n is locked and has a predecessor.
+
+        Concurrency correctness: Like unlink(), holds both links into @a n
+        while @a nn takes its place. @a n's own next pointer stays locked. */
+    static void replace(N *n, N *nn) {
+        replace(n, nn, relax_fence_function());
+    }
+    /** @overload */
+    template <typename SF>
+    static void replace(N *n, N *nn, SF spin_function) {
+        N *next = lock_next(n, spin_function);
+        N *prev;
+        while (1) {
+            prev = n->prev_;
+            if (bool_cmpxchg(&prev->next_.ptr, n, mark(n)))
+                break;
+            spin_function();
+        }
+        nn->prev_ = prev;
+        nn->next_.ptr = next;
+        if (next)
+            next->prev_ = nn;
+        fence();
+        prev->next_.ptr = nn;
+    }
 };
 
 
@@ -119,6 +146,17 @@ template <typename N> struct btree_leaflink<N, false> {
             n->next_.ptr->prev_ = n->prev_;
         n->prev_->next_.ptr = n->next_.ptr;
     }
+    static void replace(N *n, N *nn) {
+        replace(n, nn, do_nothing());
+    }
+    template <typename SF>
+    static void replace(N *n, N *nn, SF) {
+        nn->prev_ = n->prev_;
+        nn->next_.ptr = n->next_.ptr;
+        if (nn->next_.ptr)
+            nn->next_.ptr->prev_ = nn;
+        nn->prev_->next_.ptr = nn;
+    }
 };
 
 #endif
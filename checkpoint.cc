@@ -17,10 +17,19 @@
 
 // add one key/value to a checkpoint.
 // called by checkpoint_tree() for each node.
-bool ckstate::visit_value(Str key, const row_type* value, threadinfo&) {
+bool ckstate::visit_value(Str key, const row_type* value, threadinfo& ti) {
     if (endkey && key >= endkey)
         return false;
-    if (!row_is_marker(value)) {
+    if (row_inline<row_type>::is_inline(value)) {
+        // write inline values in row format
+        char buf[row_inline<row_type>::max_length];
+        row_type* row = row_type::create1(row_inline<row_type>::value(value, buf), 0, ti);
+        msgpack::unparser<kvout> up(*vals);
+        up.write(key).write_wide(row->timestamp());
+        row->checkpoint_write(up);
+        row->deallocate(ti);
+        ++count;
+    } else if (!row_is_marker(value)) {
         msgpack::unparser<kvout> up(*vals);
         up.write(key).write_wide(value->timestamp());
         value->checkpoint_write(up);
@@ -18,6 +18,7 @@
 #include "kvrow.hh"
 #include "kvio.hh"
 #include "msgpack.hh"
+#include "masstree_bulk.hh"
 
 struct ckstate {
     kvout *vals; // key, val, timestamp in msgpack
@@ -36,6 +37,9 @@ struct ckstate {
 
     template <typename T>
     static void insert(T& table, msgpack::parser& par, threadinfo& ti);
+    template <typename P>
+    static void insert(Masstree::bulk_loader<P>& loader, msgpack::parser& par,
+                       threadinfo& ti);
 };
 
 template <typename T>
@@ -53,4 +57,15 @@ void ckstate::insert(T& table, msgpack::parser& par, threadinfo& ti) {
     lp.finish(1, ti);
 }
 
+// checkpoints are written in key order, so they can be loaded bottom-up
+template <typename P>
+void ckstate::insert(Masstree::bulk_loader<P>& loader, msgpack::parser& par,
+                     threadinfo& ti) {
+    Str key;
+    kvtimestamp_t ts{};
+    par >> key >> ts;
+    row_type* row = row_type::checkpoint_read(par, ts, ti);
+    loader.add(key, row, ti);
+}
+
 #endif
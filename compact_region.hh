@@ -0,0 +1,102 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2016 President and Fellows of Harvard College
+ * Copyright (c) 2012-2016 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef COMPACT_REGION_HH
+#define COMPACT_REGION_HH 1
+#include "compiler.hh"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief A reserved address range for objects named by 32-bit offsets.
+
+    The range is reserved (but not committed) at first use; threadinfo
+    carves compact pools from it in chunk_size pieces. An offset counts
+    16-byte units from the base, so the region spans up to 64GB. Objects
+    in it are 32-byte aligned, which leaves an offset's low bit free for
+    marks like btree_leaflink's; offset 0 is never allocated and means
+    null. */
+class compact_region {
+  public:
+    static constexpr int shift = 4;
+    static constexpr size_t max_size = size_t(1) << (32 + shift);
+    static constexpr size_t chunk_size = 2 << 20;
+
+    static uint32_t encode(const void* p) {
+        if (!p)
+            return 0;
+        uintptr_t off = reinterpret_cast<uintptr_t>(p)
+            - reinterpret_cast<uintptr_t>(base_);
+        assert(off < size_ && (off & 30) == 0);
+        return (off >> shift) | (off & 1);
+    }
+    static void* decode(uint32_t x) {
+        // branch-free: mask the result to null when x is 0
+        uintptr_t p = reinterpret_cast<uintptr_t>(base_)
+            + ((uintptr_t(x) & ~uintptr_t(1)) << shift) + (x & 1);
+        return reinterpret_cast<void*>(p & -uintptr_t(x != 0));
+    }
+
+    /** @brief Return a fresh chunk_size-byte chunk, or null if the
+        region is exhausted or cannot be reserved. */
+    static void* allocate_chunk();
+    static size_t size() {
+        return size_;
+    }
+    static size_t allocated() {
+        return allocated_ < size_ ? allocated_ : size_;
+    }
+
+  private:
+    static char* base_;
+    static size_t size_;
+    static size_t allocated_;
+
+    static void reserve();
+};
+
+/** @brief A 32-bit pointer to a T allocated from the compact_region. */
+template <typename T>
+class compact_ptr {
+  public:
+    compact_ptr() = default;
+    compact_ptr(T* p)
+        : x_(compact_region::encode(p)) {
+    }
+
+    operator T*() const {
+        return static_cast<T*>(compact_region::decode(x_));
+    }
+    T* operator->() const {
+        return *this;
+    }
+    uint32_t value() const {
+        return x_;
+    }
+
+  private:
+    uint32_t x_;
+
+    template <typename U>
+    friend bool bool_cmpxchg(compact_ptr<U>* object, U* expected, U* desired);
+};
+
+template <typename T>
+inline bool bool_cmpxchg(compact_ptr<T>* object, T* expected, T* desired) {
+    return bool_cmpxchg(&object->x_, compact_region::encode(expected),
+                        compact_region::encode(desired));
+}
+
+#endif
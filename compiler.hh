@@ -694,6 +694,17 @@ inline int ctz(unsigned long long x) {
 }
 #endif
 
+#ifdef __SIZEOF_INT128__
+inline int clz(unsigned __int128 x) {
+    uint64_t hi = x >> 64;
+    return hi ? __builtin_clzll(hi) : 64 + __builtin_clzll(uint64_t(x));
+}
+inline int ctz(unsigned __int128 x) {
+    uint64_t lo = x;
+    return lo ? __builtin_ctzll(lo) : 64 + __builtin_ctzll(uint64_t(x >> 64));
+}
+#endif
+
 template <typename T, typename U>
 inline T iceil(T x, U y) {
     U mod = x % y;
@@ -802,6 +813,12 @@ inline uint64_t host_to_net_order(uint64_t x) {
     return htonq(x);
 }
 #endif
+#ifdef __SIZEOF_INT128__
+/** @overload */
+inline unsigned __int128 host_to_net_order(unsigned __int128 x) {
+    return ((unsigned __int128) htonq(uint64_t(x)) << 64) | htonq(uint64_t(x >> 64));
+}
+#endif
 /** @overload */
 inline double host_to_net_order(float x) {
     union { float f; uint32_t i; } v;
@@ -888,6 +905,12 @@ inline uint64_t net_to_host_order(uint64_t x) {
     return ntohq(x);
 }
 #endif
+#ifdef __SIZEOF_INT128__
+/** @overload */
+inline unsigned __int128 net_to_host_order(unsigned __int128 x) {
+    return host_to_net_order(x);
+}
+#endif
 /** @overload */
 inline double net_to_host_order(float x) {
     return host_to_net_order(x);
@@ -913,6 +936,12 @@ MAKE_ALIASABLE(unsigned long long);
 MAKE_ALIASABLE(float);
 MAKE_ALIASABLE(double);
 #undef MAKE_ALIASABLE
+#ifdef __SIZEOF_INT128__
+// 16-byte integers are 16-byte aligned, but keys are not
+template <> struct make_aliasable<unsigned __int128> {
+    typedef unsigned __int128 type __attribute__((__may_alias__, __aligned__(1)));
+};
+#endif
 
 template <typename T>
 inline char* write_in_host_order(char* s, T x) {
@@ -16,6 +16,13 @@
 #ifndef KPERMUTER_HH
 #define KPERMUTER_HH
 #include "string.hh"
+#include <string.h>
+#if defined(__SIZEOF_INT128__) && (__AVX__ || __GCC_HAVE_SYNC_COMPARE_AND_SWAP_16)
+# define HAVE_WIDE_KPERMUTER 1
+# if __AVX__
+#  include <immintrin.h>
+# endif
+#endif
 
 class identity_kpermuter {
     int size_;
@@ -27,6 +34,9 @@ class identity_kpermuter {
     int size() const {
         return size_;
     }
+    int width() const {
+        return size_;
+    }
     int operator[](int i) const {
         return i;
     }
@@ -42,27 +52,102 @@ template <int C> struct sized_kpermuter_info {};
 template <> struct sized_kpermuter_info<0> {
     typedef uint16_t storage_type;
     typedef unsigned value_type;
-    enum { initial_value = 0x0120U, full_value = 0x2100U };
+    enum { slot_bits = 4 };
 };
 template <> struct sized_kpermuter_info<1> {
     typedef uint32_t storage_type;
     typedef unsigned value_type;
-    enum { initial_value = 0x01234560U, full_value = 0x65432100U };
+    enum { slot_bits = 4 };
 };
 template <> struct sized_kpermuter_info<2> {
     typedef uint64_t storage_type;
     typedef uint64_t value_type;
-    enum { initial_value = (uint64_t) 0x0123456789ABCDE0ULL,
-           full_value = (uint64_t) 0xEDCBA98765432100ULL };
+    enum { slot_bits = 4 };
 };
+#if HAVE_WIDE_KPERMUTER
+/** @brief 16-byte permutation storage with atomic loads and stores.
+
+    Concurrent readers load a leaf's permutation without locking, so the
+    whole word must be read and written at once. Aligned 16-byte SSE
+    accesses are atomic on processors that support AVX. Elsewhere we fall
+    back to cmpxchg16b, which requires -mcx16. */
+class wide_kpermuter_storage {
+  public:
+    typedef unsigned __int128 value_type;
+
+    wide_kpermuter_storage() {
+    }
+    wide_kpermuter_storage(value_type x)
+        : x_(x) {
+    }
+    wide_kpermuter_storage(const wide_kpermuter_storage& x)
+        : x_(x.load()) {
+    }
+    wide_kpermuter_storage& operator=(value_type x) {
+        store(x);
+        return *this;
+    }
+    wide_kpermuter_storage& operator=(const wide_kpermuter_storage& x) {
+        store(x.load());
+        return *this;
+    }
+    operator value_type() const {
+        return load();
+    }
+    bool operator==(const wide_kpermuter_storage& x) const {
+        return load() == x.load();
+    }
+    bool operator!=(const wide_kpermuter_storage& x) const {
+        return load() != x.load();
+    }
+
+    value_type load() const {
+#if __AVX__
+        __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(&x_));
+        value_type x;
+        memcpy(&x, &v, sizeof(x));
+        return x;
+#else
+        value_type* xp = const_cast<value_type*>(&x_);
+        return __sync_val_compare_and_swap(xp, value_type(0), value_type(0));
+#endif
+    }
+    void store(value_type x) {
+#if __AVX__
+        __m128i v;
+        memcpy(&v, &x, sizeof(x));
+        _mm_store_si128(reinterpret_cast<__m128i*>(&x_), v);
+#else
+        value_type old = x_;
+        while (1) {
+            value_type cur = __sync_val_compare_and_swap(&x_, old, x);
+            if (cur == old)
+                break;
+            old = cur;
+        }
+#endif
+    }
+
+  private:
+    alignas(16) value_type x_;
+};
+
+template <> struct sized_kpermuter_info<3> {
+    typedef wide_kpermuter_storage storage_type;
+    typedef unsigned __int128 value_type;
+    enum { slot_bits = 5 };
+};
+#endif
 
 template <int W> class kpermuter {
   public:
     typedef sized_kpermuter_info<(W > 3) + (W > 7) + (W > 15)> info;
     typedef typename info::storage_type storage_type;
     typedef typename info::value_type value_type;
-    enum { max_width = (int) (sizeof(storage_type) * 2 - 1) };
-    enum { size_bits = 4 };
+    enum { size_bits = info::slot_bits,
+           slot_mask = (1 << size_bits) - 1 };
+    enum { max_width = (int) (sizeof(value_type) * 8 / size_bits - 1) };
+    static_assert(W <= max_width, "kpermuter too wide");
 
     /** @brief Construct an uninitialized permuter. */
     kpermuter() {
@@ -76,8 +161,7 @@ template <int W> class kpermuter {
 
         Elements will be allocated in order 0, 1, ..., @a width - 1. */
     static inline value_type make_empty() {
-        value_type p = (value_type) info::initial_value >> ((max_width - W) << 2);
-        return p & ~(value_type) 15;
+        return initial_value();
     }
     /** @brief Return a permuter with size @a n.
 
@@ -85,15 +169,15 @@ template <int W> class kpermuter {
         (*this)[i] == i. Elements n through @a width - 1 are free, and will be
         allocated in that order. */
     static inline value_type make_sorted(int n) {
-        value_type mask = (n == W ? (value_type) 0 : (value_type) 16 << (n << 2)) - 1;
-        return (make_empty() << (n << 2))
-            | ((value_type) info::full_value & mask)
+        value_type mask = (n == W ? (value_type) 0 : (value_type) slot_unit << (n * size_bits)) - 1;
+        return (make_empty() << (n * size_bits))
+            | (full_value() & mask)
             | n;
     }
 
     /** @brief Return the permuter's size. */
     int size() const {
-        return x_ & 15;
+        return x_ & slot_mask;
     }
     static int width() {
         return W;
@@ -101,7 +185,7 @@ template <int W> class kpermuter {
     /** @brief Return the permuter's element @a i.
         @pre 0 <= i < width */
     int operator[](int i) const {
-        return (x_ >> ((i << 2) + 4)) & 15;
+        return (x_ >> (i * size_bits + size_bits)) & slot_mask;
     }
     int back() const {
         return (*this)[W - 1];
@@ -110,11 +194,11 @@ template <int W> class kpermuter {
         return x_;
     }
     value_type value_from(int i) const {
-        return x_ >> ((i + 1) << 2);
+        return x_ >> ((i + 1) * size_bits);
     }
 
     void set_size(int n) {
-        x_ = (x_ & ~(value_type) 15) | n;
+        x_ = (x_ & ~(value_type) slot_mask) | n;
     }
     /** @brief Allocate a new element and insert it at position @a i.
         @pre 0 <= @a i < @a width
@@ -137,11 +221,11 @@ template <int W> class kpermuter {
     int insert_from_back(int i) {
         int value = back();
         // increment size, leave lower slots unchanged
-        x_ = ((x_ + 1) & (((value_type) 16 << (i << 2)) - 1))
+        x_ = ((x_ + 1) & (((value_type) slot_unit << (i * size_bits)) - 1))
             // insert slot
-            | ((value_type) value << ((i << 2) + 4))
+            | ((value_type) value << (i * size_bits + size_bits))
             // shift up unchanged higher entries & empty slots
-            | ((x_ << 4) & ~(((value_type) 256 << (i << 2)) - 1));
+            | ((x_ << size_bits) & ~(((value_type) slot_unit2 << (i * size_bits)) - 1));
         return value;
     }
     /** @brief Insert an unallocated element from position @a si at position @a di.
@@ -151,13 +235,13 @@ template <int W> class kpermuter {
         @return The newly allocated element. */
     void insert_selected(int di, int si) {
         int value = (*this)[si];
-        value_type mask = ((value_type) 256 << (si << 2)) - 1;
+        value_type mask = ((value_type) slot_unit2 << (si * size_bits)) - 1;
         // increment size, leave lower slots unchanged
-        x_ = ((x_ + 1) & (((value_type) 16 << (di << 2)) - 1))
+        x_ = ((x_ + 1) & (((value_type) slot_unit << (di * size_bits)) - 1))
             // insert slot
-            | ((value_type) value << ((di << 2) + 4))
+            | ((value_type) value << (di * size_bits + size_bits))
             // shift up unchanged higher entries & empty slots
-            | ((x_ << 4) & mask & ~(((value_type) 256 << (di << 2)) - 1))
+            | ((x_ << size_bits) & mask & ~(((value_type) slot_unit2 << (di * size_bits)) - 1))
             // leave uppermost slots alone
             | (x_ & ~mask);
     }
@@ -179,16 +263,16 @@ template <int W> class kpermuter {
         <li>q[q.size()] == p[i]</li>
         </ul> */
     void remove(int i) {
-        if (int(x_ & 15) == i + 1) {
+        if (int(x_ & slot_mask) == i + 1) {
             --x_;
         } else {
-            int rot_amount = ((x_ & 15) - i - 1) << 2;
+            int rot_amount = (int(x_ & slot_mask) - i - 1) * size_bits;
             value_type rot_mask =
-                (((value_type) 16 << rot_amount) - 1) << ((i + 1) << 2);
+                (((value_type) slot_unit << rot_amount) - 1) << ((i + 1) * size_bits);
             // decrement size, leave lower slots unchanged
             x_ = ((x_ - 1) & ~rot_mask)
                 // shift higher entries down
-                | (((x_ & rot_mask) >> 4) & rot_mask)
+                | (((x_ & rot_mask) >> size_bits) & rot_mask)
                 // shift value up
                 | (((x_ & rot_mask) << rot_amount) & rot_mask);
         }
@@ -211,15 +295,15 @@ template <int W> class kpermuter {
         <li>q.back() == p[i]</li>
         </ul> */
     void remove_to_back(int i) {
-        value_type mask = ~(((value_type) 16 << (i << 2)) - 1);
+        value_type mask = ~(((value_type) slot_unit << (i * size_bits)) - 1);
         // clear unused slots
-        value_type x = x_ & (((value_type) 16 << (W << 2)) - 1);
+        value_type x = x_ & (((value_type) slot_unit << (W * size_bits)) - 1);
         // decrement size, leave lower slots unchanged
         x_ = ((x - 1) & ~mask)
             // shift higher entries down
-            | ((x >> 4) & mask)
+            | ((x >> size_bits) & mask)
             // shift removed element up
-            | ((x & mask) << ((W - i - 1) << 2));
+            | ((x & mask) << ((W - i - 1) * size_bits));
     }
     /** @brief Rotate the permuter's elements between @a i and size().
         @pre 0 <= @a i <= @a j <= size()
@@ -237,23 +321,24 @@ template <int W> class kpermuter {
         <li>Given k with i <= k < q.size(), q[k] == p[i + (k - i + j - i) mod (size() - i)]</li>
         </ul> */
     void rotate(int i, int j) {
-        value_type mask = (i == W ? (value_type) 0 : (value_type) 16 << (i << 2)) - 1;
+        value_type mask = (i == W ? (value_type) 0 : (value_type) slot_unit << (i * size_bits)) - 1;
         // clear unused slots
-        value_type x = x_ & (((value_type) 16 << (W << 2)) - 1);
+        value_type x = x_ & (((value_type) slot_unit << (W * size_bits)) - 1);
         x_ = (x & mask)
-            | ((x >> ((j - i) << 2)) & ~mask)
-            | ((x & ~mask) << ((W - j) << 2));
+            | ((x >> ((j - i) * size_bits)) & ~mask)
+            | ((x & ~mask) << ((W - j) * size_bits));
     }
     /** @brief Exchange the elements at positions @a i and @a j. */
     void exchange(int i, int j) {
-        value_type diff = ((x_ >> (i << 2)) ^ (x_ >> (j << 2))) & 240;
-        x_ ^= (diff << (i << 2)) | (diff << (j << 2));
+        value_type diff = ((x_ >> (i * size_bits)) ^ (x_ >> (j * size_bits)))
+            & ((value_type) slot_mask << size_bits);
+        x_ ^= (diff << (i * size_bits)) | (diff << (j * size_bits));
     }
     /** @brief Exchange positions of values @a x and @a y. */
     void exchange_values(int x, int y) {
         value_type diff = 0, p = x_;
-        for (int i = 0; i < W; ++i, diff <<= 4, p <<= 4) {
-            int v = (p >> (W << 2)) & 15;
+        for (int i = 0; i < W; ++i, diff <<= size_bits, p <<= size_bits) {
+            int v = (p >> (W * size_bits)) & slot_mask;
             diff ^= -((v == x) | (v == y)) & (x ^ y);
         }
         x_ ^= diff;
@@ -269,10 +354,28 @@ template <int W> class kpermuter {
     }
 
     static inline int size(value_type p) {
-        return p & 15;
+        return p & slot_mask;
     }
   private:
     value_type x_;
+
+    enum { slot_unit = 1 << size_bits,
+           slot_unit2 = 1 << (2 * size_bits) };
+
+    // Slot i holds W - 1 - i: free elements are allocated from the back.
+    static constexpr value_type initial_value() {
+        value_type p = 0;
+        for (int i = 0; i < W; ++i)
+            p |= (value_type) (W - 1 - i) << ((i + 1) * size_bits);
+        return p;
+    }
+    // Slot i holds i, for every slot that fits.
+    static constexpr value_type full_value() {
+        value_type p = 0;
+        for (int i = 0; i < max_width; ++i)
+            p |= (value_type) i << ((i + 1) * size_bits);
+        return p;
+    }
 };
 
 template <int W>
@@ -281,8 +384,8 @@ lcdf::String kpermuter<W>::unparse() const
     char buf[max_width + 3], *s = buf;
     value_type p(x_);
     value_type seen(0);
-    int n = p & 15;
-    p >>= 4;
+    int n = p & ((1 << size_bits) - 1);
+    p >>= size_bits;
     for (int i = 0; true; ++i) {
         if (i == n) {
             *s++ = ':';
@@ -290,15 +393,16 @@ lcdf::String kpermuter<W>::unparse() const
         if (i == W) {
             break;
         }
-        if ((p & 15) < 10) {
-            *s++ = '0' + (p & 15);
+        int v = p & ((1 << size_bits) - 1);
+        if (v < 10) {
+            *s++ = '0' + v;
         } else {
-            *s++ = 'a' + (p & 15) - 10;
+            *s++ = 'a' + v - 10;
         }
-        seen |= 1 << (p & 15);
-        p >>= 4;
+        seen |= (value_type) 1 << v;
+        p >>= size_bits;
     }
-    if (seen != (1 << W) - 1) {
+    if (seen != ((value_type) 1 << W) - 1) {
         *s++ = '?';
         *s++ = '!';
     }
@@ -16,6 +16,13 @@
 #ifndef KSEARCH_HH
 #define KSEARCH_HH 1
 #include "kpermuter.hh"
+#include <type_traits>
+#if __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#if __AVX2__
+#include <immintrin.h>
+#endif
 
 template <typename KA, typename T>
 struct key_comparator {
@@ -121,6 +128,115 @@ key_indexed_position key_find_lower_bound_by(const KA& ka, const T& n, F compara
 }
 
 
+/** @brief Return the ikey that @a ka searches for. */
+template <typename KA>
+inline auto key_search_ikey(const KA& ka) -> decltype(ka.ikey()) {
+    return ka.ikey();
+}
+template <typename I>
+inline typename std::enable_if<!std::is_class<I>::value, I>::type
+key_search_ikey(I ikey) {
+    return ikey;
+}
+
+/** @brief Return a bitmask of the elements of @a a[0, @a n) less than @a k.
+
+    Bit i of the result is set iff @a a[i] < @a k. The generic version is a
+    branch-free loop; the uint64_t version compares several ikeys per
+    instruction when the compiler targets SSE4.2 or AVX2. */
+template <typename I>
+inline unsigned key_less_mask(I k, const I* a, int n) {
+    unsigned m = 0;
+    for (int i = 0; i < n; ++i)
+        m |= unsigned(a[i] < k) << i;
+    return m;
+}
+
+inline unsigned key_less_mask(uint64_t k, const uint64_t* a, int n) {
+    unsigned m = 0;
+    int i = 0;
+#if __AVX2__
+    // AVX2 only has signed 64-bit compares, so flip the sign bits
+    const __m256i bias4 = _mm256_set1_epi64x(INT64_MIN);
+    __m256i k4 = _mm256_xor_si256(_mm256_set1_epi64x(k), bias4);
+    for (; i + 4 <= n; i += 4) {
+        __m256i a4 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i lt = _mm256_cmpgt_epi64(k4, _mm256_xor_si256(a4, bias4));
+        m |= unsigned(_mm256_movemask_pd(_mm256_castsi256_pd(lt))) << i;
+    }
+#endif
+#if __SSE4_2__
+    const __m128i bias2 = _mm_set1_epi64x(INT64_MIN);
+    __m128i k2 = _mm_xor_si128(_mm_set1_epi64x(k), bias2);
+    for (; i + 2 <= n; i += 2) {
+        __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i lt = _mm_cmpgt_epi64(k2, _mm_xor_si128(a2, bias2));
+        m |= unsigned(_mm_movemask_pd(_mm_castsi128_pd(lt))) << i;
+    }
+#endif
+    for (; i < n; ++i)
+        m |= unsigned(a[i] < k) << i;
+    return m;
+}
+
+template <typename P>
+inline int key_active_count(const P& perm, unsigned less_mask) {
+    unsigned active = 0;
+    for (int i = 0; i < perm.size(); ++i)
+        active |= 1U << perm[i];
+    return __builtin_popcount(less_mask & active);
+}
+inline int key_active_count(const identity_kpermuter&, unsigned less_mask) {
+    return __builtin_popcount(less_mask);
+}
+
+/** @brief Return the number of keys in @a n whose ikeys are less than
+    @a ka's ikey.
+
+    All ikey slots are compared at once; the permutation is consulted only
+    to discard unused slots. Since keys are sorted by ikey, the result is
+    the sorted position of the first key whose ikey is >= @a ka's. */
+template <typename KA, typename T>
+inline int key_simd_position(const KA& ka,
+                             const typename key_permuter<T>::type& perm,
+                             const T& n)
+{
+    int nslots = perm.width();
+    typedef typename std::decay<decltype(*n.ikeys())>::type ikey_type;
+    ikey_type k = key_search_ikey(ka);
+    unsigned m = key_less_mask(k, n.ikeys(), nslots);
+    return key_active_count(perm, m);
+}
+
+template <typename KA, typename T, typename F>
+int key_simd_upper_bound_by(const KA& ka, const T& n, F comparator)
+{
+    typename key_permuter<T>::type perm = key_permuter<T>::permutation(n);
+    int l = key_simd_position(ka, perm, n), r = perm.size();
+    // keys with equal ikeys are ordered by length; step past them
+    while (l < r && comparator(ka, n, perm[l]) >= 0)
+        ++l;
+    return l;
+}
+
+template <typename KA, typename T, typename F>
+key_indexed_position key_simd_lower_bound_by(const KA& ka, const T& n, F comparator)
+{
+    typename key_permuter<T>::type perm = key_permuter<T>::permutation(n);
+    int l = key_simd_position(ka, perm, n), r = perm.size();
+    while (l < r) {
+        int lp = perm[l];
+        int cmp = comparator(ka, n, lp);
+        if (cmp < 0)
+            break;
+        else if (cmp == 0)
+            return key_indexed_position(l, lp);
+        else
+            ++l;
+    }
+    return key_indexed_position(l, -1);
+}
+
 struct key_bound_binary {
     static constexpr bool is_binary = true;
     template <typename KA, typename T>
@@ -153,11 +269,28 @@ struct key_bound_linear {
     }
 };
 
+struct key_bound_simd {
+    static constexpr bool is_binary = false;
+    template <typename KA, typename T>
+    static inline int upper(const KA& ka, const T& n) {
+        return key_simd_upper_bound_by(ka, n, key_comparator<KA, T>());
+    }
+    template <typename KA, typename T>
+    static inline key_indexed_position lower(const KA& ka, const T& n) {
+        return key_simd_lower_bound_by(ka, n, key_comparator<KA, T>());
+    }
+    template <typename KA, typename T, typename F>
+    static inline key_indexed_position lower_by(const KA& ka, const T& n, F comparator) {
+        return key_simd_lower_bound_by(ka, n, comparator);
+    }
+};
+
 
 enum {
     bound_method_fast = 0,
     bound_method_binary,
-    bound_method_linear
+    bound_method_linear,
+    bound_method_simd
 };
 template <int max_size, int method = bound_method_fast> struct key_bound {};
 template <int max_size> struct key_bound<max_size, bound_method_binary> {
@@ -166,6 +299,10 @@ template <int max_size> struct key_bound<max_size, bound_method_binary> {
 template <int max_size> struct key_bound<max_size, bound_method_linear> {
     typedef key_bound_linear type;
 };
+template <int max_size> struct key_bound<max_size, bound_method_simd> {
+    static_assert(max_size <= 32, "too many keys for key_bound_simd");
+    typedef key_bound_simd type;
+};
 template <int max_size> struct key_bound<max_size, bound_method_fast> {
     typedef typename key_bound<max_size, (max_size > 16 ? bound_method_binary : bound_method_linear)>::type type;
 };
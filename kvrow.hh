@@ -35,6 +35,63 @@ typedef value_string row_type;
 typedef value_bag<uint16_t> row_type;
 #endif
 
+/** @brief Values stored inline in a leaf's value slot.
+
+    With MASSTREE_INLINE_VALUES, a one-column value of up to max_length
+    bytes is stored in the row pointer itself, saving the row allocation
+    and a dependent cache miss per get. Such a pointer has its low bit
+    set; the rest of its low byte is the value's length, and the higher
+    bytes hold the value. Inline values have no timestamp, so they are
+    only written when no log is kept. */
+template <typename R>
+class row_inline {
+  public:
+    static constexpr bool enabled = MASSTREE_INLINE_VALUES;
+    static constexpr int max_length = sizeof(R*) - 1;
+
+    static bool is_inline(const R* row) {
+        return enabled && (reinterpret_cast<uintptr_t>(row) & 1);
+    }
+    static bool fits(Str value, threadinfo& ti) {
+        return enabled && value.length() <= max_length && !ti.logger();
+    }
+    static bool is_marker(const R* row) {
+        return !is_inline(row) && row_is_marker(row);
+    }
+
+    static R* make(Str value) {
+        uintptr_t x = (uintptr_t(value.length()) << 1) | 1;
+        for (int i = 0; i != value.length(); ++i)
+            x |= uintptr_t((unsigned char) value[i]) << (8 * (i + 1));
+        return reinterpret_cast<R*>(x);
+    }
+    /** @brief Return the value of inline row @a row, copied into @a buf.
+        @pre @a buf has room for max_length bytes */
+    static Str value(const R* row, char* buf) {
+        uintptr_t x = reinterpret_cast<uintptr_t>(row);
+        int len = (x & 0xFF) >> 1;
+        for (int i = 0; i != len; ++i)
+            buf[i] = char(x >> (8 * (i + 1)));
+        return Str(buf, len);
+    }
+};
+
+template <typename R>
+class row_print {
+  public:
+    static void print(R* value, FILE* f, const char* prefix,
+                      int indent, Str key, kvtimestamp_t initial_timestamp,
+                      char* suffix) {
+        if (row_inline<R>::is_inline(value)) {
+            char buf[row_inline<R>::max_length];
+            Str v = row_inline<R>::value(value, buf);
+            fprintf(f, "%s%*s%.*s = %.*s (inline)%s\n", prefix, indent, "",
+                    key.len, key.s, v.len, v.s, suffix);
+        } else
+            value->print(f, prefix, indent, key, initial_timestamp, suffix);
+    }
+};
+
 template <typename R>
 struct query_helper {
     inline const R* snapshot(const R* row, const std::vector<typename R::index_type>&, threadinfo&) {
@@ -53,6 +110,9 @@ class query {
     void run_get(T& table, Json& req, threadinfo& ti);
     template <typename T>
     bool run_get1(T& table, Str key, int col, Str& value, threadinfo& ti);
+    template <typename T>
+    int run_multi_get1(T& table, const Str* keys, int n, int col,
+                       Str* values, bool* found, threadinfo& ti);
 
     template <typename T>
     result_t run_put(T& table, Str key,
@@ -60,6 +120,9 @@ class query {
     template <typename T>
     result_t run_replace(T& table, Str key, Str value, threadinfo& ti);
     template <typename T>
+    int run_replace_sorted(T& table, const Str* keys, const Str* values,
+                           int n, threadinfo& ti);
+    template <typename T>
     bool run_remove(T& table, Str key, threadinfo& ti);
 
     template <typename T>
@@ -75,6 +138,8 @@ class query {
 
   private:
     std::vector<typename R::index_type> f_;
+    std::vector<R*> rows_;
+    std::vector<char> inlinebuf_;
     loginfo::query_times qtimes_;
     query_helper<R> helper_;
     lcdf::String scankey_;
@@ -82,6 +147,10 @@ class query {
 
     void emit_fields(const R* value, Json& req, threadinfo& ti);
     void emit_fields1(const R* value, Json& req, threadinfo& ti);
+    void emit_inline_fields(const R* value, Json& req, bool one);
+    inline Str inline_col(const R* value, int col, int i);
+    inline bool inline_put(const Json* firstreq, const Json* lastreq,
+                           threadinfo& ti) const;
     void assign_timestamp(threadinfo& ti);
     void assign_timestamp(threadinfo& ti, kvtimestamp_t t);
     inline bool apply_put(R*& value, bool found, const Json* firstreq,
@@ -96,6 +165,8 @@ class query {
 
 template <typename R>
 void query<R>::emit_fields(const R* value, Json& req, threadinfo& ti) {
+    if (row_inline<R>::is_inline(value))
+        return emit_inline_fields(value, req, false);
     const R* snapshot = helper_.snapshot(value, f_, ti);
     if (f_.empty()) {
         for (int i = 0; i != snapshot->ncol(); ++i)
@@ -108,6 +179,8 @@ void query<R>::emit_fields(const R* value, Json& req, threadinfo& ti) {
 
 template <typename R>
 void query<R>::emit_fields1(const R* value, Json& req, threadinfo& ti) {
+    if (row_inline<R>::is_inline(value))
+        return emit_inline_fields(value, req, true);
     const R* snapshot = helper_.snapshot(value, f_, ti);
     if ((f_.empty() && snapshot->ncol() == 1) || f_.size() == 1)
         req = lcdf::String::make_stable(snapshot->col(f_.empty() ? 0 : f_[0]));
@@ -120,12 +193,38 @@ void query<R>::emit_fields1(const R* value, Json& req, threadinfo& ti) {
     }
 }
 
+template <typename R>
+void query<R>::emit_inline_fields(const R* value, Json& req, bool one) {
+    // The value lives in the leaf, so copy it out.
+    char buf[row_inline<R>::max_length];
+    Str v = row_inline<R>::value(value, buf);
+    if (f_.empty() && one)
+        req = lcdf::String(v);
+    else if (f_.empty())
+        req.push_back(lcdf::String(v));
+    else if (f_.size() == 1 && one)
+        req = lcdf::String(R::inline_col(v, f_[0]));
+    else {
+        for (int i = 0; i != (int) f_.size(); ++i)
+            req.push_back(lcdf::String(R::inline_col(v, f_[i])));
+    }
+}
+
+/** @brief Return column @a col of inline row @a value, copied into slot
+    @a i of this query's buffer.
+    @pre inlinebuf_ has room for @a i + 1 values */
+template <typename R>
+inline Str query<R>::inline_col(const R* value, int col, int i) {
+    char* buf = inlinebuf_.data() + i * row_inline<R>::max_length;
+    return R::inline_col(row_inline<R>::value(value, buf), col);
+}
+
 
 template <typename R> template <typename T>
 void query<R>::run_get(T& table, Json& req, threadinfo& ti) {
     typename T::unlocked_cursor_type lp(table, req[2].as_s());
     bool found = lp.find_unlocked(ti);
-    if (found && row_is_marker(lp.value()))
+    if (found && row_inline<R>::is_marker(lp.value()))
         found = false;
     if (found) {
         f_.clear();
@@ -141,13 +240,38 @@ template <typename R> template <typename T>
 bool query<R>::run_get1(T& table, Str key, int col, Str& value, threadinfo& ti) {
     typename T::unlocked_cursor_type lp(table, key);
     bool found = lp.find_unlocked(ti);
-    if (found && row_is_marker(lp.value()))
+    if (found && row_inline<R>::is_marker(lp.value()))
         found = false;
-    if (found)
+    if (found && row_inline<R>::is_inline(lp.value())) {
+        inlinebuf_.resize(row_inline<R>::max_length);
+        value = inline_col(lp.value(), col, 0);
+    } else if (found)
         value = lp.value()->col(col);
     return found;
 }
 
+template <typename R> template <typename T>
+int query<R>::run_multi_get1(T& table, const Str* keys, int n, int col,
+                             Str* values, bool* found, threadinfo& ti) {
+    rows_.resize(n);
+    table.multi_get(keys, n, rows_.data(), found, ti);
+    if (row_inline<R>::enabled)
+        inlinebuf_.resize(n * row_inline<R>::max_length);
+    int nfound = 0;
+    for (int i = 0; i != n; ++i) {
+        if (found[i] && row_inline<R>::is_marker(rows_[i]))
+            found[i] = false;
+        if (found[i]) {
+            if (row_inline<R>::is_inline(rows_[i]))
+                values[i] = inline_col(rows_[i], col, i);
+            else
+                values[i] = rows_[i]->col(col);
+            ++nfound;
+        }
+    }
+    return nfound;
+}
+
 
 template <typename R>
 inline void query<R>::assign_timestamp(threadinfo& ti) {
@@ -187,25 +311,49 @@ inline bool query<R>::apply_put(R*& value, bool found, const Json* firstreq,
     if (!found) {
     insert:
         assign_timestamp(ti);
-        value = R::create(firstreq, lastreq, qtimes_.ts, ti);
+        if (inline_put(firstreq, lastreq, ti))
+            value = row_inline<R>::make(firstreq[1].as_s());
+        else
+            value = R::create(firstreq, lastreq, qtimes_.ts, ti);
         return true;
     }
 
     R* old_value = value;
-    assign_timestamp(ti, old_value->timestamp());
+    if (row_inline<R>::is_inline(old_value)) {
+        assign_timestamp(ti);
+        if (inline_put(firstreq, lastreq, ti)) {
+            value = row_inline<R>::make(firstreq[1].as_s());
+            return false;
+        }
+        // The value outgrew its slot; promote it to a row.
+        char buf[row_inline<R>::max_length];
+        old_value = R::create1(row_inline<R>::value(old_value, buf),
+                               qtimes_.ts, ti);
+    } else
+        assign_timestamp(ti, old_value->timestamp());
     if (row_is_marker(old_value)) {
         old_value->deallocate_rcu(ti);
         goto insert;
     }
 
     R* updated = old_value->update(firstreq, lastreq, qtimes_.ts, ti);
-    if (updated != old_value) {
-        value = updated;
+    if (updated != old_value)
         old_value->deallocate_rcu_after_update(firstreq, lastreq, ti);
-    }
+    value = updated;
     return false;
 }
 
+/** @brief Return true iff a put of [@a firstreq, @a lastreq) sets only
+    column 0 to a value that can be stored inline. */
+template <typename R>
+inline bool query<R>::inline_put(const Json* firstreq, const Json* lastreq,
+                                 threadinfo& ti) const {
+    return row_inline<R>::enabled
+        && lastreq - firstreq == 2
+        && firstreq[0].as_i() == 0
+        && row_inline<R>::fits(firstreq[1].as_s(), ti);
+}
+
 template <typename R> template <typename T>
 result_t query<R>::run_replace(T& table, Str key, Str value, threadinfo& ti) {
     typename T::cursor_type lp(table, key);
@@ -218,6 +366,22 @@ result_t query<R>::run_replace(T& table, Str key, Str value, threadinfo& ti) {
     return inserted ? Inserted : Updated;
 }
 
+template <typename R> template <typename T>
+int query<R>::run_replace_sorted(T& table, const Str* keys, const Str* values,
+                                 int n, threadinfo& ti) {
+    struct replacer {
+        query<R>* q;
+        const Str* values;
+        void operator()(int i, typename T::cursor_type& lp, bool found,
+                        threadinfo& ti) {
+            if (!found)
+                ti.observe_phantoms(lp.node());
+            q->apply_replace(lp.value(), found, values[i], ti);
+        }
+    } f = {this, values};
+    return table.insert_sorted(keys, n, f, ti);
+}
+
 template <typename R>
 inline bool query<R>::apply_replace(R*& value, bool found, Str new_value,
                                     threadinfo& ti) {
@@ -226,15 +390,18 @@ inline bool query<R>::apply_replace(R*& value, bool found, Str new_value,
         qtimes_.epoch = global_log_epoch;
     }
 
-    bool inserted = !found || row_is_marker(value);
-    if (!found) {
+    bool inserted = !found || row_inline<R>::is_marker(value);
+    if (!found || row_inline<R>::is_inline(value)) {
         assign_timestamp(ti);
     } else {
         assign_timestamp(ti, value->timestamp());
         value->deallocate_rcu(ti);
     }
 
-    value = R::create1(new_value, qtimes_.ts, ti);
+    if (row_inline<R>::fits(new_value, ti))
+        value = row_inline<R>::make(new_value);
+    else
+        value = R::create1(new_value, qtimes_.ts, ti);
     return inserted;
 }
 
@@ -257,11 +424,16 @@ inline void query<R>::apply_remove(R*& value, kvtimestamp_t& node_ts,
     }
 
     R* old_value = value;
-    assign_timestamp(ti, old_value->timestamp());
+    if (row_inline<R>::is_inline(old_value)) {
+        assign_timestamp(ti);
+        old_value = nullptr;
+    } else
+        assign_timestamp(ti, old_value->timestamp());
     if (circular_int<kvtimestamp_t>::less_equal(node_ts, qtimes_.ts)) {
         node_ts = qtimes_.ts + 2;
     }
-    old_value->deallocate_rcu(ti);
+    if (old_value)
+        old_value->deallocate_rcu(ti);
 }
 
 
@@ -286,7 +458,7 @@ class query_json_scanner {
         }
     }
     bool visit_value(Str key, R* value, threadinfo& ti) {
-        if (row_is_marker(value)) {
+        if (row_inline<R>::is_marker(value)) {
             return true;
         }
         // NB the `key` is not stable! We must save space for it.
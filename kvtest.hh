@@ -111,17 +111,10 @@ unsigned kvtest_rw1puts_seed(C& client, int seed) {
     return n;
 }
 
-// do a bunch of inserts to distinct keys, then check that they all showed up.
-// sometimes overwrites, but only w/ same value.
-// different clients might use same key sometimes.
+// return the keys put by kvtest_rw1puts_seed(client, seed), shuffled.
 template <typename C>
-void kvtest_rw1_seed(C &client, int seed)
-{
-    unsigned n = kvtest_rw1puts_seed(client, seed);
-
-    client.notice("now getting\n");
-    int32_t *a = (int32_t *) malloc(sizeof(int32_t) * n);
-    assert(a);
+std::vector<int32_t> kvtest_rw1keys_seed(C& client, int seed, unsigned n) {
+    std::vector<int32_t> a(n);
     client.rand.seed(seed);
     for (unsigned i = 0; i < n; ++i) {
         a[i] = (int32_t) client.rand();
@@ -130,33 +123,53 @@ void kvtest_rw1_seed(C &client, int seed)
     for (unsigned i = 0; i < n; ++i) {
         std::swap(a[i], a[swapd(client.rand)]);
     }
+    return a;
+}
 
+// get and check the keys @a a, in batches of @a batch keys if @a batch > 0.
+// Returns the number of gets done and sets @a delta_t to their duration.
+template <typename C>
+unsigned kvtest_rw1gets(C& client, const std::vector<int32_t>& a, int batch,
+                        double& delta_t) {
+    unsigned n = a.size();
     double tg0 = client.now();
-    unsigned g;
-#if 0
-#define BATCH 8
-    for(g = 0; g+BATCH < n && !client.timeout(1); g += BATCH){
-      long key[BATCH], expected[BATCH];
-      for(int i = 0; i < BATCH; i++){
-        key[i] = a[g+i];
-        expected[i] = a[g+i] + 1;
-      }
-      client.many_get_check(BATCH, key, expected);
+    unsigned g = 0;
+    if (batch > 0) {
+        std::vector<long> key(batch), expected(batch);
+        for (; g + batch <= n && !client.timeout(1); g += batch) {
+            for (int i = 0; i < batch; ++i) {
+                key[i] = a[g + i];
+                expected[i] = a[g + i] + 1;
+            }
+            client.many_get_check(batch, key.data(), expected.data());
+        }
     }
-#else
-    for (g = 0; g < n && !client.timeout(1); ++g) {
+    for (; g < n && !client.timeout(1); ++g) {
         client.get_check(a[g], a[g] + 1);
     }
-#endif
     client.wait_all();
-    double tg1 = client.now();
+    delta_t = client.now() - tg0;
+    return g;
+}
+
+// do a bunch of inserts to distinct keys, then check that they all showed up.
+// sometimes overwrites, but only w/ same value.
+// different clients might use same key sometimes.
+template <typename C>
+void kvtest_rw1_seed(C &client, int seed, int batch = 0)
+{
+    unsigned n = kvtest_rw1puts_seed(client, seed);
+
+    client.notice("now getting\n");
+    std::vector<int32_t> a = kvtest_rw1keys_seed(client, seed, n);
+    double delta_gets;
+    unsigned g = kvtest_rw1gets(client, a, batch, delta_gets);
 
     Json result = client.report(Json());
-    kvtest_set_time(result, "gets", g, tg1 - tg0);
+    kvtest_set_time(result, "gets", g, delta_gets);
     double delta_puts = n / result["puts_per_sec"].as_d();
-    kvtest_set_time(result, "ops", n + g, delta_puts + (tg1 - tg0));
+    kvtest_set_time(result, "ops", n + g, delta_puts + delta_gets);
     client.report(result);
-    free(a);
 }
 
 template <typename C>
@@ -171,6 +184,158 @@ void kvtest_rw1(C &client)
     kvtest_rw1_seed(client, kvtest_first_seed + client.id() % 48);
 }
 
+// like rw1, but gets are issued in batches of `batch` keys.
+template <typename C>
+void kvtest_rw1mget(C &client)
+{
+    kvtest_rw1_seed(client, kvtest_first_seed + client.id() % 48,
+                    client.param("batch", 16).as_i());
+}
+
+// like rw1, but gets are timed alone and, where the platform can count
+// them, hardware cache misses per get are reported. Use a large -l to
+// compare leaf layouts on a tree bigger than the last-level cache.
+template <typename C>
+void kvtest_rw1miss(C &client)
+{
+    int seed = kvtest_first_seed + client.id() % 48;
+    unsigned n = kvtest_rw1puts_seed(client, seed);
+
+    client.notice("now getting\n");
+    std::vector<int32_t> a = kvtest_rw1keys_seed(client, seed, n);
+    client.start_cache_misses();
+    double delta_gets;
+    unsigned g = kvtest_rw1gets(client, a, 0, delta_gets);
+    int64_t misses = client.cache_misses();
+
+    Json result = Json();
+    kvtest_set_time(result, "gets", g, delta_gets);
+    if (misses >= 0 && g)
+        result.set("cache_misses_per_get", double(misses) / g);
+    client.report(result);
+}
+
+// append increasing keys one put at a time, as a time-series or
+// auto-increment table would, then read them back in order.
+template <typename C>
+void kvtest_wappend(C &client)
+{
+    long base = (long) client.id() << 40;
+
+    double tp0 = client.now();
+    long n;
+    for (n = 0; !client.timeout(0) && n <= (long) client.limit(); ++n) {
+        quick_istr k(base + n, 16);
+        client.put(k.string(), base + n + 1);
+    }
+    client.wait_all();
+    double tp1 = client.now();
+    client.puts_done();
+    client.notice("now getting\n");
+
+    long g;
+    for (g = 0; g < n && !client.timeout(1); ++g) {
+        quick_istr k(base + g, 16);
+        client.get_check(k.string(), base + g + 1);
+    }
+    client.wait_all();
+    double tg1 = client.now();
+
+    Json result = Json();
+    kvtest_set_time(result, "puts", n, tp1 - tp0);
+    kvtest_set_time(result, "gets", g, tg1 - tp1);
+    client.report(result);
+}
+
+// put 8-byte big-endian IDs in increasing order, as a time-ordered ID
+// table would, rebuild the table's leaf model, then get the IDs in random
+// order. Compare builds with and without --enable-leaf-model.
+template <typename C>
+void kvtest_rwmodel(C &client)
+{
+    uint64_t base = (uint64_t) client.id() << 40;
+    uint64_t x;
+
+    double tp0 = client.now();
+    long n;
+    for (n = 0; !client.timeout(0) && n <= (long) client.limit(); ++n) {
+        x = host_to_net_order(base + n);
+        client.put(Str((const char*) &x, 8), base + n + 1);
+    }
+    client.wait_all();
+    double tp1 = client.now();
+    client.puts_done();
+    client.build_model();
+    client.notice("now getting\n");
+
+    std::vector<long> a(n);
+    for (long i = 0; i < n; ++i)
+        a[i] = i;
+    kvrandom_uniform_int_distribution<long> swapd(0, n - 1);
+    for (long i = 0; i < n; ++i)
+        std::swap(a[i], a[swapd(client.rand)]);
+
+    double tg0 = client.now();
+    long g;
+    for (g = 0; g < n && !client.timeout(1); ++g) {
+        x = host_to_net_order(base + a[g]);
+        client.get_check(Str((const char*) &x, 8), base + a[g] + 1);
+    }
+    client.wait_all();
+    double tg1 = client.now();
+
+    Json result = Json();
+    kvtest_set_time(result, "puts", n, tp1 - tp0);
+    kvtest_set_time(result, "gets", g, tg1 - tg0);
+    client.report(result);
+}
+
+// insert sorted batches of `batch` keys: first the even keys, then all keys
+// (so half the second pass are updates). then check that they all showed up.
+template <typename C>
+void kvtest_wsorted(C &client)
+{
+    int batch = client.param("batch", 1000).as_i();
+    long base = (long) client.id() << 40;
+    std::vector<long> key(batch), value(batch);
+
+    double tp0 = client.now();
+    unsigned long n, nputs = 0;
+    for (n = 0; !client.timeout(0) && n <= client.limit(); n += batch) {
+        for (int i = 0; i < batch; ++i) {
+            key[i] = base + 2 * (n + i);
+            value[i] = key[i] + 1;
+        }
+        client.put_sorted_key16(batch, key.data(), value.data());
+        nputs += batch;
+    }
+    n *= 2;
+    for (unsigned long g = 0; g < n; g += batch) {
+        for (int i = 0; i < batch; ++i) {
+            key[i] = base + g + i;
+            value[i] = key[i] + 1;
+        }
+        client.put_sorted_key16(batch, key.data(), value.data());
+        nputs += batch;
+    }
+    client.wait_all();
+    double tp1 = client.now();
+    client.puts_done();
+
+    unsigned long g;
+    for (g = 0; g < n && !client.timeout(1); ++g) {
+        quick_istr k(base + g, 16);
+        client.get_check(k.string(), base + g + 1);
+    }
+    client.wait_all();
+    double tg1 = client.now();
+
+    Json result = Json();
+    kvtest_set_time(result, "puts", nputs, tp1 - tp0);
+    kvtest_set_time(result, "gets", g, tg1 - tp1);
+    client.report(result);
+}
+
 // do a bunch of inserts to distinct keys, then check that they all showed up.
 // sometimes overwrites, but only w/ same value.
 // different clients might use same key sometimes.
@@ -232,6 +397,57 @@ void kvtest_rw1long(C &client)
     kvtest_rw1long_seed(client, kvtest_first_seed + client.id() % 48);
 }
 
+// key length sweep. for each length, put `n` keys that share all but
+// their last 10 bytes, get them in a different order, then remove them.
+// reports puts_LEN and gets_LEN rates for each length.
+template <typename C>
+void kvtest_keylen(C &client)
+{
+    static const int lengths[] = {16, 24, 32, 48, 64, 96, 128};
+    const unsigned c = 2654435761U;
+    unsigned n = std::min(client.limit(), (uint64_t) client.param("n", 200000).as_i());
+    char buf[129];
+    Json result = Json();
+    unsigned long nputs = 0, ngets = 0;
+    double tputs = 0, tgets = 0;
+
+    for (size_t li = 0; li != arraysize(lengths); ++li) {
+        int len = std::min(lengths[li], MASSTREE_MAXKEYLEN);
+        memset(buf, '/', len);
+        sprintf(buf, "k%03d", client.id() % 1000);
+        buf[4] = '/';
+        auto make_key = [&](unsigned i) {
+            sprintf(buf + len - 10, "%010u", i * c);
+            return Str(buf, len);
+        };
+
+        double t0 = client.now();
+        for (unsigned i = 0; i != n; ++i)
+            client.put(make_key(i), i + 1);
+        client.wait_all();
+        double t1 = client.now();
+        for (unsigned i = 0; i != n; ++i) {
+            unsigned j = (uint64_t) i * 7919 % n;
+            client.get_check(make_key(j), j + 1);
+        }
+        client.wait_all();
+        double t2 = client.now();
+        for (unsigned i = 0; i != n; ++i)
+            client.remove(make_key(i));
+        client.wait_all();
+
+        kvtest_set_time(result, String("puts_") + String(len), n, t1 - t0);
+        kvtest_set_time(result, String("gets_") + String(len), n, t2 - t1);
+        nputs += n;
+        ngets += n;
+        tputs += t1 - t0;
+        tgets += t2 - t1;
+    }
+    kvtest_set_time(result, "puts", nputs, tputs);
+    kvtest_set_time(result, "gets", ngets, tgets);
+    client.report(result);
+}
+
 // interleave inserts and gets for random keys.
 template <typename C>
 void kvtest_rw2_seed(C &client, int seed, double getfrac)
@@ -18,13 +18,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <new>
+#include <vector>
 #include <sys/mman.h>
+#if HAVE_NUMA_H && HAVE_LIBNUMA
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+#endif
 #if HAVE_SUPERPAGE && !NOSUPERPAGE
 #include <sys/types.h>
 #include <dirent.h>
 #endif
 
 threadinfo *threadinfo::allthreads;
+char* compact_region::base_;
+size_t compact_region::size_;
+// Offset 0 means null, so the first chunk is never handed out.
+size_t compact_region::allocated_ = compact_region::chunk_size;
+static pthread_once_t compact_region_once = PTHREAD_ONCE_INIT;
+std::atomic<uintptr_t> pool_depot::heads_[pool_depot::max_nodes][2 * pool_depot::nclasses];
+std::atomic<size_t> pool_depot::chunks_[pool_depot::max_nodes];
+std::atomic<size_t> pool_depot::bytes_[2 * pool_depot::nclasses];
+std::atomic<size_t> pool_depot::carved_[2 * pool_depot::nclasses];
+std::atomic<unsigned> pool_depot::flush_generation_;
+size_t threadinfo::pool_retention = 64 << 20;
+int threadinfo::numa_nodes_;
+threadinfo* threadinfo::reclaimer_;
+static std::atomic<limbo_group*> reclaim_queue; // handed off, not yet adopted
+static limbo_group* reclaim_pending;            // adopted by the reclaimer
+static pthread_mutex_t pool_trim_mu = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<std::pair<void*, int> > released_chunks[2]; // chunk, node
 #if ENABLE_ASSERTIONS
 int threadinfo::no_pool_value;
 #endif
@@ -37,13 +60,23 @@ inline threadinfo::threadinfo(int purpose, int index) {
     index_ = index;
 
     for (size_t i = 0; i != sizeof(pool_) / sizeof(pool_[0]); ++i) {
-        pool_[i] = nullptr;
+        pool_[i] = compact_pool_[i] = nullptr;
+        pool_count_[i] = compact_pool_count_[i] = 0;
     }
+    sequential_[0] = sequential_[1] = nullptr;
+    compact_sequential_[0] = compact_sequential_[1] = nullptr;
+    flush_generation_ = pool_depot::flush_generation();
+    numa_node_ = -1;
 
     void *limbo_space = allocate(sizeof(limbo_group), memtag_limbo);
     mark(tc_limbo_slots, limbo_group::capacity);
     limbo_head_ = limbo_tail_ = new(limbo_space) limbo_group;
+    limbo_returned_.store(nullptr, std::memory_order_relaxed);
     ts_ = 2;
+    for (int i = 0; i != nfingers; ++i) {
+        fingers_[i].root = fingers_[i].node = nullptr;
+        fingers_[i].epoch = 0;
+    }
 
     for (size_t i = 0; i != sizeof(counters_) / sizeof(counters_[0]); ++i) {
         counters_[i] = 0;
@@ -53,22 +86,60 @@ inline threadinfo::threadinfo(int purpose, int index) {
 threadinfo *threadinfo::make(int purpose, int index) {
     static int threads_initialized;
 
-    threadinfo* ti = new(malloc(8192)) threadinfo(purpose, index);
-    ti->next_ = allthreads;
-    allthreads = ti;
-
+    // Before any allocation: NUMA support changes where values live.
     if (!threads_initialized) {
 #if ENABLE_ASSERTIONS
         const char* s = getenv("_");
         no_pool_value = s && strstr(s, "valgrind") != 0;
+#endif
+#if HAVE_NUMA_H && HAVE_LIBNUMA
+        if (numa_available() != -1
+            && numa_max_node() < pool_depot::max_nodes)
+            numa_nodes_ = numa_max_node() + 1;
 #endif
         threads_initialized = 1;
     }
 
+    threadinfo* ti = new(malloc(8192)) threadinfo(purpose, index);
+    ti->next_ = allthreads;
+    allthreads = ti;
+    if (purpose == TI_RECLAIM) {
+        assert(!reclaimer_);
+        reclaimer_ = ti;
+    }
     return ti;
 }
 
+int threadinfo::detect_numa_node() {
+#if HAVE_NUMA_H && HAVE_LIBNUMA
+    if (numa_nodes_) {
+        int cpu = sched_getcpu();
+        int node = cpu >= 0 ? numa_node_of_cpu(cpu) : -1;
+        if (node >= 0 && node < numa_nodes_)
+            return node;
+    }
+#endif
+    return 0;
+}
+
+/** @brief Ask that the pages of pool chunk @a p come from NUMA node @a node. */
+static void bind_pool_chunk(void* p, size_t size, int node) {
+#if HAVE_NUMA_H && HAVE_LIBNUMA
+    if (threadinfo::numa_nodes() > 1) {
+        unsigned long mask = 1UL << node;
+        if (mbind(p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0)
+            perror("mbind");
+    }
+#else
+    (void) p, (void) size, (void) node;
+#endif
+}
+
 void threadinfo::refill_rcu() {
+    if (reclaimer_ && reclaimer_ != this && limbo_head_ == limbo_tail_) {
+        hand_off_limbo();
+        return;
+    }
     if (!limbo_tail_->next_) {
         void *limbo_space = allocate(sizeof(limbo_group), memtag_limbo);
         mark(tc_limbo_slots, limbo_group::capacity);
@@ -78,6 +149,32 @@ void threadinfo::refill_rcu() {
     assert(limbo_tail_->head_ == 0 && limbo_tail_->tail_ == 0);
 }
 
+/** @brief Pass the current limbo group to the reclaimer and start a
+    new one.
+
+    The new group is a spare from this thread's list, one the reclaimer
+    has emptied and returned, or a fresh allocation, in that order.
+    @pre limbo_head_ == limbo_tail_ */
+void threadinfo::hand_off_limbo() {
+    assert(limbo_head_ == limbo_tail_);
+    limbo_group* g = limbo_tail_;
+    limbo_group* next = g->next_;
+    if (!next)
+        next = limbo_returned_.exchange(nullptr, std::memory_order_acquire);
+    if (!next) {
+        void *limbo_space = allocate(sizeof(limbo_group), memtag_limbo);
+        mark(tc_limbo_slots, limbo_group::capacity);
+        next = new(limbo_space) limbo_group;
+    }
+    g->owner_ = this;
+    g->next_ = reclaim_queue.load(std::memory_order_relaxed);
+    while (!reclaim_queue.compare_exchange_weak(g->next_, g,
+                                                std::memory_order_release,
+                                                std::memory_order_relaxed))
+        /* retry */;
+    limbo_head_ = limbo_tail_ = next;
+}
+
 inline unsigned limbo_group::clean_until(threadinfo& ti, mrcu_epoch_type epoch_bound,
                                          unsigned count) {
     epoch_type epoch = 0;
@@ -104,11 +201,23 @@ inline unsigned limbo_group::clean_until(threadinfo& ti, mrcu_epoch_type epoch_b
 }
 
 void threadinfo::hard_rcu_quiesce() {
+    if (flush_generation_ != pool_depot::flush_generation())
+        flush_pools();
+
     limbo_group* empty_head = nullptr;
     limbo_group* empty_tail = nullptr;
     unsigned count = rcu_free_count;
 
     mrcu_epoch_type epoch_bound = active_epoch.load() - 1;
+    // With a reclaimer, do O(1) work: hand over the limbo group once
+    // its oldest objects can be freed. An older backlog of groups is
+    // still cleaned here.
+    if (reclaimer_ && reclaimer_ != this && limbo_head_ == limbo_tail_) {
+        if (limbo_head_->head_ != limbo_head_->tail_
+            && mrcu_signed_epoch_type(epoch_bound - limbo_head_->first_epoch()) >= 0)
+            hand_off_limbo();
+        goto done;
+    }
     if (limbo_head_->head_ == limbo_head_->tail_
         || mrcu_signed_epoch_type(epoch_bound - limbo_head_->first_epoch()) < 0)
         goto done;
@@ -140,6 +249,43 @@ done:
         perform_gc_epoch_ = epoch_bound + 1;
 }
 
+/** @brief Free limbo objects that other threads handed off.
+
+    Call from the reclaimer() thread, between rcu_start() and rcu_stop().
+    Frees every handed-off object that active_epoch allows and returns
+    each emptied limbo group to the thread that filled it. Freed pool
+    nodes collect on this thread's free lists, which pass them back to
+    the allocating threads through the pool_depot in batches. Returns
+    the number of objects freed. */
+size_t threadinfo::reclaim_limbo() {
+    assert(this == reclaimer_);
+    limbo_group* g = reclaim_queue.exchange(nullptr, std::memory_order_acquire);
+    while (g) {
+        limbo_group* next = g->next_;
+        g->next_ = reclaim_pending;
+        reclaim_pending = g;
+        g = next;
+    }
+
+    size_t n = 0;
+    mrcu_epoch_type epoch_bound = active_epoch.load() - 1;
+    limbo_group** pprev = &reclaim_pending;
+    while ((g = *pprev)) {
+        n += ~0U - g->clean_until(*this, epoch_bound, ~0U);
+        if (g->head_ == g->tail_) {
+            *pprev = g->next_;
+            std::atomic<limbo_group*>& returned = g->owner_->limbo_returned_;
+            g->next_ = returned.load(std::memory_order_relaxed);
+            while (!returned.compare_exchange_weak(g->next_, g,
+                                                   std::memory_order_release,
+                                                   std::memory_order_relaxed))
+                /* retry */;
+        } else
+            pprev = &g->next_;
+    }
+    return n;
+}
+
 void threadinfo::report_rcu(void *ptr) const
 {
     for (limbo_group *lg = limbo_head_; lg; lg = lg->next_) {
@@ -199,56 +345,310 @@ static void initialize_pool(void* pool, size_t sz, size_t unit) {
     *nextptr = 0;
 }
 
-void threadinfo::refill_pool(int nl) {
-    assert(!pool_[nl - 1]);
+void compact_region::reserve() {
+    // Reserve address space only; chunks are committed as they are
+    // handed out. Fall back to smaller regions where the address space
+    // is limited.
+    for (size_t sz = max_size; sz >= (size_t(1) << 30); sz >>= 1) {
+        void* p = mmap(0, sz + chunk_size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            uintptr_t x = reinterpret_cast<uintptr_t>(p);
+            base_ = reinterpret_cast<char*>((x + chunk_size - 1) & ~(chunk_size - 1));
+            size_ = sz;
+            return;
+        }
+    }
+    perror("mmap compact region");
+}
 
-    if (!use_pool()) {
-        pool_[nl - 1] = malloc(nl * CACHE_LINE_SIZE);
-        if (pool_[nl - 1])
-            *reinterpret_cast<void**>(pool_[nl - 1]) = 0;
-        return;
+void* compact_region::allocate_chunk() {
+    pthread_once(&compact_region_once, reserve);
+    size_t off = fetch_and_add(&allocated_, size_t(chunk_size));
+    if (!base_ || off + chunk_size > size_)
+        return nullptr;
+    char* p = base_ + off;
+    if (mprotect(p, chunk_size, PROT_READ | PROT_WRITE) != 0) {
+        perror("mprotect compact region");
+        return nullptr;
     }
+#if HAVE_SUPERPAGE && !NOSUPERPAGE && MADV_HUGEPAGE
+    madvise(p, chunk_size, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+/** @brief Return a new chunk of pool memory, setting @a size to its size.
 
+    The result follows the chunk's pool_chunk header, and its pages come
+    from NUMA node @a node where possible. Chunks released by
+    trim_pools() are reused before new memory is allocated, preferably
+    ones from @a node.
+    @pre @a compact || use_pool() */
+void* threadinfo::allocate_pool_chunk(bool compact, int node, size_t& size) {
+    static_assert(compact_region::chunk_size == pool_chunk_size,
+                  "compact chunks must be pool chunks");
     void* pool = 0;
-    size_t pool_size = 0;
-    int r;
+    pthread_mutex_lock(&pool_trim_mu);
+    auto& released = released_chunks[compact];
+    if (!released.empty()) {
+        auto it = released.end() - 1;
+        for (auto jt = released.begin(); jt != released.end(); ++jt)
+            if (jt->second == node) {
+                it = jt;
+                break;
+            }
+        pool = it->first;
+        if (it->second != node)
+            bind_pool_chunk(pool, pool_chunk_size, node);
+        *it = released.back();
+        released.pop_back();
+    }
+    pthread_mutex_unlock(&pool_trim_mu);
 
+    if (!pool && compact) {
+        pool = compact_region::allocate_chunk();
+        if (!pool) {
+            fprintf(stderr, "compact region exhausted\n");
+            abort();
+        }
+        bind_pool_chunk(pool, pool_chunk_size, node);
+        pool_depot::note_chunk(node);
+    } else if (!pool) {
+        int r;
+        if ((r = posix_memalign(&pool, pool_chunk_size, pool_chunk_size)) != 0) {
+            fprintf(stderr, "posix_memalign: %s\n", strerror(r));
+            abort();
+        }
 #if HAVE_SUPERPAGE && !NOSUPERPAGE
-    if (!superpage_size)
-        superpage_size = read_superpage_size();
-    if (superpage_size != (size_t) -1) {
-        pool_size = superpage_size;
+        // Superpages back pool chunks only if they are the same size.
+        if (!superpage_size)
+            superpage_size = read_superpage_size();
 # if MADV_HUGEPAGE
-        if ((r = posix_memalign(&pool, pool_size, pool_size)) != 0) {
-            fprintf(stderr, "posix_memalign superpage: %s\n", strerror(r));
-            pool = 0;
-            superpage_size = (size_t) -1;
-        } else if (madvise(pool, pool_size, MADV_HUGEPAGE) != 0) {
+        if (superpage_size == pool_chunk_size
+            && madvise(pool, pool_chunk_size, MADV_HUGEPAGE) != 0) {
             perror("madvise superpage");
             superpage_size = (size_t) -1;
         }
-# elif MAP_HUGETLB
-        pool = mmap(0, pool_size, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
-        if (pool == MAP_FAILED) {
-            perror("mmap superpage");
-            pool = 0;
-            superpage_size = (size_t) -1;
-        }
-# else
-        superpage_size = (size_t) -1;
 # endif
-    }
 #endif
+        bind_pool_chunk(pool, pool_chunk_size, node);
+        pool_depot::note_chunk(node);
+    }
 
-    if (!pool) {
-        pool_size = 2 << 20;
-        if ((r = posix_memalign(&pool, CACHE_LINE_SIZE, pool_size)) != 0) {
-            fprintf(stderr, "posix_memalign: %s\n", strerror(r));
-            abort();
+    pool_chunk* pc = reinterpret_cast<pool_chunk*>(pool);
+    pc->carved = (size_t) -1;
+    pc->found = 0;
+    pc->node = node;
+    size = pool_chunk_size - CACHE_LINE_SIZE;
+    return reinterpret_cast<char*>(pool) + CACHE_LINE_SIZE;
+}
+
+void threadinfo::refill_pool(int c, bool compact) {
+    int pooltag = (compact ? memtag_pool_compact : 0) + c;
+    size_t unit = pool_depot::unit(pooltag);
+    assert(!pool_head(pooltag));
+
+    if (!compact && !use_pool()) {
+        pool_[c - 1] = malloc(unit);
+        if (pool_[c - 1])
+            *reinterpret_cast<void**>(pool_[c - 1]) = 0;
+        pool_count_[c - 1] = 1;
+        return;
+    }
+
+    unsigned n;
+    if (void* pool = pool_depot::take(home_node(), pooltag, n)) {
+        pool_head(pooltag) = pool;
+        pool_count(pooltag) = n;
+        return;
+    }
+
+    // Keep the first batch of a new chunk and share the rest.
+    size_t pool_size;
+    char* pool = reinterpret_cast<char*>(allocate_pool_chunk(compact, home_node(), pool_size));
+    size_t batch = pool_depot::batch_size(pooltag) * unit;
+    pool_size -= pool_size % unit;
+    chunk_of(pool)->carved = pool_size;
+    pool_depot::note_carved(pooltag, pool_size);
+    size_t first = std::min(batch, pool_size);
+    for (size_t off = first; off < pool_size; off += batch) {
+        size_t sz = std::min(batch, pool_size - off);
+        initialize_pool(pool + off, sz, unit);
+        pool_depot::put(home_node(), pooltag, pool + off, sz / unit);
+    }
+    initialize_pool(pool, first, unit);
+    pool_head(pooltag) = pool;
+    pool_count(pooltag) = first / unit;
+}
+
+/** @brief Return surplus nodes from the @a pooltag free list to the
+    pool_depot.
+
+    Called when the list passes pool_depot::high_water(). The most
+    recently freed batch, which is likeliest to be cached, stays here;
+    the batch after it goes to the depot. */
+void threadinfo::release_pool(int pooltag) {
+    unsigned bn = pool_depot::batch_size(pooltag);
+    void** keep = reinterpret_cast<void**>(pool_head(pooltag));
+    for (unsigned i = 1; i != bn; ++i)
+        keep = reinterpret_cast<void**>(*keep);
+    void** give = reinterpret_cast<void**>(*keep);
+    void** last = give;
+    for (unsigned i = 1; i != bn; ++i)
+        last = reinterpret_cast<void**>(*last);
+    *keep = *last;
+    *last = nullptr;
+    pool_depot::put(chunk_of(give)->node, pooltag, give, bn);
+    pool_count(pooltag) -= bn;
+}
+
+void threadinfo::flush_pools() {
+    flush_generation_ = pool_depot::flush_generation();
+    for (int compact = 0; compact != 2; ++compact)
+        for (int c = 1; c <= pool_nclasses; ++c) {
+            int pooltag = (compact ? memtag_pool_compact : 0) + c;
+            if (pool_count(pooltag)) {
+                pool_depot::put(chunk_of(pool_head(pooltag))->node, pooltag,
+                                pool_head(pooltag), pool_count(pooltag));
+                pool_head(pooltag) = nullptr;
+                pool_count(pooltag) = 0;
+            }
+        }
+}
+
+/** @brief Release pool chunks whose nodes are all free.
+
+    Takes every batch from the pool_depot, finds the chunks all of whose
+    carved bytes are in hand, and returns all but pool_retention bytes
+    of free memory to the operating system with MADV_DONTNEED. The
+    chunks stay mapped and are reused by later refills. Nodes still on
+    other threads' free lists keep their chunks; this asks those threads
+    to flush, so a later call can release more. Returns the number of
+    bytes released. Any thread may call trim_pools(). */
+size_t threadinfo::trim_pools() {
+    if (pool_depot::free_bytes() <= pool_retention)
+        return 0;
+    pthread_mutex_lock(&pool_trim_mu);
+    pool_depot::request_flush();
+
+    struct taken {
+        void* head;
+        int pooltag;
+    };
+    std::vector<taken> batches;
+    size_t in_hand = 0;
+    for (int node = 0; node < std::max(numa_nodes_, 1); ++node)
+        for (int compact = !use_pool(); compact != 2; ++compact)
+            for (int c = 1; c <= pool_nclasses; ++c) {
+                int pooltag = (compact ? memtag_pool_compact : 0) + c;
+                size_t unit = pool_depot::unit(pooltag);
+                unsigned n;
+                while (void* b = pool_depot::take(node, pooltag, n)) {
+                    batches.push_back(taken{b, pooltag});
+                    for (void* p = b; p; p = *reinterpret_cast<void**>(p))
+                        chunk_of(p)->found += unit;
+                    in_hand += n * unit;
+                }
+            }
+
+    // Choose chunks to release, marking them with found == -1.
+    std::vector<pool_chunk*> release[2];
+    size_t released = 0;
+    for (auto& t : batches)
+        for (void* p = t.head; p; p = *reinterpret_cast<void**>(p)) {
+            pool_chunk* pc = chunk_of(p);
+            if (pc->found == pc->carved
+                && in_hand - released - pc->carved >= pool_retention) {
+                release[bool(t.pooltag & memtag_pool_compact)].push_back(pc);
+                released += pc->carved;
+                pc->found = (size_t) -1;
+            }
         }
+
+    // Return the other nodes to the depot.
+    for (auto& t : batches) {
+        void* head = nullptr;
+        void** tail = &head;
+        unsigned n = 0, dropped = 0;
+        for (void* p = t.head; p; p = *reinterpret_cast<void**>(p)) {
+            pool_chunk* pc = chunk_of(p);
+            if (pc->found != (size_t) -1) {
+                pc->found = 0;
+                *tail = p;
+                tail = reinterpret_cast<void**>(p);
+                ++n;
+            } else
+                ++dropped;
+        }
+        *tail = nullptr;
+        if (dropped)
+            pool_depot::note_carved(t.pooltag, -ptrdiff_t(dropped * pool_depot::unit(t.pooltag)));
+        if (n)
+            pool_depot::put(chunk_of(head)->node, t.pooltag, head, n);
     }
 
-    initialize_pool(pool, pool_size, nl * CACHE_LINE_SIZE);
-    pool_[nl - 1] = pool;
+    for (int compact = 0; compact != 2; ++compact)
+        for (pool_chunk* pc : release[compact]) {
+            int node = pc->node;
+            if (madvise(pc, pool_chunk_size, MADV_DONTNEED) != 0)
+                perror("madvise");
+            released_chunks[compact].push_back(std::make_pair(pc, node));
+        }
+    pthread_mutex_unlock(&pool_trim_mu);
+    return released;
+}
+
+/** @brief Return the number of free bytes in pool @a pooltag.
+
+    Counts the pool_depot's batches and every thread's free list. The
+    lists are read without synchronization, so the result is only
+    approximate while other threads run. Together with
+    pool_depot::carved_bytes() this gives a pool's occupancy. */
+size_t threadinfo::pool_free_bytes(int pooltag) {
+    size_t n = 0;
+    for (threadinfo* ti = allthreads; ti; ti = ti->next())
+        n += ti->pool_count(pooltag);
+    return pool_depot::free_bytes(pooltag) + n * pool_depot::unit(pooltag);
+}
+
+/** @brief Allocate a pool node of @a sz bytes from this thread's
+    sequential chunk.
+
+    Successive calls return adjacent memory, so nodes allocated in key
+    order are laid out in key order. The result is freed with
+    pool_deallocate() like any other pool node. */
+void* threadinfo::pool_allocate_sequential(size_t sz, memtag tag) {
+    bool compact = tag & memtag_pool_compact;
+    if (!compact && !use_pool())
+        return pool_allocate(sz, tag);
+
+    int nl = pool_nlines(sz);
+    char** seq = compact ? compact_sequential_ : sequential_;
+    if (size_t(seq[1] - seq[0]) < size_t(nl * CACHE_LINE_SIZE)) {
+        // return the rest of the old chunk to the pools
+        while (seq[1] - seq[0] >= CACHE_LINE_SIZE) {
+            int rl = std::min(int((seq[1] - seq[0]) / CACHE_LINE_SIZE),
+                              int(pool_max_nlines));
+            int pooltag = (compact ? memtag_pool_compact : 0) + rl;
+            void*& pool = pool_head(pooltag);
+            *reinterpret_cast<void**>(seq[0]) = pool;
+            pool = seq[0];
+            ++pool_count(pooltag);
+            pool_depot::note_carved(pooltag, rl * CACHE_LINE_SIZE);
+            seq[0] += rl * CACHE_LINE_SIZE;
+        }
+        if (seq[1])
+            chunk_of(seq[1] - 1)->carved = pool_chunk_size - CACHE_LINE_SIZE;
+        size_t size;
+        seq[0] = reinterpret_cast<char*>(allocate_pool_chunk(compact, home_node(), size));
+        seq[1] = seq[0] + size;
+    }
+    void* p = seq[0];
+    seq[0] += nl * CACHE_LINE_SIZE;
+    pool_depot::note_carved(tag + nl, nl * CACHE_LINE_SIZE);
+    p = memdebug::make(p, sz, memtag(tag + nl));
+    mark(threadcounter(tc_alloc + (tag > memtag_value)),
+         nl * CACHE_LINE_SIZE);
+    return p;
 }
@@ -20,6 +20,8 @@
 #include "circular_int.hh"
 #include "timestamp.hh"
 #include "memdebug.hh"
+#include "compact_region.hh"
+#include "pool_depot.hh"
 #include <assert.h>
 #include <pthread.h>
 #include <sys/mman.h>
@@ -46,11 +48,13 @@ struct limbo_group {
         } u_;
     };
 
-    enum { capacity = (4076 - sizeof(epoch_type) - sizeof(limbo_group*)) / sizeof(limbo_element) };
+    enum { capacity = (4076 - sizeof(epoch_type) - sizeof(limbo_group*)
+                       - sizeof(threadinfo*)) / sizeof(limbo_element) };
     unsigned head_;
     unsigned tail_;
     epoch_type epoch_;
     limbo_group* next_;
+    threadinfo* owner_;         // set when handed to the reclaimer
     limbo_element e_[capacity];
     limbo_group()
         : head_(0), tail_(0), next_() {
@@ -94,7 +98,7 @@ struct mrcu_callback {
 class threadinfo {
   public:
     enum {
-        TI_MAIN, TI_PROCESS, TI_LOG, TI_CHECKPOINT
+        TI_MAIN, TI_PROCESS, TI_LOG, TI_CHECKPOINT, TI_RECLAIM
     };
 
     static threadinfo* allthreads;
@@ -202,7 +206,11 @@ class threadinfo {
     }
 
     // memory allocation
+    // Values of up to pool_depot::max_value_size bytes come from
+    // size-class slabs in this thread's pools; anything else uses malloc.
     void* allocate(size_t sz, memtag tag) {
+        if (int c = value_class(sz, tag))
+            return pool_pop(sz, tag, c);
         void* p = malloc(sz + memdebug_size);
         p = memdebug::make(p, sz, tag);
         if (p)
@@ -212,50 +220,70 @@ class threadinfo {
     void deallocate(void* p, size_t sz, memtag tag) {
         // in C++ allocators, 'p' must be nonnull
         assert(p);
+        if (int c = value_class(sz, tag))
+            return pool_push(p, sz, tag, c);
         p = memdebug::check_free(p, sz, tag);
         free(p);
         mark(threadcounter(tc_alloc + (tag > memtag_value)), -sz);
     }
     void deallocate_rcu(void* p, size_t sz, memtag tag) {
         assert(p);
+        if (int c = value_class(sz, tag))
+            return pool_push_rcu(p, sz, tag, c);
         memdebug::check_rcu(p, sz, tag);
         record_rcu(p, tag);
         mark(threadcounter(tc_alloc + (tag > memtag_value)), -sz);
     }
 
+    // Pass a tag including memtag_pool_compact to allocate from the
+    // compact_region, so that the result can be stored in a compact_ptr.
     void* pool_allocate(size_t sz, memtag tag) {
-        int nl = (sz + memdebug_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
-        assert(nl <= pool_max_nlines);
-        if (unlikely(!pool_[nl - 1]))
-            refill_pool(nl);
-        void* p = pool_[nl - 1];
-        if (p) {
-            pool_[nl - 1] = *reinterpret_cast<void **>(p);
-            p = memdebug::make(p, sz, memtag(tag + nl));
-            mark(threadcounter(tc_alloc + (tag > memtag_value)),
-                 nl * CACHE_LINE_SIZE);
-        }
-        return p;
+        return pool_pop(sz, tag, pool_nlines(sz));
     }
+    void* pool_allocate_sequential(size_t sz, memtag tag);
     void pool_deallocate(void* p, size_t sz, memtag tag) {
-        int nl = (sz + memdebug_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
-        assert(p && nl <= pool_max_nlines);
-        p = memdebug::check_free(p, sz, memtag(tag + nl));
-        if (use_pool()) {
-            *reinterpret_cast<void **>(p) = pool_[nl - 1];
-            pool_[nl - 1] = p;
-        } else
-            free(p);
-        mark(threadcounter(tc_alloc + (tag > memtag_value)),
-             -nl * CACHE_LINE_SIZE);
+        pool_push(p, sz, tag, pool_nlines(sz));
     }
     void pool_deallocate_rcu(void* p, size_t sz, memtag tag) {
-        int nl = (sz + memdebug_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
-        assert(p && nl <= pool_max_nlines);
-        memdebug::check_rcu(p, sz, memtag(tag + nl));
-        record_rcu(p, memtag(tag + nl));
-        mark(threadcounter(tc_alloc + (tag > memtag_value)),
-             -nl * CACHE_LINE_SIZE);
+        pool_push_rcu(p, sz, tag, pool_nlines(sz));
+    }
+
+    // NUMA
+    /** @brief Return the number of NUMA nodes, or 0 if NUMA support is off.
+
+        NUMA support is on when libnuma is available and reports at most
+        pool_depot::max_nodes nodes. */
+    static int numa_nodes() {
+        return numa_nodes_;
+    }
+    /** @brief Return the NUMA node that holds this thread's new pool
+        chunks, or -1 if NUMA support is off.
+
+        Defaults to the node of the CPU the thread runs on when it first
+        needs a chunk, so pin threads before they allocate. */
+    int numa_node() {
+        return numa_nodes_ ? home_node() : -1;
+    }
+    void set_numa_node(int node) {
+        assert(node >= 0 && node < pool_depot::max_nodes);
+        numa_node_ = node;
+    }
+
+    enum { pool_chunk_size = 2 << 20 };
+    /** @brief Move all of this thread's free pool nodes to the pool_depot. */
+    void flush_pools();
+    static size_t trim_pools();
+    /** @brief Set the number of bytes of free pool memory that
+        trim_pools() keeps resident. */
+    static void set_pool_retention(size_t bytes) {
+        pool_retention = bytes;
+    }
+    static size_t pool_free_bytes(int pooltag);
+    /** @brief Return the pool tag that values of @a sz bytes come from,
+        or 0 if they come from malloc. */
+    static int value_pooltag(size_t sz) {
+        int c = value_class(sz, memtag_value);
+        return c ? memtag_value + c : 0;
     }
 
     // RCU
@@ -279,6 +307,38 @@ class threadinfo {
     void rcu_register(mrcu_callback* cb) {
         record_rcu(cb, memtag(-1));
     }
+    /** @brief Return the TI_RECLAIM thread, or null if there is none.
+
+        A thread made with purpose TI_RECLAIM frees every other thread's
+        limbo objects: other threads hand it their limbo groups, rather
+        than freeing objects at their own quiescent points, and it calls
+        reclaim_limbo() in a loop. Make it before any thread that
+        records RCU frees. */
+    static threadinfo* reclaimer() {
+        return reclaimer_;
+    }
+    size_t reclaim_limbo();
+
+    // search fingers
+    enum { nfingers = 4 };
+    /** @brief Return the node last recorded by set_finger(@a i, @a root).
+
+        Returns null unless this thread is in the same RCU epoch as when
+        the finger was set. A node that was live at set_finger() time
+        cannot have been freed within that epoch, so the result is safe
+        to examine; the caller must still validate it. */
+    void* finger(int i, const void* root) const {
+        if (fingers_[i].root == root && fingers_[i].epoch == gc_epoch_
+            && gc_epoch_)
+            return fingers_[i].node;
+        return nullptr;
+    }
+    /** @brief Record @a node, which is live, as finger @a i for @a root. */
+    void set_finger(int i, const void* root, void* node) {
+        fingers_[i].root = root;
+        fingers_[i].node = node;
+        fingers_[i].epoch = gc_epoch_;
+    }
 
     // thread management
     pthread_t& pthread() {
@@ -309,19 +369,112 @@ class threadinfo {
         char padding1[CACHE_LINE_SIZE];
     };
 
-    enum { pool_max_nlines = 20 };
-    void* pool_[pool_max_nlines];
+    enum { pool_max_nlines = pool_depot::max_nlines,
+           pool_nclasses = pool_depot::nclasses };
+    void* pool_[pool_nclasses];
+    void* compact_pool_[pool_nclasses];
+    unsigned pool_count_[pool_nclasses];
+    unsigned compact_pool_count_[pool_nclasses];
+    char* sequential_[2];       // next, end of the sequential chunk
+    char* compact_sequential_[2];
+    unsigned flush_generation_;
+    int numa_node_;
 
     limbo_group* limbo_head_;
     limbo_group* limbo_tail_;
+    std::atomic<limbo_group*> limbo_returned_; // emptied by the reclaimer
     mutable kvtimestamp_t ts_;
 
+    struct finger_type {
+        const void* root;
+        void* node;
+        mrcu_epoch_type epoch;
+    };
+    finger_type fingers_[nfingers];
+
     //enum { ncounters = (int) tc_max };
     enum { ncounters = 0 };
     uint64_t counters_[ncounters];
 
-    void refill_pool(int nl);
+    // Pool chunks are pool_chunk_size-aligned. Their first line holds
+    // a pool_chunk header, which trim_pools() uses to tell when every
+    // node carved from the chunk is free.
+    struct pool_chunk {
+        size_t carved;          // bytes of nodes carved from the chunk
+        size_t found;           // bytes of free nodes found by trim_pools()
+        int node;               // NUMA node, or 0 if NUMA support is off
+    };
+    static pool_chunk* chunk_of(const void* p) {
+        return reinterpret_cast<pool_chunk*>(reinterpret_cast<uintptr_t>(p)
+                                             & ~uintptr_t(pool_chunk_size - 1));
+    }
+    static size_t pool_retention;
+    static int numa_nodes_;
+    static threadinfo* reclaimer_;
+
+    int home_node() {
+        if (unlikely(numa_node_ < 0))
+            numa_node_ = detect_numa_node();
+        return numa_node_;
+    }
+    static int detect_numa_node();
+    static int pool_nlines(size_t sz) {
+        int nl = (sz + memdebug_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+        assert(nl <= pool_max_nlines);
+        return nl;
+    }
+    static int value_class(size_t sz, memtag tag) {
+        return tag == memtag_value ? pool_depot::value_class(sz + memdebug_size) : 0;
+    }
+
+    // Allocate from, and free to, pool class @a c.
+    void* pool_pop(size_t sz, memtag tag, int c) {
+        void*& pool = pool_head(tag + c);
+        if (unlikely(!pool))
+            refill_pool(c, tag & memtag_pool_compact);
+        void* p = pool;
+        if (p) {
+            pool = *reinterpret_cast<void **>(p);
+            --pool_count(tag + c);
+            p = memdebug::make(p, sz, memtag(tag + c));
+            mark(threadcounter(tc_alloc + (tag > memtag_value)),
+                 pool_depot::unit(c));
+        }
+        return p;
+    }
+    void pool_push(void* p, size_t sz, memtag tag, int c) {
+        p = memdebug::check_free(p, sz, memtag(tag + c));
+        if (use_pool() || (tag & memtag_pool_compact)) {
+            void*& pool = pool_head(tag + c);
+            *reinterpret_cast<void **>(p) = pool;
+            pool = p;
+            if (pool_depot::high_water(c, ++pool_count(tag + c)))
+                release_pool(tag + c);
+        } else
+            free(p);
+        mark(threadcounter(tc_alloc + (tag > memtag_value)),
+             -pool_depot::unit(c));
+    }
+    void pool_push_rcu(void* p, size_t sz, memtag tag, int c) {
+        memdebug::check_rcu(p, sz, memtag(tag + c));
+        record_rcu(p, memtag(tag + c));
+        mark(threadcounter(tc_alloc + (tag > memtag_value)),
+             -pool_depot::unit(c));
+    }
+
+    void refill_pool(int c, bool compact);
+    static void* allocate_pool_chunk(bool compact, int node, size_t& size);
+    void*& pool_head(int pooltag) {
+        int c = pooltag & memtag_pool_nlines_mask;
+        return pooltag & memtag_pool_compact ? compact_pool_[c - 1] : pool_[c - 1];
+    }
+    unsigned& pool_count(int pooltag) {
+        int c = pooltag & memtag_pool_nlines_mask;
+        return pooltag & memtag_pool_compact ? compact_pool_count_[c - 1] : pool_count_[c - 1];
+    }
+    void release_pool(int pooltag);
     void refill_rcu();
+    void hand_off_limbo();
 
     void free_rcu(void *p, memtag tag) {
         if ((tag & memtag_pool_mask) == 0) {
@@ -331,9 +484,14 @@ class threadinfo {
             (*static_cast<mrcu_callback*>(p))(*this);
         else {
             p = memdebug::check_free_after_rcu(p, tag);
-            int nl = tag & memtag_pool_mask;
-            *reinterpret_cast<void**>(p) = pool_[nl - 1];
-            pool_[nl - 1] = p;
+            if (use_pool() || (tag & memtag_pool_compact)) {
+                void*& pool = pool_head(tag);
+                *reinterpret_cast<void**>(p) = pool;
+                pool = p;
+                if (pool_depot::high_water(tag, ++pool_count(tag)))
+                    release_pool(tag);
+            } else
+                ::free(p);
         }
     }
 
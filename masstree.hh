@@ -26,16 +26,36 @@ using lcdf::String;
 class key_unparse_printable_string;
 template <typename T> class value_print;
 
+enum {
+    leaf_layout_packed = 0,     // leaf fields in declaration order
+    leaf_layout_hot_cold        // search fields alone in the first lines
+};
+
+enum {
+    descent_prefetch_none = 0,      // prefetch each node on arrival
+    descent_prefetch_child,         // prefetch the chosen child early
+    descent_prefetch_neighbors      // ... and its neighbor near a separator
+};
+
 template <int LW = 15, int IW = LW> struct nodeparams {
     static constexpr int leaf_width = LW;
     static constexpr int internode_width = IW;
     static constexpr bool concurrent = true;
     static constexpr bool prefetch = true;
+    static constexpr bool use_finger = false;
     static constexpr int bound_method = bound_method_binary;
+    static constexpr int leaf_layout = leaf_layout_packed;
+    static constexpr int descent_prefetch = descent_prefetch_none;
     static constexpr int debug_level = 0;
     typedef uint64_t ikey_type;
+    static constexpr int fixed_key_length = 0;
     typedef uint32_t nodeversion_value_type;
     static constexpr bool need_phantom_epoch = true;
+    static constexpr int leaf_merge_size = LW / 4;
+    static constexpr int internode_merge_size = IW / 4;
+    static constexpr int small_leaf_width = 0;
+    static constexpr bool compressed_pointers = false;
+    static constexpr bool leaf_model = false;
     typedef uint64_t phantom_epoch_type;
     static constexpr ssize_t print_max_indent_depth = 12;
     typedef key_unparse_printable_string key_unparse_type;
@@ -44,6 +64,10 @@ template <int LW = 15, int IW = LW> struct nodeparams {
 template <int LW, int IW> constexpr int nodeparams<LW, IW>::leaf_width;
 template <int LW, int IW> constexpr int nodeparams<LW, IW>::internode_width;
 template <int LW, int IW> constexpr int nodeparams<LW, IW>::debug_level;
+template <int LW, int IW> constexpr int nodeparams<LW, IW>::fixed_key_length;
+template <int LW, int IW> constexpr int nodeparams<LW, IW>::leaf_merge_size;
+template <int LW, int IW> constexpr int nodeparams<LW, IW>::internode_merge_size;
+template <int LW, int IW> constexpr int nodeparams<LW, IW>::small_leaf_width;
 
 template <typename P> class node_base;
 template <typename P> class leaf;
@@ -53,6 +77,9 @@ template <typename P> class key;
 template <typename P> class basic_table;
 template <typename P> class unlocked_tcursor;
 template <typename P> class tcursor;
+template <typename P> class bulk_loader;
+template <typename P> class leaf_model;
+template <typename P> class frozen_layer;
 
 template <typename P>
 class basic_table {
@@ -72,8 +99,21 @@ class basic_table {
 
     inline node_type* root() const;
     inline node_type* fix_root();
+    inline const leaf_model<P>* model() const;
+    void build_model(threadinfo& ti);
+    bool maintain_model(threadinfo& ti);
 
     bool get(Str key, value_type& value, threadinfo& ti) const;
+    int multi_get(const Str* keys, int n, value_type* values, bool* found,
+                  threadinfo& ti) const;
+
+    template <typename F>
+    int insert_sorted(const Str* keys, int n, F& f, threadinfo& ti);
+    template <typename I>
+    void bulk_load(I first, I last, double fill, threadinfo& ti);
+    template <typename F>
+    void remove_range(Str first, Str last, F& f, threadinfo& ti);
+    int freeze(Str prefix, threadinfo& ti);
 
     template <typename F>
     int scan(Str firstkey, bool matchfirst, F& scanner, threadinfo& ti) const;
@@ -84,6 +124,7 @@ class basic_table {
 
   private:
     node_type* root_;
+    leaf_model<P>* model_;
 
     template <typename H, typename F>
     int scan(H helper, Str firstkey, bool matchfirst,
@@ -91,6 +132,7 @@ class basic_table {
 
     friend class unlocked_tcursor<P>;
     friend class tcursor<P>;
+    friend class bulk_loader<P>;
 };
 
 } // namespace Masstree
@@ -0,0 +1,301 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_BULK_HH
+#define MASSTREE_BULK_HH
+#include "masstree_struct.hh"
+#include "masstree_model.hh"
+#include <vector>
+namespace Masstree {
+
+/** @brief Builds a table bottom-up from keys in sorted order.
+
+    Add keys with add() in strictly increasing order, then call finish() to
+    install the result as the table's tree. Leaves are packed to the
+    requested fill factor as keys arrive; each layer's internodes are built
+    once the layer is complete. No splits or locks are involved.
+
+    The table must be empty and must not be accessed until finish()
+    returns. Key data must remain valid until finish() returns. */
+template <typename P>
+class bulk_loader {
+  public:
+    typedef typename P::value_type value_type;
+    typedef typename P::ikey_type ikey_type;
+    typedef typename P::threadinfo_type threadinfo;
+    typedef node_base<P> node_type;
+    typedef leaf<P> leaf_type;
+    typedef internode<P> internode_type;
+    typedef key<ikey_type> key_type;
+
+    /** @brief Construct a loader for @a table.
+        @param fill fraction of each node's width to fill, in (0, 1] */
+    bulk_loader(basic_table<P>& table, double fill = 1.0);
+
+    void add(Str key, value_type value, threadinfo& ti);
+    void finish(threadinfo& ti);
+
+  private:
+    struct entry {
+        ikey_type ikey;
+        int keylenx;
+        Str suffix;
+        leafvalue<P> lv;
+    };
+    struct layer {
+        int depth;                 // bytes of key prefix consumed
+        Str prefix;                // a key whose first depth bytes are the prefix
+        ikey_type ikey;            // slice of this layer in its parent
+        int nbuf;
+        entry buf[leaf_type::width];
+        bool pending;              // is there a keysuffixed entry on hold?
+        entry pending_entry;
+        Str pending_key;
+        leaf_type* last;
+        std::vector<std::pair<ikey_type, node_type*> > nodes;
+    };
+
+    basic_table<P>& table_;
+    int leaf_fill_;
+    int internode_fill_;
+    std::vector<layer> layers_;
+
+    void push_layer(int depth, Str prefix, ikey_type ikey);
+    static bool in_layer(const layer& l, Str key) {
+        return key.len > l.depth
+            && memcmp(key.s, l.prefix.s, l.depth) == 0;
+    }
+    void push_entry(layer& l, const entry& e, threadinfo& ti);
+    void make_leaf(layer& l, int n, threadinfo& ti);
+    node_type* build_layer(layer& l, threadinfo& ti);
+    void finish_layer(threadinfo& ti);
+};
+
+template <typename P>
+bulk_loader<P>::bulk_loader(basic_table<P>& table, double fill)
+    : table_(table) {
+    leaf_fill_ = std::max(1, std::min(leaf_type::width,
+                                      int(fill * leaf_type::width + 0.5)));
+    // internodes need at least two children; three keys ensures that
+    // even distribution never produces a single-child internode
+    internode_fill_ = std::max(3, std::min(internode_type::width,
+                                           int(fill * internode_type::width + 0.5)));
+    push_layer(0, Str(), 0);
+}
+
+template <typename P>
+void bulk_loader<P>::push_layer(int depth, Str prefix, ikey_type ikey) {
+    layers_.emplace_back();
+    layer& l = layers_.back();
+    l.depth = depth;
+    l.prefix = prefix;
+    l.ikey = ikey;
+    l.nbuf = 0;
+    l.pending = false;
+    l.last = nullptr;
+}
+
+/** @brief Add @a key with @a value.
+    @pre @a key is greater than every key added so far */
+template <typename P>
+void bulk_loader<P>::add(Str key, value_type value, threadinfo& ti)
+{
+    while (layers_.size() > 1 && !in_layer(layers_.back(), key))
+        finish_layer(ti);
+
+    layer& l = layers_.back();
+    key_type ka(key);
+    if (l.depth)
+        ka.shift_by(l.depth);
+
+    if (l.pending) {
+        if (ka.has_suffix() && ka.ikey() == l.pending_entry.ikey) {
+            // two keys share this slice and continue past it: new layer
+            Str pkey = l.pending_key;
+            value_type pvalue = l.pending_entry.lv.value();
+            l.pending = false;
+            push_layer(l.depth + sizeof(ikey_type), key, ka.ikey());
+            add(pkey, pvalue, ti);
+            add(key, value, ti);
+            return;
+        }
+        l.pending = false;
+        push_entry(l, l.pending_entry, ti);
+    }
+
+    entry e;
+    e.ikey = ka.ikey();
+    e.lv = leafvalue<P>(value);
+    if (ka.has_suffix()) {
+        // hold the entry until we know whether the next key shares its slice
+        e.keylenx = leaf_type::ksuf_keylenx;
+        e.suffix = ka.suffix();
+        l.pending = true;
+        l.pending_entry = e;
+        l.pending_key = key;
+    } else {
+        e.keylenx = ka.length();
+        push_entry(l, e, ti);
+    }
+}
+
+template <typename P>
+void bulk_loader<P>::push_entry(layer& l, const entry& e, threadinfo& ti)
+{
+    if (l.nbuf >= leaf_fill_ && l.buf[l.nbuf - 1].ikey != e.ikey)
+        make_leaf(l, l.nbuf, ti);
+    else if (l.nbuf == leaf_type::width) {
+        // entries with the same ikey must share a leaf
+        int n = l.nbuf;
+        while (n > 0 && l.buf[n - 1].ikey == e.ikey)
+            --n;
+        masstree_invariant(n > 0);
+        make_leaf(l, n, ti);
+    }
+    l.buf[l.nbuf] = e;
+    ++l.nbuf;
+}
+
+template <typename P>
+void bulk_loader<P>::make_leaf(layer& l, int n, threadinfo& ti)
+{
+    int ksufsize = 0;
+    for (int i = 0; i != n; ++i)
+        if (leaf_type::keylenx_has_ksuf(l.buf[i].keylenx))
+            ksufsize += l.buf[i].suffix.len;
+    if (ksufsize)
+        ksufsize += leaf_type::internal_ksuf_type::overhead(leaf_type::width);
+
+    leaf_type* lf = leaf_type::make(ksufsize, typename P::phantom_epoch_type(), ti);
+    for (int i = 0; i != n; ++i) {
+        const entry& e = l.buf[i];
+        lf->ikey0_[i] = e.ikey;
+        lf->assign_keylenx(i, e.keylenx);
+        lf->lv_[i] = e.lv;
+        if (leaf_type::keylenx_has_ksuf(e.keylenx))
+            lf->assign_ksuf(i, e.suffix, true, ti);
+    }
+    lf->permutation_ = leaf_type::permuter_type::make_sorted(n);
+
+    lf->prev_ = l.last;
+    lf->next_.ptr = nullptr;
+    if (l.last)
+        l.last->next_.ptr = lf;
+    l.last = lf;
+    l.nodes.push_back(std::make_pair(lf->ikey0_[0], lf));
+
+    for (int i = n; i != l.nbuf; ++i)
+        l.buf[i - n] = l.buf[i];
+    l.nbuf -= n;
+}
+
+/** @brief Complete layer @a l and return its root.
+    @pre The layer contains at least one key. */
+template <typename P>
+node_base<P>* bulk_loader<P>::build_layer(layer& l, threadinfo& ti)
+{
+    if (l.pending) {
+        l.pending = false;
+        push_entry(l, l.pending_entry, ti);
+    }
+    if (l.nbuf)
+        make_leaf(l, l.nbuf, ti);
+
+    std::vector<std::pair<ikey_type, node_type*> > up;
+    uint32_t height = 0;
+    while (l.nodes.size() > 1) {
+        // spread the children evenly over as few internodes as possible
+        size_t nchild = l.nodes.size();
+        size_t nnodes = (nchild + internode_fill_) / (internode_fill_ + 1);
+        size_t pos = 0;
+        up.clear();
+        for (size_t i = 0; i != nnodes; ++i) {
+            size_t end = nchild * (i + 1) / nnodes;
+            internode_type* in = internode_type::make(height + 1, ti);
+            in->child_[0] = l.nodes[pos].second;
+            l.nodes[pos].second->set_parent(in);
+            for (size_t j = pos + 1; j != end; ++j)
+                in->assign(j - pos - 1, l.nodes[j].first, l.nodes[j].second);
+            in->nkeys_ = end - pos - 1;
+            up.push_back(std::make_pair(l.nodes[pos].first, in));
+            pos = end;
+        }
+        l.nodes.swap(up);
+        ++height;
+    }
+
+    node_type* root = l.nodes[0].second;
+    root->make_layer_root();
+    return root;
+}
+
+template <typename P>
+void bulk_loader<P>::finish_layer(threadinfo& ti)
+{
+    layer& l = layers_.back();
+    entry e;
+    e.ikey = l.ikey;
+    if (!l.pending && l.nodes.empty() && l.nbuf == 1
+        && leaf_type::keylenx_is_layer(l.buf[0].keylenx)) {
+        // The layer holds just another layer, so fold its slice into a
+        // compressed path. Every key in the layer, including the one
+        // that started it, has the path's bytes.
+        int pathlen = sizeof(ikey_type);
+        if (leaf_type::keylenx_has_ksuf(l.buf[0].keylenx))
+            pathlen += l.buf[0].suffix.len;
+        e.keylenx = leaf_type::layer_ksuf_keylenx;
+        e.suffix = Str(l.prefix.s + l.depth, pathlen);
+        e.lv = l.buf[0].lv;
+    } else {
+        e.keylenx = leaf_type::layer_keylenx;
+        e.lv = leafvalue<P>(build_layer(l, ti));
+    }
+    layers_.pop_back();
+    push_entry(layers_.back(), e, ti);
+}
+
+/** @brief Install the loaded keys as the table's tree. */
+template <typename P>
+void bulk_loader<P>::finish(threadinfo& ti)
+{
+    while (layers_.size() > 1)
+        finish_layer(ti);
+    layer& l = layers_.back();
+    if (l.pending || l.nbuf || !l.nodes.empty()) {
+        node_type* old_root = table_.root_;
+        masstree_precondition(old_root->isleaf()
+                              && static_cast<leaf_type*>(old_root)->size() == 0);
+        table_.root_ = build_layer(l, ti);
+        static_cast<leaf_type*>(old_root)->deallocate_rcu(ti);
+    }
+    layers_.clear();
+    push_layer(0, Str(), 0);
+}
+
+/** @brief Load the sorted range [@a first, @a last) into this empty table.
+
+    Each element has a Str @a first member (the key) and a value_type @a
+    second member. See bulk_loader. */
+template <typename P> template <typename I>
+void basic_table<P>::bulk_load(I first, I last, double fill, threadinfo& ti)
+{
+    bulk_loader<P> loader(*this, fill);
+    for (; first != last; ++first)
+        loader.add(first->first, first->second, ti);
+    loader.finish(ti);
+}
+
+} // namespace Masstree
+#endif
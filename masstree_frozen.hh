@@ -0,0 +1,435 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_FROZEN_HH
+#define MASSTREE_FROZEN_HH
+#include "masstree_struct.hh"
+#include "masstree_tcursor.hh"
+#include "masstree_bulk.hh"
+#include "straccum.hh"
+#include <vector>
+namespace Masstree {
+
+/** @brief Immutable, sorted block of the keys under one trie layer slot.
+
+    basic_table::freeze() replaces a trie layer with a frozen_layer. The
+    block holds the layer's keys, relative to the slot (so a compressed
+    layer's path is part of every key), in one allocation: a header, the
+    values in key order, then the keys. Keys are front-coded: each stores
+    the length of the prefix it shares with the previous key and the bytes
+    that follow. Every group_size'th key is stored whole, and a table of
+    their offsets lets lookups binary-search the groups, then decode at
+    most one group.
+
+    Blocks never change. Readers use them in place of a layer; the first
+    write under the slot thaws the block back into a layer (see thaw()),
+    and the block is freed after an RCU grace period. */
+template <typename P>
+class frozen_layer {
+  public:
+    typedef typename P::value_type value_type;
+    typedef typename P::threadinfo_type threadinfo;
+    typedef std::vector<std::pair<String, value_type> > entries_type;
+
+    enum { group_size = 16 };
+
+    static frozen_layer<P>* make(const entries_type& entries, threadinfo& ti);
+    void deallocate(threadinfo& ti);
+    void deallocate_rcu(threadinfo& ti);
+
+    inline int size() const {
+        return nkeys_;
+    }
+    inline size_t allocated_size() const {
+        return size_;
+    }
+    inline value_type value(int i) const {
+        return values()[i];
+    }
+
+    inline int lower_bound(Str s, bool& exact) const;
+    inline bool find(Str s, leafvalue<P>& lv) const;
+    inline int seek(int i, char* buf, uint32_t& off) const;
+    inline int decode(char* buf, uint32_t& off) const;
+
+    node_base<P>* thaw(threadinfo& ti) const;
+    template <typename F> void destroy(F& dispose, threadinfo& ti);
+
+  private:
+    size_t size_;
+    int nkeys_;
+    int ngroups_;
+
+    static size_t values_offset() {
+        return iceil(sizeof(frozen_layer<P>), alignof(value_type));
+    }
+    size_t restarts_offset() const {
+        return iceil(values_offset() + sizeof(value_type) * nkeys_,
+                     alignof(uint32_t));
+    }
+    const value_type* values() const {
+        return reinterpret_cast<const value_type*>
+            (reinterpret_cast<const char*>(this) + values_offset());
+    }
+    value_type* values() {
+        return reinterpret_cast<value_type*>
+            (reinterpret_cast<char*>(this) + values_offset());
+    }
+    const uint32_t* restarts() const {
+        return reinterpret_cast<const uint32_t*>
+            (reinterpret_cast<const char*>(this) + restarts_offset());
+    }
+    const uint8_t* keys() const {
+        return reinterpret_cast<const uint8_t*>(restarts() + ngroups_);
+    }
+    inline Str group_key(int g) const;
+
+    static void append_length(std::vector<uint8_t>& v, unsigned x) {
+        for (; x >= 128; x >>= 7)
+            v.push_back(x | 128);
+        v.push_back(x);
+    }
+    static unsigned read_length(const uint8_t*& p) {
+        unsigned x = 0;
+        for (int shift = 0; ; shift += 7) {
+            unsigned c = *p++;
+            x |= (c & 127) << shift;
+            if (c < 128)
+                return x;
+        }
+    }
+};
+
+/** @brief Build a block from @a entries, which are in strictly increasing
+    key order. */
+template <typename P>
+frozen_layer<P>* frozen_layer<P>::make(const entries_type& entries,
+                                       threadinfo& ti)
+{
+    int n = entries.size();
+    std::vector<uint32_t> restarts;
+    std::vector<uint8_t> keys;
+    for (int i = 0; i != n; ++i) {
+        Str k = entries[i].first;
+        int shared = 0;
+        if (i % group_size == 0)
+            restarts.push_back(keys.size());
+        else {
+            Str prev = entries[i - 1].first;
+            while (shared < prev.len && shared < k.len
+                   && prev.s[shared] == k.s[shared])
+                ++shared;
+        }
+        append_length(keys, shared);
+        append_length(keys, k.len - shared);
+        keys.insert(keys.end(), k.s + shared, k.s + k.len);
+    }
+
+    frozen_layer<P> header;
+    header.nkeys_ = n;
+    header.ngroups_ = restarts.size();
+    size_t restarts_offset = header.restarts_offset();
+    header.size_ = restarts_offset + sizeof(uint32_t) * restarts.size()
+        + keys.size();
+    char* p = (char*) ti.allocate(header.size_, memtag_masstree_frozen);
+    frozen_layer<P>* fl = new(p) frozen_layer<P>(header);
+    for (int i = 0; i != n; ++i)
+        fl->values()[i] = entries[i].second;
+    memcpy(p + restarts_offset, restarts.data(),
+           sizeof(uint32_t) * restarts.size());
+    memcpy(p + restarts_offset + sizeof(uint32_t) * restarts.size(),
+           keys.data(), keys.size());
+    return fl;
+}
+
+template <typename P>
+void frozen_layer<P>::deallocate(threadinfo& ti)
+{
+    ti.deallocate(this, size_, memtag_masstree_frozen);
+}
+
+template <typename P>
+void frozen_layer<P>::deallocate_rcu(threadinfo& ti)
+{
+    ti.deallocate_rcu(this, size_, memtag_masstree_frozen);
+}
+
+/** @brief Return the first key of group @a g, which is stored whole. */
+template <typename P>
+inline Str frozen_layer<P>::group_key(int g) const
+{
+    const uint8_t* p = keys() + restarts()[g];
+    read_length(p);
+    int len = read_length(p);
+    return Str(reinterpret_cast<const char*>(p), len);
+}
+
+/** @brief Decode the key at offset @a off into @a buf.
+    @return the key's length
+    @pre @a buf holds the previous key, unless the key starts a group
+
+    Sets @a off to the offset of the following key. */
+template <typename P>
+inline int frozen_layer<P>::decode(char* buf, uint32_t& off) const
+{
+    const uint8_t* p = keys() + off;
+    int shared = read_length(p);
+    int unshared = read_length(p);
+    memcpy(buf + shared, p, unshared);
+    off = p + unshared - keys();
+    return shared + unshared;
+}
+
+/** @brief Decode key @a i into @a buf.
+    @return the key's length
+
+    Sets @a off to the offset of key @a i + 1, for decode(). */
+template <typename P>
+inline int frozen_layer<P>::seek(int i, char* buf, uint32_t& off) const
+{
+    int g = i / group_size;
+    off = restarts()[g];
+    int len = 0;
+    for (int j = g * group_size; j <= i; ++j)
+        len = decode(buf, off);
+    return len;
+}
+
+/** @brief Return the index of the first key not less than @a s.
+
+    Sets @a exact to true iff that key equals @a s. */
+template <typename P>
+inline int frozen_layer<P>::lower_bound(Str s, bool& exact) const
+{
+    int l = 0, r = ngroups_;
+    while (r - l > 1) {
+        int m = (l + r) >> 1;
+        if (group_key(m).compare(s) <= 0)
+            l = m;
+        else
+            r = m;
+    }
+
+    char buf[MASSTREE_MAXKEYLEN];
+    uint32_t off = restarts()[l];
+    int i = l * group_size, end = std::min(i + group_size, nkeys_);
+    for (; i != end; ++i) {
+        int len = decode(buf, off);
+        int cmp = Str(buf, len).compare(s);
+        if (cmp >= 0) {
+            exact = cmp == 0;
+            return i;
+        }
+    }
+    exact = false;
+    return i;
+}
+
+/** @brief Look up @a s, setting @a lv to its value if found. */
+template <typename P>
+inline bool frozen_layer<P>::find(Str s, leafvalue<P>& lv) const
+{
+    bool exact;
+    int i = lower_bound(s, exact);
+    if (exact)
+        lv = leafvalue<P>(value(i));
+    return exact;
+}
+
+/** @brief Build a new trie layer holding this block's keys and values.
+    @return the layer's root */
+template <typename P>
+node_base<P>* frozen_layer<P>::thaw(threadinfo& ti) const
+{
+    std::vector<String> keys(nkeys_);
+    char buf[MASSTREE_MAXKEYLEN];
+    uint32_t off = 0;
+    for (int i = 0; i != nkeys_; ++i) {
+        int len = decode(buf, off);
+        keys[i] = String(buf, len);
+    }
+
+    basic_table<P> table;
+    table.initialize(ti);
+    bulk_loader<P> loader(table);
+    for (int i = 0; i != nkeys_; ++i)
+        loader.add(keys[i], value(i), ti);
+    loader.finish(ti);
+    return table.root();
+}
+
+/** @brief Pass each value to @a dispose, then free the block.
+    @pre No reader can reach the block */
+template <typename P> template <typename F>
+void frozen_layer<P>::destroy(F& dispose, threadinfo& ti)
+{
+    for (int i = 0; i != nkeys_; ++i)
+        dispose(values()[i], ti);
+    deallocate(ti);
+}
+
+
+/** @brief Lock the leaves of the layer rooted at @a root and collect its
+    keys and values.
+    @param prefix bytes to prepend to each key
+    @pre The leaf holding the layer's slot is locked
+
+    Leaves are locked in key order, and a nested layer's leaves are locked
+    after the leaf holding its slot, so the order agrees with gc_layer().
+    Nested layers are collected recursively, and nested frozen blocks are
+    merged. */
+template <typename P>
+void tcursor<P>::freeze_collect(node_type* root, Str prefix,
+                                freeze_state& fs, threadinfo& ti)
+{
+    while (!root->is_root())
+        root = root->maybe_parent();
+    fs.roots.push_back(root);
+
+    nodeversion_type v;
+    key_type ka{Str()};
+    leaf_type* lf = root->reach_leaf(ka, v, ti);
+    lf->lock(*lf, ti.lock_fence(tc_leaf_lock));
+    lcdf::StringAccum sa;
+    while (lf) {
+        fs.leaves.push_back(lf);
+        permuter_type perm(lf->permutation_);
+        for (int i = 0; i != perm.size(); ++i) {
+            int p = perm[i];
+            key_type k = lf->get_key(p);
+            sa.clear();
+            sa.append(prefix.s, prefix.len);
+            k.unparse(sa.extend(k.length()), k.length());
+            if (lf->is_layer(p))
+                freeze_collect(lf->lv_[p].layer(), Str(sa.data(), sa.length()),
+                               fs, ti);
+            else if (lf->is_frozen(p)) {
+                frozen_layer<P>* fl = lf->lv_[p].frozen();
+                char buf[MASSTREE_MAXKEYLEN];
+                uint32_t off = 0;
+                int plen = sa.length();
+                for (int j = 0; j != fl->size(); ++j) {
+                    int len = fl->decode(buf, off);
+                    sa.set_length(plen);
+                    sa.append(buf, len);
+                    fs.entries.push_back(std::make_pair(
+                        String(sa.data(), sa.length()), fl->value(j)));
+                }
+                fs.blocks.push_back(fl);
+            } else
+                fs.entries.push_back(std::make_pair(sa.take_string(),
+                                                    lf->lv_[p].value()));
+        }
+
+        leaf_type* next;
+        while ((next = lf->safe_next())) {
+            next->lock(*next, ti.lock_fence(tc_leaf_lock));
+            if (!next->deleted())
+                break;
+            next->unlock();
+        }
+        lf = next;
+    }
+}
+
+/** @brief Free the internodes of the layer rooted at @a n. */
+template <typename P>
+void tcursor<P>::freeze_free_internodes(node_type* n, threadinfo& ti)
+{
+    if (!n->isleaf()) {
+        internode_type* in = static_cast<internode_type*>(n);
+        for (int i = 0; i != in->size() + 1; ++i)
+            freeze_free_internodes(in->child_[i], ti);
+        in->deallocate_rcu(ti);
+    }
+}
+
+/** @brief Replace the layer in the locked slot kx_ with a frozen_layer.
+    @return the number of keys frozen, or 0 if the layer is empty
+
+    The layer's leaves are marked as a deleted layer, so writers waiting
+    on them retry from the table root and thaw the block. Readers already
+    in the layer see its unchanged contents until the nodes are freed
+    after an RCU grace period. */
+template <typename P>
+int tcursor<P>::freeze_layer(threadinfo& ti)
+{
+    freeze_state fs;
+    Str path;
+    if (n_->has_ksuf(kx_.p))
+        path = n_->ksuf(kx_.p);
+    freeze_collect(n_->lv_[kx_.p].layer(), path, fs, ti);
+
+    int nkeys = fs.entries.size();
+    if (nkeys) {
+        frozen_layer<P>* fl = frozen_layer<P>::make(fs.entries, ti);
+        n_->mark_insert();
+        n_->lv_[kx_.p] = fl;
+        fence();
+        n_->assign_keylenx(kx_.p, leaf_type::frozen_keylenx);
+        for (auto lf : fs.leaves)
+            lf->mark_deleted_layer();
+        for (auto root : fs.roots)
+            freeze_free_internodes(root, ti);
+        for (auto block : fs.blocks)
+            block->deallocate_rcu(ti);
+    }
+    for (auto lf : fs.leaves) {
+        lf->unlock();
+        if (nkeys)
+            lf->deallocate_rcu(ti);
+    }
+    return nkeys;
+}
+
+/** @brief Replace the frozen_layer in the locked slot kx_ with a layer.
+
+    The block's values move to the new layer, so the block itself is
+    freed without disposing of them. */
+template <typename P>
+void tcursor<P>::thaw_layer(threadinfo& ti)
+{
+    frozen_layer<P>* fl = n_->lv_[kx_.p].frozen();
+    node_type* layer = fl->thaw(ti);
+    n_->mark_insert();
+    n_->lv_[kx_.p] = layer;
+    fence();
+    n_->assign_keylenx(kx_.p, leaf_type::layer_keylenx);
+    fl->deallocate_rcu(ti);
+}
+
+/** @brief Freeze the trie layer holding the keys that extend @a prefix.
+    @return the number of keys frozen
+
+    @a prefix must name a layer: a whole number of key slices, such as an
+    8-byte tenant ID whose keys are all longer. Its keys are copied into
+    one compact, read-only frozen_layer that gets and scans search in
+    place. The first insert or remove under @a prefix thaws the block
+    back into ordinary nodes. Returns 0, and changes nothing, if there is
+    no such layer (for instance, because it is already frozen). */
+template <typename P>
+int basic_table<P>::freeze(Str prefix, threadinfo& ti)
+{
+    cursor_type lp(*this, prefix);
+    lp.find_locked(ti);
+    int nkeys = 0;
+    if (lp.find_layer_slot())
+        nkeys = lp.freeze_layer(ti);
+    lp.n_->unlock();
+    return nkeys;
+}
+
+} // namespace Masstree
+#endif
@@ -17,6 +17,8 @@
 #define MASSTREE_GET_HH
 #include "masstree_tcursor.hh"
 #include "masstree_key.hh"
+#include "masstree_model.hh"
+#include "masstree_frozen.hh"
 namespace Masstree {
 
 template <typename P>
@@ -25,6 +27,11 @@ bool unlocked_tcursor<P>::find_unlocked(threadinfo& ti)
     int match;
     key_indexed_position kx;
     node_base<P>* root = const_cast<node_base<P>*>(root_);
+    masstree_precondition(!leaf<P>::fixed_keys
+                          || ka_.length() == P::fixed_key_length);
+
+    if (P::leaf_model && model_ && (n_ = model_->find(ka_, v_, ti)))
+        goto forward;
 
  retry:
     n_ = root->reach_leaf(ka_, v_, ti);
@@ -38,7 +45,7 @@ bool unlocked_tcursor<P>::find_unlocked(threadinfo& ti)
     kx = leaf<P>::bound_type::lower(ka_, *this);
     if (kx.p >= 0) {
         lv_ = n_->lv_[kx.p];
-        lv_.prefetch(n_->keylenx_[kx.p]);
+        lv_.prefetch(n_->keylenx(kx.p));
         match = n_->ksuf_matches(kx.p, ka_);
     } else
         match = 0;
@@ -49,6 +56,8 @@ bool unlocked_tcursor<P>::find_unlocked(threadinfo& ti)
     }
 
     if (match < 0) {
+        if (match == leaf<P>::frozen_match)
+            return lv_.frozen()->find(ka_.suffix(), lv_);
         ka_.shift_by(-match);
         root = lv_.layer();
         goto retry;
@@ -67,12 +76,146 @@ inline bool basic_table<P>::get(Str key, value_type &value,
     return found;
 }
 
+/** @brief Advance this lookup until it must wait for memory.
+
+    Returns true if the lookup is still in progress, in which case the
+    node it will examine next has been prefetched. Returns false when the
+    lookup is complete. Validation follows find_unlocked() exactly: each
+    child's version is read before its parent is checked for changes. */
+template <typename P>
+bool multi_get_cursor<P>::step(threadinfo& ti)
+{
+    const internode<P>* in;
+    const leaf<P>* lf;
+    key_indexed_position kx;
+
+    if (state_ == st_child) {
+        in = static_cast<const internode<P>*>(n_);
+        nodeversion_type cv = next_->stable_annotated(ti.stable_fence());
+        if (likely(!in->has_changed(v_))) {
+            n_ = next_;
+            v_ = cv;
+            goto descend;
+        }
+        nodeversion_type oldv = v_;
+        v_ = in->stable_annotated(ti.stable_fence());
+        if (unlikely(oldv.has_split(v_))
+            && in->stable_last_key_compare(ka_, v_, ti) > 0) {
+            ti.mark(tc_root_retry);
+            goto retry;
+        }
+        ti.mark(tc_internode_retry);
+        goto descend;
+    }
+
+ retry:
+    n_ = root_;
+    while (true) {
+        v_ = n_->stable_annotated(ti.stable_fence());
+        if (v_.is_root())
+            break;
+        ti.mark(tc_root_retry);
+        n_ = n_->maybe_parent();
+    }
+
+ descend:
+    if (!v_.isleaf()) {
+        in = static_cast<const internode<P>*>(n_);
+        int kp = internode<P>::bound_type::upper(ka_, *in);
+        next_ = in->child_[kp];
+        if (!next_)
+            goto retry;
+        next_->prefetch_full();
+        state_ = st_child;
+        return true;
+    }
+
+    lf = static_cast<const leaf<P>*>(n_);
+ forward:
+    if (v_.deleted())
+        goto retry;
+    lf->prefetch();
+    kx = leaf<P>::bound_type::lower(ka_, *lf);
+    if (kx.p >= 0) {
+        lv_ = lf->lv_[kx.p];
+        lv_.prefetch(lf->keylenx(kx.p));
+        match_ = lf->ksuf_matches(kx.p, ka_);
+    } else
+        match_ = 0;
+    if (lf->has_changed(v_)) {
+        ti.mark(threadcounter(tc_stable_leaf_insert + lf->simple_has_split(v_)));
+        lf = lf->advance_to_key(ka_, v_, ti);
+        goto forward;
+    }
+
+    if (match_ == leaf<P>::frozen_match)
+        match_ = lv_.frozen()->find(ka_.suffix(), lv_);
+    else if (match_ < 0) {
+        // the layer root was prefetched by lv_.prefetch()
+        ka_.shift_by(-match_);
+        root_ = lv_.layer();
+        state_ = st_root;
+        return true;
+    }
+    return false;
+}
+
+/** @brief Look up @a n keys at once.
+    @param keys the keys to look up
+    @param values on return, values[i] is the value for keys[i], if found
+    @param found on return, found[i] is true iff keys[i] was found
+    @return the number of keys found
+
+    Lookups are interleaved: while one lookup waits for a node to arrive
+    from memory, the others make progress. Each individual lookup has the
+    same semantics as get(). */
+template <typename P>
+int basic_table<P>::multi_get(const Str* keys, int n, value_type* values,
+                              bool* found, threadinfo& ti) const
+{
+    typedef multi_get_cursor<P> cursor_type;
+    cursor_type c[cursor_type::group_size];
+    int ki[cursor_type::group_size];
+    int nactive = 0, next = 0, nfound = 0;
+
+    for (; nactive < cursor_type::group_size && next < n; ++nactive, ++next) {
+        c[nactive].start(root_, keys[next]);
+        ki[nactive] = next;
+    }
+
+    while (nactive) {
+        for (int i = 0; i < nactive; ) {
+            if (c[i].step(ti)) {
+                ++i;
+                continue;
+            }
+            found[ki[i]] = c[i].found();
+            if (c[i].found()) {
+                values[ki[i]] = c[i].value();
+                ++nfound;
+            }
+            if (next < n) {
+                c[i].start(root_, keys[next]);
+                ki[i] = next;
+                ++next, ++i;
+            } else {
+                --nactive;
+                c[i] = c[nactive];
+                ki[i] = ki[nactive];
+            }
+        }
+    }
+    return nfound;
+}
+
 template <typename P>
 bool tcursor<P>::find_locked(threadinfo& ti)
 {
     node_base<P>* root = const_cast<node_base<P>*>(root_);
     nodeversion_type v;
     permuter_type perm;
+    masstree_precondition(!leaf<P>::fixed_keys
+                          || ka_.length() == P::fixed_key_length);
 
  retry:
     n_ = root->reach_leaf(ka_, v, ti);
@@ -87,9 +230,10 @@ bool tcursor<P>::find_locked(threadinfo& ti)
     kx_ = leaf<P>::bound_type::lower(ka_, *n_);
     if (kx_.p >= 0) {
         leafvalue<P> lv = n_->lv_[kx_.p];
-        lv.prefetch(n_->keylenx_[kx_.p]);
+        lv.prefetch(n_->keylenx(kx_.p));
         state_ = n_->ksuf_matches(kx_.p, ka_);
-        if (state_ < 0 && !n_->has_changed(v) && lv.layer()->is_root()) {
+        if (state_ < 0 && state_ != leaf<P>::frozen_match
+            && !n_->has_changed(v) && lv.layer()->is_root()) {
             ka_.shift_by(-state_);
             root = lv.layer();
             goto retry;
@@ -103,6 +247,11 @@ bool tcursor<P>::find_locked(threadinfo& ti)
         n_->unlock();
         n_ = n_->advance_to_key(ka_, v, ti);
         goto forward;
+    } else if (unlikely(state_ == leaf<P>::frozen_match)) {
+        // writes thaw frozen layers, then continue into the new layer
+        thaw_layer(ti);
+        n_->unlock();
+        goto retry;
     } else if (unlikely(state_ < 0)) {
         ka_.shift_by(-state_);
         n_->lv_[kx_.p] = root = n_->lv_[kx_.p].layer()->maybe_parent();
@@ -117,5 +266,25 @@ bool tcursor<P>::find_locked(threadinfo& ti)
     return state_;
 }
 
+/** @brief Point this cursor at the slot holding the layer for its key.
+    @pre find_locked() was called on a layer's whole prefix
+    @return true if that slot exists
+
+    find_locked() stops at a compressed layer whose path is the rest of
+    the key, leaving the cursor at its slot. Otherwise the key ends in
+    this leaf, and the layer's slot follows any value for the same ikey. */
+template <typename P>
+inline bool tcursor<P>::find_layer_slot()
+{
+    if (ka_.has_suffix())
+        return kx_.p >= 0 && n_->is_layer(kx_.p) && n_->has_ksuf(kx_.p)
+            && n_->ksuf_equals(kx_.p, ka_);
+    kx_.i += has_value();
+    if (kx_.i >= n_->size())
+        return false;
+    kx_.p = permuter_type(n_->permutation_)[kx_.i];
+    return n_->ikey0_[kx_.p] == ka_.ikey() && n_->is_layer(kx_.p);
+}
+
 } // namespace Masstree
 #endif
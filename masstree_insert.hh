@@ -25,7 +25,54 @@ bool tcursor<P>::find_insert(threadinfo& ti)
     find_locked(ti);
     original_n_ = n_;
     original_v_ = n_->full_unlocked_version_value();
+    return make_insert(ti);
+}
+
+/** @brief Find or insert @a key using the leaf this cursor already holds.
+    @pre The cursor is locked after find_insert() or find_insert_next() on
+    a key less than @a key, and no finish() has been called.
 
+    The previous key's pending insertion is completed first. If @a key
+    belongs in the locked leaf, it is found or inserted there without a
+    new descent, splitting if needed. Otherwise the leaf is released and
+    @a key is found with find_insert(). Either way, the cursor then
+    behaves exactly as after find_insert(@a key). */
+template <typename P>
+bool tcursor<P>::find_insert_next(Str key, threadinfo& ti)
+{
+    masstree_precondition(!leaf<P>::fixed_keys
+                          || key.len == P::fixed_key_length);
+    if (state_ == 2)
+        finish_insert();
+    state_ = 1;
+
+    int plen = ka_.prefix_length();
+    if (key.len > plen
+        && (plen == 0 || memcmp(key.s, ka_.prefix_string().s, plen) == 0)) {
+        key_type ka(key);
+        if (plen)
+            ka.shift_by(plen);
+        leaf_type* next = n_->safe_next();
+        if (!next || compare(ka.ikey(), next->ikey_bound()) < 0) {
+            kx_ = leaf<P>::bound_type::lower(ka, *n_);
+            int match = kx_.p >= 0 ? n_->ksuf_matches(kx_.p, ka) : 0;
+            if (match >= 0) {
+                ka_ = ka;
+                state_ = match;
+                return make_insert(ti);
+            }
+        }
+    }
+
+    finish(1, ti);
+    ka_ = key_type(key);
+    new_nodes_.clear();
+    return find_insert(ti);
+}
+
+template <typename P>
+bool tcursor<P>::make_insert(threadinfo& ti)
+{
     // maybe we found it
     if (state_)
         return true;
@@ -43,10 +90,22 @@ bool tcursor<P>::find_insert(threadinfo& ti)
         n_->mark_insert();
         n_->modstate_ = leaf<P>::modstate_insert;
     }
+    n_->history_.record(kx_.i, n_->size());
 
     // try inserting into this node
-    if (n_->size() < n_->width) {
-        kx_.p = permuter_type(n_->permutation_).back();
+    if (n_->size() < n_->capacity()) {
+        permuter_type perm(n_->permutation_);
+        kx_.p = perm.back();
+        // a small leaf may only use slots below its capacity, but removals
+        // can leave a higher free slot at the back
+        if (unlikely(kx_.p >= n_->capacity())) {
+            int i = perm.size();
+            while (perm[i] >= n_->capacity())
+                ++i;
+            perm.exchange(i, n_->width - 1);
+            n_->permutation_ = perm.value();
+            kx_.p = perm.back();
+        }
         // don't inappropriately reuse position 0, which holds the ikey_bound
         if (likely(kx_.p != 0) || !n_->prev_ || n_->ikey_bound() == ka_.ikey()) {
             n_->assign(kx_.p, ka_, ti);
@@ -59,40 +118,50 @@ bool tcursor<P>::find_insert(threadinfo& ti)
 }
 
 template <typename P>
-bool tcursor<P>::make_new_layer(threadinfo& ti) {
+bool tcursor<P>::make_new_layer(threadinfo& ti)
+{
+    // The slot holds either a key with a suffix, or a compressed layer
+    // whose suffix is the path its keys share. Either way, skip the whole
+    // slices the old entry and the new key have in common: they become
+    // the slot's (new) compressed path, so no single-entry layers are
+    // built for them.
+    bool path = n_->is_layer(kx_.p);
     key_type oka(n_->ksuf(kx_.p));
     ka_.shift();
-    int kcmp = oka.compare(ka_);
-
-    // Create a twig of nodes until the suffixes diverge
-    leaf_type* twig_head = n_;
-    leaf_type* twig_tail = n_;
-    while (kcmp == 0) {
-        leaf_type* nl = leaf_type::make_root(0, twig_tail, ti);
-        nl->assign_initialize_for_layer(0, oka);
-        if (twig_head != n_)
-            twig_tail->lv_[0] = nl;
-        else
-            twig_head = nl;
-        nl->permutation_ = permuter_type::make_sorted(1);
-        twig_tail = nl;
-        new_nodes_.emplace_back(nl, nl->full_unlocked_version_value());
+    int nshared = 0, kcmp;
+    while (true) {
+        if (!path)
+            kcmp = oka.compare(ka_);
+        else if (!(kcmp = ::compare(oka.ikey(), ka_.ikey())))
+            // every key in the layer continues past the path
+            kcmp = !ka_.has_suffix();
+        if (kcmp != 0)
+            break;
         oka.shift();
         ka_.shift();
-        kcmp = oka.compare(ka_);
+        ++nshared;
     }
 
-    // Estimate how much space will be required for keysuffixes
+    // Estimate how much space will be required for keysuffixes: room for
+    // half a full-width leaf, or for all of a small one
+    int nksuf = leaf_type::small_width < n_->width ? leaf_type::small_width
+        : n_->width / 2;
     size_t ksufsize;
     if (ka_.has_suffix() || oka.has_suffix())
         ksufsize = (std::max(0, ka_.suffix_length())
-                    + std::max(0, oka.suffix_length())) * (n_->width / 2)
-            + n_->iksuf_[0].overhead(n_->width);
+                    + std::max(0, oka.suffix_length())) * nksuf
+            + leaf_type::internal_ksuf_type::overhead(leaf_type::small_width);
     else
         ksufsize = 0;
-    leaf_type *nl = leaf_type::make_root(ksufsize, twig_tail, ti);
-    nl->assign_initialize(0, kcmp < 0 ? oka : ka_, ti);
-    nl->assign_initialize(1, kcmp < 0 ? ka_ : oka, ti);
+    leaf_type *nl = leaf_type::make_root(ksufsize, n_, ti);
+    // initialize in slot order: assign_ksuf expects earlier slots ready
+    for (int p = 0; p != 2; ++p)
+        if (p != (kcmp > 0))
+            nl->assign_initialize(p, ka_, ti);
+        else if (path)
+            nl->assign_initialize_for_layer(p, oka, ti);
+        else
+            nl->assign_initialize(p, oka, ti);
     nl->lv_[kcmp > 0] = n_->lv_[kx_.p];
     nl->lock(*nl, ti.lock_fence(tc_leaf_lock));
     if (kcmp < 0)
@@ -110,14 +179,18 @@ bool tcursor<P>::make_new_layer(threadinfo& ti) {
     // face of concurrent lockless readers? Mark insertion so they
     // retry.
     n_->mark_insert();
+    n_->modstate_ = leaf<P>::modstate_insert;
     fence();
-    if (twig_tail != n_)
-        twig_tail->lv_[0] = nl;
-    if (twig_head != n_)
-        n_->lv_[kx_.p] = twig_head;
-    else
-        n_->lv_[kx_.p] = nl;
-    n_->keylenx_[kx_.p] = n_->layer_keylenx;
+    if (nshared) {
+        // The shared slices end the new key's prefix. The slot's old
+        // suffix starts with them, so this shrinks it in place.
+        Str pfx = ka_.prefix_string();
+        int plen = nshared * key_type::ikey_size;
+        n_->assign_ksuf(kx_.p, Str(pfx.end() - plen, plen), false, ti);
+    }
+    n_->lv_[kx_.p] = nl;
+    n_->assign_keylenx(kx_.p, nshared ? n_->layer_ksuf_keylenx
+                       : n_->layer_keylenx);
     updated_v_ = n_->full_unlocked_version_value();
     n_->unlock();
     n_ = nl;
@@ -125,6 +198,34 @@ bool tcursor<P>::make_new_layer(threadinfo& ti) {
     return false;
 }
 
+/** @brief Find or insert each of @a n sorted keys.
+    @param keys the keys, in strictly increasing order
+    @param f called as f(i, cursor, found, ti) for each key, with that
+    key's leaf locked; it must set cursor.value() if !found
+    @return the number of keys inserted
+
+    Consecutive keys that fall in the same leaf are handled under a single
+    lock acquisition, without descending from the root again. */
+template <typename P> template <typename F>
+int basic_table<P>::insert_sorted(const Str* keys, int n, F& f,
+                                  threadinfo& ti)
+{
+    if (n <= 0)
+        return 0;
+    tcursor<P> lp(*this, keys[0]);
+    bool found = lp.find_insert(ti);
+    f(0, lp, found, ti);
+    int ninserted = !found;
+    for (int i = 1; i != n; ++i) {
+        masstree_precondition(keys[i - 1] < keys[i]);
+        found = lp.find_insert_next(keys[i], ti);
+        f(i, lp, found, ti);
+        ninserted += !found;
+    }
+    lp.finish(1, ti);
+    return ninserted;
+}
+
 template <typename P>
 void tcursor<P>::finish_insert()
 {
@@ -201,7 +201,7 @@ class key {
     }
     void assign_store_ikey(ikey_type ikey) {
         ikey0_ = ikey;
-        *reinterpret_cast<ikey_type*>(const_cast<char*>(s_)) = host_to_net_order(ikey);
+        write_in_net_order<ikey_type>(const_cast<char*>(s_), ikey);
     }
     int assign_store_suffix(Str s) {
         memcpy(const_cast<char*>(s_ + ikey_size), s.s, s.len);
@@ -0,0 +1,307 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_MODEL_HH
+#define MASSTREE_MODEL_HH
+#include "masstree_struct.hh"
+#include <pthread.h>
+#include <vector>
+namespace Masstree {
+
+/** @brief Piecewise-linear map from a layer-0 ikey to the leaf holding it.
+
+    A leaf_model is a snapshot of the table's layer-0 leaves and their
+    lower-bound ikeys, in order. Line segments fitted to (bound, index)
+    pairs predict each bound's index to within max_error, so find()
+    reaches a leaf with a short search of a dense array instead of a
+    descent through the internodes. The leaf is then validated like a
+    search finger; callers descend from the root when find() fails.
+
+    Splits after the model was built leave it correct but less useful:
+    keys that moved to a new leaf fail validation, and the first such miss
+    marks the model outdated. Freed leaves make it unusable, since the
+    snapshot may point at freed memory. Live models are kept in a
+    registry that leaf frees consult, so freeing one of a model's leaves
+    marks that model, and no other, stale; find() then always fails.
+    basic_table::maintain_model() replaces outdated and stale models. */
+template <typename P>
+class leaf_model {
+  public:
+    typedef typename P::ikey_type ikey_type;
+    typedef typename P::threadinfo_type threadinfo;
+    typedef typename leaf<P>::nodeversion_type nodeversion_type;
+    typedef key<ikey_type> key_type;
+
+    enum { max_error = 8 };
+
+    static leaf_model<P>* make(node_base<P>* root, threadinfo& ti);
+    void deallocate_rcu(threadinfo& ti);
+    static void note_freed(const leaf<P>* lf);
+
+    inline int size() const {
+        return nleaves_;
+    }
+    inline int nsegments() const {
+        return nsegments_;
+    }
+    inline bool stale() const {
+        return stale_;
+    }
+    inline bool outdated() const {
+        return stale_ || missed_;
+    }
+
+    inline leaf<P>* find(const key_type& ka, nodeversion_type& version,
+                         threadinfo& ti) const;
+
+  private:
+    struct segment {
+        ikey_type first;        // == bounds_[base]
+        double slope;
+        int base;
+        int last;
+    };
+
+    ikey_type* bounds_;
+    segment* segments_;
+    leaf<P>** leaves_;
+    size_t size_;
+    leaf_model<P>* next_;       // in the registry
+    int nleaves_;
+    int nsegments_;
+    volatile bool stale_;       // one of leaves_ was freed
+    mutable volatile bool missed_; // find() failed to validate a leaf
+
+    static leaf_model<P>* registry_;
+    static pthread_mutex_t registry_mu_;
+
+    inline int locate(ikey_type ikey) const;
+    void publish();
+};
+
+template <typename P> leaf_model<P>* leaf_model<P>::registry_;
+template <typename P>
+pthread_mutex_t leaf_model<P>::registry_mu_ = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Return the index of the leaf whose bounds include @a ikey. */
+template <typename P>
+inline int leaf_model<P>::locate(ikey_type ikey) const
+{
+    int l = 0, r = nsegments_;
+    while (r - l > 1) {
+        int m = (l + r) >> 1;
+        if (segments_[m].first <= ikey)
+            l = m;
+        else
+            r = m;
+    }
+    const segment& s = segments_[l];
+
+    // Search the predicted window, or the whole segment if the key lies
+    // outside the window (possible between fitted bounds).
+    double pos = s.slope * double(ikey - s.first);
+    int p = pos < double(s.last - s.base) ? s.base + int(pos) : s.last;
+    l = std::max(p - max_error - 1, s.base);
+    r = std::min(p + max_error + 1, s.last);
+    if (bounds_[l] > ikey || (r != s.last && bounds_[r + 1] <= ikey)) {
+        l = s.base;
+        r = s.last;
+    }
+    while (l != r) {
+        int m = (l + r + 1) >> 1;
+        if (bounds_[m] <= ikey)
+            l = m;
+        else
+            r = m - 1;
+    }
+    return l;
+}
+
+/** @brief Return the leaf responsible for @a ka, or null.
+    @pre @a ka is a layer-0 key
+
+    Sets @a version to the returned leaf's stable version. Returns null if
+    the model is stale or its leaf no longer covers @a ka; the latter
+    marks the model outdated. */
+template <typename P>
+inline leaf<P>* leaf_model<P>::find(const key_type& ka,
+                                    nodeversion_type& version,
+                                    threadinfo& ti) const
+{
+    if (!stale_) {
+        acquire_fence();
+        leaf<P>* lf = leaves_[locate(ka.ikey())];
+        version = lf->stable_annotated(ti.stable_fence());
+        if (likely(!version.deleted()) && lf->covers(ka.ikey())) {
+            ti.mark(tc_model_hit);
+            return lf;
+        }
+        if (!missed_)
+            missed_ = true;
+    }
+    ti.mark(tc_model_miss);
+    return nullptr;
+}
+
+/** @brief Build and register a model of the layer-0 leaves under @a root.
+    @pre The calling thread is in an RCU critical section. */
+template <typename P>
+leaf_model<P>* leaf_model<P>::make(node_base<P>* root, threadinfo& ti)
+{
+    std::vector<leaf<P>*> leaves;
+    std::vector<ikey_type> bounds;
+    nodeversion_type v;
+    key_type ka{Str()};
+    for (leaf<P>* lf = root->reach_leaf(ka, v, ti); lf;
+         lf = lf->safe_next()) {
+        v = lf->stable();
+        ikey_type bound = leaves.empty() ? ikey_type(0) : lf->ikey_bound();
+        if (!v.deleted() && (leaves.empty() || bound > bounds.back())) {
+            leaves.push_back(lf);
+            bounds.push_back(bound);
+        }
+    }
+
+    // Fit segments greedily: extend each segment while some line through
+    // its first point passes within max_error of every later point.
+    std::vector<segment> segments;
+    int n = leaves.size();
+    for (int i = 0; i != n; ) {
+        segment s;
+        s.first = bounds[i];
+        s.base = i;
+        double lo = 0, hi = 0;
+        int j;
+        for (j = i + 1; j != n; ++j) {
+            double dx = double(bounds[j] - bounds[i]);
+            double jlo = (j - i - max_error) / dx;
+            double jhi = (j - i + max_error) / dx;
+            if (j != i + 1 && (jlo > hi || jhi < lo))
+                break;
+            lo = j == i + 1 ? std::max(jlo, 0.0) : std::max(lo, jlo);
+            hi = j == i + 1 ? jhi : std::min(hi, jhi);
+        }
+        s.slope = (lo + hi) / 2;
+        s.last = j - 1;
+        segments.push_back(s);
+        i = j;
+    }
+
+    size_t bounds_size = sizeof(ikey_type) * n;
+    size_t segments_size = sizeof(segment) * segments.size();
+    size_t size = iceil(sizeof(leaf_model<P>), alignof(segment))
+        + segments_size + bounds_size + sizeof(leaf<P>*) * n;
+    char* p = (char*) ti.allocate(size, memtag_masstree_model);
+    leaf_model<P>* m = new(p) leaf_model<P>;
+    p += iceil(sizeof(leaf_model<P>), alignof(segment));
+    m->segments_ = reinterpret_cast<segment*>(p);
+    p += segments_size;
+    m->bounds_ = reinterpret_cast<ikey_type*>(p);
+    p += bounds_size;
+    m->leaves_ = reinterpret_cast<leaf<P>**>(p);
+    std::copy(segments.begin(), segments.end(), m->segments_);
+    std::copy(bounds.begin(), bounds.end(), m->bounds_);
+    std::copy(leaves.begin(), leaves.end(), m->leaves_);
+    m->size_ = size;
+    m->nleaves_ = n;
+    m->nsegments_ = segments.size();
+    m->stale_ = m->missed_ = false;
+    m->publish();
+    return m;
+}
+
+/** @brief Add this model to the registry, then recheck its leaves.
+
+    A leaf freed while the model was being built may have been missed by
+    note_freed(), but it was marked deleted first, so the recheck finds
+    it. */
+template <typename P>
+void leaf_model<P>::publish()
+{
+    pthread_mutex_lock(&registry_mu_);
+    next_ = registry_;
+    release_fence();
+    registry_ = this;
+    pthread_mutex_unlock(&registry_mu_);
+    memory_fence();
+    for (int i = 0; i != nleaves_ && !stale_; ++i)
+        if (leaves_[i]->deleted())
+            stale_ = true;
+}
+
+/** @brief Mark every registered model that refers to @a lf stale.
+    @pre @a lf is marked deleted, or unreachable, and is being freed
+    after an RCU grace period. */
+template <typename P>
+void leaf_model<P>::note_freed(const leaf<P>* lf)
+{
+    memory_fence();
+    // The model records the leftmost leaf with bound 0.
+    ikey_type bound = lf->ikey_bound();
+    for (leaf_model<P>* m = registry_; m; m = m->next_)
+        if (!m->stale_
+            && (m->leaves_[m->locate(bound)] == lf || m->leaves_[0] == lf))
+            m->stale_ = true;
+}
+
+/** @brief Unregister this model and free it after an RCU grace period. */
+template <typename P>
+void leaf_model<P>::deallocate_rcu(threadinfo& ti)
+{
+    pthread_mutex_lock(&registry_mu_);
+    leaf_model<P>** pprev = &registry_;
+    while (*pprev != this)
+        pprev = &(*pprev)->next_;
+    *pprev = next_;
+    pthread_mutex_unlock(&registry_mu_);
+    ti.deallocate_rcu(this, size_, memtag_masstree_model);
+}
+
+
+/** @brief Rebuild the model lookups use to skip the descent to a leaf.
+    @pre The calling thread is in an RCU critical section.
+
+    Does nothing unless P::leaf_model. */
+template <typename P>
+void basic_table<P>::build_model(threadinfo& ti)
+{
+    if (P::leaf_model) {
+        leaf_model<P>* m = leaf_model<P>::make(fix_root(), ti);
+        leaf_model<P>* old = xchg(&model_, m);
+        if (old)
+            old->deallocate_rcu(ti);
+    }
+}
+
+/** @brief Rebuild the model if there is none, or if it is outdated or
+    stale.
+    @pre The calling thread is in an RCU critical section.
+    @return true iff the model was rebuilt
+
+    The model is a snapshot, so applications call this periodically;
+    mtd does so from a maintenance thread. A model with no misses is
+    left alone, so an idle or read-only table is not rebuilt again. */
+template <typename P>
+bool basic_table<P>::maintain_model(threadinfo& ti)
+{
+    const leaf_model<P>* m = model_;
+    if (!P::leaf_model || (m && !m->outdated()))
+        return false;
+    build_model(ti);
+    return true;
+}
+
+} // namespace Masstree
+#endif
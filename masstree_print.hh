@@ -16,6 +16,7 @@
 #ifndef MASSTREE_PRINT_HH
 #define MASSTREE_PRINT_HH
 #include "masstree_struct.hh"
+#include "masstree_frozen.hh"
 #include <stdio.h>
 #include <inttypes.h>
 
@@ -74,7 +75,7 @@ void leaf<P>::print(FILE *f, const char *prefix, int depth, int kdepth) const
     do {
         v = *this;
         fence();
-        perm = permutation_;
+        perm = permutation();
     } while (this->has_changed(v));
     int indent = 2 * depth;
     if (depth > P::print_max_indent_depth && P::print_max_indent_depth > 0)
@@ -100,7 +101,7 @@ void leaf<P>::print(FILE *f, const char *prefix, int depth, int kdepth) const
                 (uint64_t) v.version_value(),
                 modstate_ <= 2 ? modstates[modstate_] : "??",
                 perm.unparse().c_str(),
-                parent_, prev_, next_.ptr,
+                (void*) parent_, (void*) prev_, (void*) next_.ptr,
                 l, buf);
     }
 
@@ -112,7 +113,7 @@ void leaf<P>::print(FILE *f, const char *prefix, int depth, int kdepth) const
     for (int idx = 0; idx < perm.size(); ++idx) {
         int p = perm[idx];
         int l = P::key_unparse_type::unparse_key(this->get_key(p), keybuf, sizeof(keybuf));
-        sprintf(xbuf, " #%x/%d", p, keylenx_[p]);
+        sprintf(xbuf, " #%x/%d", p, keylenx(p));
         leafvalue_type lv = lv_[p];
         if (this->has_changed(v)) {
             fprintf(f, "%s%*s[NODE CHANGED]\n", prefix, indent + 2, "");
@@ -124,8 +125,11 @@ void leaf<P>::print(FILE *f, const char *prefix, int depth, int kdepth) const
             node_base<P> *n = lv.layer();
             while (!n->is_root())
                 n = n->maybe_parent();
-            n->print(f, prefix, depth + 1, kdepth + key_type::ikey_size);
-        } else {
+            int klen = has_ksuf(p) ? get_key(p).length() : key_type::ikey_size;
+            n->print(f, prefix, depth + 1, kdepth + klen);
+        } else if (is_frozen(p))
+            fprintf(f, "%s%*s%.*s = FROZEN %d keys%s\n", prefix, indent + 2, "", l, keybuf, lv.frozen()->size(), xbuf);
+        else {
             typename P::value_type tvx = lv.value();
             P::value_print_type::print(tvx, f, prefix, indent + 2, Str(keybuf, l), initial_timestamp, xbuf);
         }
@@ -157,7 +161,7 @@ void internode<P>::print(FILE* f, const char* prefix, int depth, int kdepth) con
         fprintf(f, "%s%*sinternode %p[%u]%s: %d keys, version %" PRIx64 ", parent %p%.*s\n",
                 prefix, indent, "", this,
                 height_, this->deleted() ? " [DELETED]" : "",
-                copy.size(), (uint64_t) copy.version_value(), copy.parent_,
+                copy.size(), (uint64_t) copy.version_value(), (void*) copy.parent_,
                 l, buf);
     }
 
@@ -0,0 +1,264 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2014 President and Fellows of Harvard College
+ * Copyright (c) 2012-2014 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef MASSTREE_RELOCATE_HH
+#define MASSTREE_RELOCATE_HH
+#include "masstree_struct.hh"
+#include "masstree_model.hh"
+#include "btree_leaflink.hh"
+#include "memdebug.hh"
+#include <vector>
+namespace Masstree {
+
+/** @brief Copies a table's leaves into contiguous memory in key order.
+
+    Each call to run() visits the next few leaves in scan order, descending
+    into trie layers as a scan would, and copies every leaf that does not
+    already continue a contiguous run into this thread's sequential pool
+    chunk. A copy replaces its original under the leaf and parent locks,
+    as a split would; the original is marked deleted, so concurrent
+    readers retry, and is freed after an RCU grace period.
+
+    Leftmost leaves and layer roots stay put, since other structures point
+    at them, as do the leaves of layers that were frozen. The relocator
+    keeps only keys between calls, so it may be used concurrently with any
+    other table operation. Callers limit its rate by choosing how many
+    leaves each run() visits and how often to call it. */
+template <typename P>
+class leaf_relocator {
+  public:
+    typedef typename P::ikey_type ikey_type;
+    typedef typename P::threadinfo_type threadinfo;
+    typedef node_base<P> node_type;
+    typedef leaf<P> leaf_type;
+    typedef internode<P> internode_type;
+    typedef typename leaf_type::nodeversion_type nodeversion_type;
+    typedef typename leaf_type::permuter_type permuter_type;
+    typedef key<ikey_type> key_type;
+
+    explicit leaf_relocator(basic_table<P>& table);
+
+    int run(int nvisit, threadinfo& ti);
+
+    /** @brief Return the number of completed passes over the table. */
+    uint64_t passes() const {
+        return passes_;
+    }
+
+  private:
+    struct frame {
+        ikey_type ikey;         // next position in this layer
+        ikey_type bound;        // bound of the last leaf visited here
+        bool visited;           // false until a leaf is visited here
+        bool exhausted;         // visited the layer at the largest ikey
+        frame()
+            : ikey(0), bound(0), visited(false), exhausted(false) {
+        }
+    };
+
+    basic_table<P>& table_;
+    std::vector<frame> stack_;
+    const char* last_end_;
+    uint64_t passes_;
+
+    node_type* layer_root(threadinfo& ti);
+    void finish_layer();
+    static const char* end(const leaf_type* lf);
+    bool in_place(const leaf_type* lf) const;
+    leaf_type* relocate(leaf_type* lf, threadinfo& ti);
+};
+
+template <typename P>
+leaf_relocator<P>::leaf_relocator(basic_table<P>& table)
+    : table_(table), stack_(1), last_end_(nullptr), passes_(0) {
+}
+
+/** @brief Return the root of the layer on top of the stack.
+
+    Pops the frames for any layers that have since disappeared, in which
+    case it returns null. */
+template <typename P>
+node_base<P>* leaf_relocator<P>::layer_root(threadinfo& ti)
+{
+    node_type* root = table_.fix_root();
+    for (size_t d = 0; d + 1 < stack_.size(); ++d) {
+        ikey_type ikey = stack_[d].ikey;
+        nodeversion_type v;
+        leaf_type* lf = root->reach_leaf(key_type(ikey), v, ti);
+        node_type* next;
+        while (true) {
+            next = nullptr;
+            permuter_type perm = lf->permutation();
+            for (int i = 0; i != perm.size(); ++i) {
+                int p = perm[i];
+                if (lf->ikey(p) == ikey && lf->is_layer(p)) {
+                    next = lf->lv_[p].layer();
+                    break;
+                }
+            }
+            if (!lf->has_changed(v))
+                break;
+            lf = lf->advance_to_key(key_type(ikey), v, ti);
+            if (v.deleted())
+                lf = root->reach_leaf(key_type(ikey), v, ti);
+        }
+        if (!next) {
+            stack_.resize(d + 2);
+            finish_layer();
+            return nullptr;
+        }
+        root = next;
+    }
+    return root;
+}
+
+/** @brief Pop the top layer and advance past its slot in the layer above. */
+template <typename P>
+void leaf_relocator<P>::finish_layer()
+{
+    stack_.pop_back();
+    frame& f = stack_.back();
+    if (f.ikey == ~ikey_type(0))
+        f.exhausted = true;
+    else
+        ++f.ikey;
+}
+
+/** @brief Return where a leaf allocated right after @a lf would start. */
+template <typename P>
+inline const char* leaf_relocator<P>::end(const leaf_type* lf)
+{
+    return reinterpret_cast<const char*>(lf)
+        + iceil(lf->allocated_size() + memdebug_size, CACHE_LINE_SIZE);
+}
+
+/** @brief Return true if @a lf already continues a contiguous run. */
+template <typename P>
+bool leaf_relocator<P>::in_place(const leaf_type* lf) const
+{
+    return reinterpret_cast<const char*>(lf) == last_end_
+        || reinterpret_cast<const char*>(lf->safe_next()) == end(lf);
+}
+
+/** @brief Visit up to @a nvisit leaves, relocating those out of place.
+    @return the number of leaves relocated
+    @pre The calling thread is in an RCU critical section.
+
+    Returns early when a pass over the whole table completes. */
+template <typename P>
+int leaf_relocator<P>::run(int nvisit, threadinfo& ti)
+{
+    int nrelocated = 0;
+    while (nvisit > 0) {
+        node_type* root = layer_root(ti);
+        if (!root)
+            continue;
+        frame* f = &stack_.back();
+
+        nodeversion_type v;
+        leaf_type* lf = root->reach_leaf(key_type(f->ikey), v, ti);
+        ikey_type bound = lf->prev_ ? lf->ikey_bound() : ikey_type(0);
+        if (!f->visited || bound != f->bound) {
+            if (!in_place(lf)) {
+                leaf_type* nl = relocate(lf, ti);
+                nrelocated += nl != lf;
+                lf = nl;
+            }
+            f->visited = true;
+            f->bound = bound;
+            last_end_ = end(lf);
+            --nvisit;
+            continue;
+        }
+
+        // descend into the next layer at or after f->ikey
+        permuter_type perm = lf->permutation();
+        int layerp = -1;
+        for (int i = 0; i != perm.size() && layerp < 0 && !f->exhausted; ++i) {
+            int p = perm[i];
+            if (lf->ikey(p) >= f->ikey && lf->is_layer(p))
+                layerp = p;
+        }
+        ikey_type layer_ikey = layerp >= 0 ? lf->ikey(layerp) : ikey_type(0);
+        leaf_type* next = lf->safe_next();
+        ikey_type next_ikey = next ? next->ikey_bound() : ikey_type(0);
+        if (lf->has_changed(v))
+            continue;
+
+        if (layerp >= 0) {
+            f->ikey = layer_ikey;
+            stack_.push_back(frame());
+        } else if (next)
+            f->ikey = next_ikey;
+        else if (stack_.size() > 1)
+            finish_layer();
+        else {
+            stack_.back() = frame();
+            last_end_ = nullptr;
+            ++passes_;
+            break;
+        }
+    }
+    return nrelocated;
+}
+
+/** @brief Copy @a lf to this thread's sequential chunk and swap the copy
+    into the tree.
+    @return the copy, or @a lf if it could not be relocated */
+template <typename P>
+leaf<P>* leaf_relocator<P>::relocate(leaf_type* lf, threadinfo& ti)
+{
+    nodeversion_type v = lf->lock(*lf, ti.lock_fence(tc_leaf_lock));
+    if (v.deleted() || v.is_root() || !lf->prev_ || lf->deleted_layer()) {
+        lf->unlock(v);
+        return lf;
+    }
+    internode_type* p = lf->locked_parent(ti);
+    int kp = internode_type::bound_type::upper(lf->ikey_bound(), *p);
+    if (p->child_[kp] != lf) {
+        for (kp = 0; kp <= p->size() && p->child_[kp] != lf; ++kp) {
+        }
+        if (kp > p->size()) {
+            p->unlock();
+            lf->unlock(v);
+            return lf;
+        }
+    }
+
+    size_t sz = lf->allocated_size();
+    void* ptr = ti.pool_allocate_sequential(sz, node_memtag<P>(memtag_masstree_leaf));
+    memcpy(ptr, static_cast<const void*>(lf), sz);
+    leaf_type* nl = reinterpret_cast<leaf_type*>(ptr);
+    if (lf->ksuf_) {
+        size_t ksz = lf->ksuf_->capacity();
+        void* kptr = ti.allocate(ksz, memtag_masstree_ksuffixes);
+        memcpy(kptr, static_cast<const void*>(lf->ksuf_), ksz);
+        nl->ksuf_ = reinterpret_cast<typename leaf_type::external_ksuf_type*>(kptr);
+    }
+
+    btree_leaflink<leaf_type>::replace(lf, nl);
+    p->mark_insert();
+    p->child_[kp] = nl;
+    lf->mark_deleted();
+    fence();
+    p->unlock();
+    lf->unlock();
+    nl->unlock();
+    lf->deallocate_rcu(ti);
+    return nl;
+}
+
+} // namespace Masstree
+#endif
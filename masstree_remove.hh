@@ -18,6 +18,7 @@
 #include "masstree_get.hh"
 #include "btree_leaflink.hh"
 #include "circular_int.hh"
+#include "straccum.hh"
 namespace Masstree {
 
 template <typename P>
@@ -26,25 +27,10 @@ bool tcursor<P>::gc_layer(threadinfo& ti)
     find_locked(ti);
     masstree_precondition(!n_->deleted() && !n_->deleted_layer());
 
-    // find_locked might return early if another gc_layer attempt has
-    // succeeded at removing multiple tree layers. So check that the whole
-    // key has been consumed
-    if (ka_.has_suffix()) {
-        return false;
-    }
-
-    // find the slot for the child tree
-    // ka_ is a multiple of ikey_size bytes long. We are looking for the entry
-    // for the next tree layer, which has keylenx_ corresponding to ikey_size+1.
-    // So if has_value(), then we found an entry for the same ikey, but with
-    // length ikey_size; we need to adjust ki_.
-    kx_.i += has_value();
-    if (kx_.i >= n_->size()) {
-        return false;
-    }
-    permuter_type perm(n_->permutation_);
-    kx_.p = perm[kx_.i];
-    if (n_->ikey0_[kx_.p] != ka_.ikey() || !n_->is_layer(kx_.p)) {
+    // find the slot for the child tree. find_locked might return early if
+    // another gc_layer attempt has succeeded at removing multiple tree
+    // layers, so this checks that the whole key has been consumed
+    if (!find_layer_slot()) {
         return false;
     }
 
@@ -168,13 +154,95 @@ bool tcursor<P>::finish_remove(threadinfo& ti) {
     permuter_type perm(n_->permutation_);
     perm.remove(kx_.i);
     n_->permutation_ = perm.value();
-    if (perm.size()) {
+    if (perm.size() > P::leaf_merge_size) {
         return false;
+    } else if (perm.size()) {
+        return merge_leaf(ti);
     } else {
         return remove_leaf(n_, root_, ka_.prefix_string(), ti);
     }
 }
 
+/** @brief Try to merge the underfull leaf n_ with a neighbor.
+    @pre n_ is locked
+    @return true iff n_ was merged away (and unlocked)
+
+    Leaves are merged leftward, into n_'s predecessor if it has one and
+    into n_ otherwise, so the surviving leaf keeps its ikey bound. The
+    other leaf is only try-locked: merging is opportunistic and never
+    waits for a neighbor. */
+template <typename P>
+bool tcursor<P>::merge_leaf(threadinfo& ti)
+{
+    leaf_type* l = n_->prev_;
+    leaf_type* r = n_;
+    if (!l) {
+        l = n_;
+        r = n_->safe_next();
+        if (!r)
+            return false;
+    }
+    leaf_type* other = l == n_ ? r : l;
+    // leave room so the merged leaf does not split on the next insert
+    int max_size = l->width - l->width / 4;
+    if (l->size() + r->size() >= max_size
+        || !other->try_lock(ti.lock_fence(tc_leaf_lock)))
+        return false;
+    // with both leaves locked, check that they are still neighbors
+    if (other->deleted() || l->safe_next() != r || r->prev_ != l
+        || l->size() + r->size() >= max_size) {
+        other->unlock();
+        return false;
+    }
+    merge_into(l, r, root_, ti);
+    if (r == n_) {
+        l->unlock();
+        return true;
+    } else
+        return false;
+}
+
+/** @brief Move all of leaf @a r's entries into its predecessor @a l, then
+    remove @a r from the tree.
+    @pre @a l and @a r are locked neighbors with room for @a r's entries
+    @post @a r is deleted and unlocked; @a l is still locked
+
+    Entries are appended to @a l one at a time, each published with a new
+    permutation, so key suffix reallocation sees every moved suffix.
+    Readers of @a l retry because it is marked inserting; readers of @a r
+    find it deleted and retry from the root, which leads to @a l. */
+template <typename P>
+bool tcursor<P>::merge_into(leaf_type* l, leaf_type* r, node_type* root,
+                            threadinfo& ti)
+{
+    masstree_precondition(l->locked() && r->locked() && r->prev_ == l);
+    l->mark_insert();
+    l->modstate_ = leaf<P>::modstate_insert;
+
+    permuter_type lperm(l->permutation_);
+    permuter_type rperm(r->permutation_);
+    masstree_invariant(lperm.size() + rperm.size() < l->width);
+    for (int i = 0; i != rperm.size(); ++i) {
+        int rp = rperm[i];
+        int si = lperm.size();
+        // don't reuse position 0, which holds the ikey_bound
+        if (lperm[si] == 0 && l->prev_)
+            ++si;
+        int p = lperm[si];
+        l->lv_[p] = r->lv_[rp];
+        l->ikey0_[p] = r->ikey0_[rp];
+        l->assign_keylenx(p, r->keylenx(rp));
+        if (r->has_ksuf(rp))
+            l->assign_ksuf(p, r->ksuf(rp), false, ti);
+        lperm.insert_selected(lperm.size(), si);
+        fence();
+        l->permutation_ = lperm.value();
+    }
+
+    // remove_leaf also carries r's phantom epoch over to l
+    return remove_leaf(r, root, Str(), ti);
+}
+
 template <typename P>
 bool tcursor<P>::remove_leaf(leaf_type* leaf, node_type* root,
                              Str prefix, threadinfo& ti)
@@ -250,10 +318,113 @@ bool tcursor<P>::remove_leaf(leaf_type* leaf, node_type* root,
         p->child_[0] = nullptr;
     }
 
-    n->unlock();
+    if (n->is_root()
+        || static_cast<internode_type*>(n)->nkeys_ > P::internode_merge_size)
+        n->unlock();
+    else
+        balance_internode(static_cast<internode_type*>(n), ti);
     return true;
 }
 
+/** @brief Merge or rebalance the underfull internode @a n with a sibling.
+    @pre @a n is locked and is not a root
+    @post @a n is unlocked
+
+    The sibling is only try-locked. If the two fit in one internode with
+    room to spare, the right one's children move into the left one and
+    the right one is deleted; a reader still in it sees the same
+    children as before, all of which remain live. Otherwise, if @a n is
+    the right sibling, children move to it from the end of its left
+    sibling, which is marked as splitting, so a reader there whose key is
+    now past its last key retries from the root, as after a split.
+    Children never move leftward out of a live internode, since a reader
+    could then descend past its key. A merge that leaves the parent
+    underfull repeats at the parent. */
+template <typename P>
+void tcursor<P>::balance_internode(internode_type* n, threadinfo& ti)
+{
+    while (true) {
+        internode_type* p = n->locked_parent(ti);
+        int kp = 0;
+        while (p->child_[kp] != n)
+            ++kp;
+        masstree_invariant(kp <= p->nkeys_);
+
+        // prefer the left sibling; child_[0] may be null
+        int rkp = kp ? kp : 1;
+        node_type* other = nullptr;
+        if (kp && p->child_[kp - 1])
+            other = p->child_[kp - 1];
+        else if (kp < p->nkeys_) {
+            rkp = kp + 1;
+            other = p->child_[rkp];
+        }
+        if (!other || other->isleaf()
+            || !other->try_lock(ti.lock_fence(tc_internode_lock))) {
+            p->unlock();
+            n->unlock();
+            return;
+        }
+        node_type* lx = p->child_[rkp - 1];
+        node_type* rx = p->child_[rkp];
+        internode_type* l = static_cast<internode_type*>(lx);
+        internode_type* r = static_cast<internode_type*>(rx);
+        masstree_invariant(!other->deleted());
+
+        // A null child_[0] in r has an empty key range, and its separator
+        // in p equals r's first key, so both are dropped.
+        int nl = l->nkeys_, nr = r->nkeys_;
+        int extra = r->child_[0] ? 1 : 0;
+        bool merged = false;
+        if (nl + nr + extra < n->width - n->width / 4 && p->nkeys_ > 1) {
+            l->mark_insert();
+            r->mark_deleted();
+            p->mark_insert();
+            int i = nl;
+            for (int j = 1 - extra; j <= nr; ++j, ++i) {
+                l->ikey0_[i] = j ? r->ikey0_[j - 1] : p->ikey0_[rkp - 1];
+                node_type* c = r->child_[j];
+                l->child_[i + 1] = c;
+                c->set_parent(l);
+            }
+            l->nkeys_ = i;
+            p->shift_down(rkp - 1, rkp, p->nkeys_ - rkp);
+            --p->nkeys_;
+            r->deallocate_rcu(ti);
+            merged = true;
+        } else if (r == n && nl > nr + 1) {
+            int m = (nl - nr) / 2;
+            int shift = m - 1 + extra;
+            l->mark_split();
+            r->mark_insert();
+            p->mark_insert();
+            r->shift_up(shift, 0, nr);
+            if (extra) {
+                r->ikey0_[shift - 1] = p->ikey0_[rkp - 1];
+                r->child_[shift] = r->child_[0];
+            }
+            for (int j = 0; j != m; ++j) {
+                node_type* c = l->child_[nl - m + 1 + j];
+                if (j)
+                    r->ikey0_[j - 1] = l->ikey0_[nl - m + j];
+                r->child_[j] = c;
+                c->set_parent(r);
+            }
+            r->nkeys_ = nr + shift;
+            p->ikey0_[rkp - 1] = l->ikey0_[nl - m];
+            l->nkeys_ = nl - m;
+        }
+
+        other->unlock();
+        n->unlock();
+        if (!merged || p->is_root() || p->nkeys_ > P::internode_merge_size) {
+            p->unlock();
+            return;
+        }
+        n = p;
+    }
+}
+
 template <typename P>
 void tcursor<P>::redirect(internode_type* n, ikey_type ikey,
                           ikey_type replacement_ikey, threadinfo& ti)
@@ -275,40 +446,52 @@ void tcursor<P>::redirect(internode_type* n, ikey_type ikey,
     n->unlock();
 }
 
+/** @brief Value disposer that leaves values alone.
+
+    Used when destroying a whole tree, whose values belong to the caller. */
 template <typename P>
+struct ignore_values {
+    void operator()(typename P::value_type&,
+                    typename P::threadinfo_type&) const {
+    }
+};
+
+template <typename P, typename F = ignore_values<P> >
 struct destroy_rcu_callback : public P::threadinfo_type::mrcu_callback {
     typedef typename P::threadinfo_type threadinfo;
     typedef typename node_base<P>::leaf_type leaf_type;
     typedef typename node_base<P>::internode_type internode_type;
+    typedef node_pointer<P, node_base<P> > link_type;
     node_base<P>* root_;
     int count_;
-    destroy_rcu_callback(node_base<P>* root)
-        : root_(root), count_(0) {
+    F dispose_;
+    destroy_rcu_callback(node_base<P>* root, const F& dispose)
+        : root_(root), count_(0), dispose_(dispose) {
     }
     void operator()(threadinfo& ti);
-    static void make(node_base<P>* root, Str prefix, threadinfo& ti);
+    static void make(node_base<P>* root, const F& dispose, threadinfo& ti);
   private:
-    static inline node_base<P>** link_ptr(node_base<P>* n);
-    static inline void enqueue(node_base<P>* n, node_base<P>**& tailp);
+    static inline link_type* link_ptr(node_base<P>* n);
+    static inline void enqueue(node_base<P>* n, link_type*& tailp);
 };
 
-template <typename P>
-inline node_base<P>** destroy_rcu_callback<P>::link_ptr(node_base<P>* n) {
+template <typename P, typename F>
+inline auto destroy_rcu_callback<P, F>::link_ptr(node_base<P>* n) -> link_type* {
     if (n->isleaf())
         return &static_cast<leaf_type*>(n)->parent_;
     else
         return &static_cast<internode_type*>(n)->parent_;
 }
 
-template <typename P>
-inline void destroy_rcu_callback<P>::enqueue(node_base<P>* n,
-                                             node_base<P>**& tailp) {
+template <typename P, typename F>
+inline void destroy_rcu_callback<P, F>::enqueue(node_base<P>* n,
+                                                link_type*& tailp) {
     *tailp = n;
     tailp = link_ptr(n);
 }
 
-template <typename P>
-void destroy_rcu_callback<P>::operator()(threadinfo& ti) {
+template <typename P, typename F>
+void destroy_rcu_callback<P, F>::operator()(threadinfo& ti) {
     if (++count_ == 1) {
         while (!root_->is_root()) {
             root_ = root_->maybe_parent();
@@ -320,12 +503,12 @@ void destroy_rcu_callback<P>::operator()(threadinfo& ti) {
         return;
     }
 
-    node_base<P>* workq;
-    node_base<P>** tailp = &workq;
+    link_type workq;
+    link_type* tailp = &workq;
     enqueue(root_, tailp);
 
     while (node_base<P>* n = workq) {
-        node_base<P>** linkp = link_ptr(n);
+        link_type* linkp = link_ptr(n);
         if (linkp != tailp) {
             workq = *linkp;
         } else {
@@ -340,6 +523,10 @@ void destroy_rcu_callback<P>::operator()(threadinfo& ti) {
                 int p = perm[i];
                 if (l->is_layer(p))
                     enqueue(l->lv_[p].layer(), tailp);
+                else if (l->is_frozen(p))
+                    l->lv_[p].frozen()->destroy(dispose_, ti);
+                else
+                    dispose_(l->lv_[p].value(), ti);
             }
             l->deallocate(ti);
         } else {
@@ -351,18 +538,172 @@ void destroy_rcu_callback<P>::operator()(threadinfo& ti) {
             in->deallocate(ti);
         }
     }
-    ti.deallocate(this, sizeof(this), memtag_masstree_gc);
+    this->~destroy_rcu_callback();
+    ti.deallocate(this, sizeof(*this), memtag_masstree_gc);
+}
+
+template <typename P, typename F>
+void destroy_rcu_callback<P, F>::make(node_base<P>* root, const F& dispose,
+                                      threadinfo& ti) {
+    void* data = ti.allocate(sizeof(destroy_rcu_callback<P, F>),
+                             memtag_masstree_gc);
+    destroy_rcu_callback<P, F>* cb =
+        new(data) destroy_rcu_callback<P, F>(root, dispose);
+    ti.rcu_register(cb);
 }
 
 template <typename P>
 void basic_table<P>::destroy(threadinfo& ti) {
+    if (model_) {
+        model_->deallocate_rcu(ti);
+        model_ = 0;
+    }
     if (root_) {
-        void* data = ti.allocate(sizeof(destroy_rcu_callback<P>), memtag_masstree_gc);
-        destroy_rcu_callback<P>* cb = new(data) destroy_rcu_callback<P>(root_);
-        ti.rcu_register(cb);
+        destroy_rcu_callback<P>::make(root_, ignore_values<P>(), ti);
         root_ = 0;
     }
 }
 
+/** @brief Remove the entries of locked leaf n_ that lie in [ka_, @a last).
+    @param f called as f(value, ti) for each removed value
+    @param[out] next the key at which to resume, if the range may continue
+      past n_
+    @return true iff the range may continue past n_
+    @post n_ is unlocked
+
+    A trie layer whose keys all lie in the range is dropped by removing
+    its slot; the layer itself is torn down after an RCU grace period,
+    and its values are passed to a copy of @a f at that time. */
+template <typename P> template <typename F>
+bool tcursor<P>::remove_range_locked(Str last, F& f, lcdf::StringAccum& next,
+                                     threadinfo& ti)
+{
+    Str first = ka_.full_string();
+    Str prefix = ka_.prefix_string();
+    permuter_type perm(n_->permutation_);
+    node_type* layers[leaf_type::width];
+    int nlayers = 0, rfirst = -1, nremoved = 0;
+    bool more = true;
+    lcdf::StringAccum ks;
+    next.clear();
+
+    int i;
+    for (i = kx_.i; i < perm.size(); ++i) {
+        int p = perm[i];
+        key_type k = n_->get_key(p);
+        ks.clear();
+        ks.append(prefix.s, prefix.len);
+        k.unparse(ks.extend(k.length()), k.length());
+        Str kstr(ks.data(), ks.length());
+
+        if (n_->is_layer(p) || n_->is_frozen(p)) {
+            // The layer holds the keys that extend kstr.
+            if (first.length() > kstr.length() && first.starts_with(kstr)) {
+                next.append(first.s, first.len);
+                break;
+            } else if (last.length() > kstr.length() && last.starts_with(kstr)) {
+                next.append(kstr.s, kstr.len);
+                next.append('\0');
+                break;
+            } else if (last.compare(kstr) <= 0) {
+                more = false;
+                break;
+            } else if (kstr.compare(first) < 0) {
+                // a compressed layer whose keys all precede first
+                continue;
+            } else if (n_->is_frozen(p)) {
+                // resume inside the frozen layer, which thaws it
+                next.append(kstr.s, kstr.len);
+                next.append('\0');
+                break;
+            }
+            layers[nlayers] = n_->lv_[p].layer();
+            ++nlayers;
+        } else if (kstr.compare(first) < 0) {
+            continue;
+        } else if (kstr.compare(last) >= 0) {
+            more = false;
+            break;
+        } else {
+            f(n_->lv_[p].value(), ti);
+        }
+
+        if (rfirst < 0) {
+            rfirst = i;
+        }
+        ++nremoved;
+    }
+
+    if (i == perm.size()) {
+        // resume after this leaf, or after this layer
+        if (leaf_type* nextleaf = n_->safe_next()) {
+            key_type bound = leaf_type::fixed_keys
+                ? key_type(nextleaf->ikey_bound(), P::fixed_key_length)
+                : key_type(nextleaf->ikey_bound());
+            next.append(prefix.s, prefix.len);
+            bound.unparse(next.extend(bound.length()), bound.length());
+        } else {
+            next.append(prefix.s, prefix.len);
+            while (next.length() && (unsigned char) next.back() == 255) {
+                next.pop_back();
+            }
+            if (next.empty()) {
+                more = false;
+            } else {
+                ++next.back();
+            }
+        }
+    }
+
+    bool unlocked = false;
+    if (nremoved) {
+        if (n_->modstate_ == leaf<P>::modstate_insert) {
+            n_->mark_insert();
+            n_->modstate_ = leaf<P>::modstate_remove;
+        }
+        for (int j = 0; j != nremoved; ++j) {
+            perm.remove(rfirst);
+        }
+        n_->permutation_ = perm.value();
+        for (int j = 0; j != nlayers; ++j) {
+            destroy_rcu_callback<P, F>::make(layers[j], f, ti);
+        }
+
+        if (!perm.size()) {
+            unlocked = remove_leaf(n_, root_, prefix, ti);
+        } else if (perm.size() <= P::leaf_merge_size) {
+            unlocked = merge_leaf(ti);
+        }
+    }
+    if (!unlocked) {
+        n_->unlock();
+    }
+    return more;
+}
+
+/** @brief Remove all keys in [@a first, @a last).
+    @param f called as f(value, ti) for each removed value
+
+    Each leaf is emptied of in-range keys under a single lock, and emptied
+    leaves are unlinked as by remove. A trie layer whose keys all lie in
+    the range, such as the layer for an 8-byte prefix when @a last is
+    that prefix's successor, is dropped in one step. Its nodes are freed
+    after an RCU grace period, when its values are passed to a copy of
+    @a f; @a f should therefore not depend on per-call state. */
+template <typename P> template <typename F>
+void basic_table<P>::remove_range(Str first, Str last, F& f, threadinfo& ti)
+{
+    lcdf::StringAccum cur, next;
+    cur.append(first.s, first.len);
+    while (last.compare(Str(cur.data(), cur.length())) > 0) {
+        cursor_type lp(*this, cur.data(), cur.length());
+        lp.find_locked(ti);
+        if (!lp.remove_range_locked(last, f, next, ti)) {
+            break;
+        }
+        cur.swap(next);
+    }
+}
+
 } // namespace Masstree
 #endif
@@ -17,6 +17,7 @@
 #define MASSTREE_SCAN_HH
 #include "masstree_tcursor.hh"
 #include "masstree_struct.hh"
+#include "masstree_frozen.hh"
 namespace Masstree {
 
 template <typename P>
@@ -43,6 +44,9 @@ class scanstackelt {
     permuter_type permutation() const {
         return perm_;
     }
+    const ikey_type* ikeys() const {
+        return n_->ikeys();
+    }
     int operator()(const key_type &k, const scanstackelt<P> &n, int p) {
         return n.n_->compare_key(k, p);
     }
@@ -54,6 +58,12 @@ class scanstackelt {
     permuter_type perm_;
     int ki_;
     small_vector<node_base<P>*, 2> node_stack_;
+    // while emitting a frozen layer's keys: the block, the current key's
+    // index, the offset of the key after it, and the current key
+    const frozen_layer<P>* frozen_;
+    int fi_;
+    uint32_t foff_;
+    char fkey_[MASSTREE_MAXKEYLEN];
 
     enum { scan_emit, scan_find_next, scan_down, scan_up, scan_retry };
 
@@ -75,6 +85,34 @@ class scanstackelt {
             return -1;
     }
 
+    int emit_frozen(key_type& ka, leafvalue_type& entry, int keylen) {
+        ka.assign_store_length(ka.assign_store_suffix(Str(fkey_, keylen)));
+        entry = leafvalue_type(frozen_->value(fi_));
+        return scan_emit;
+    }
+    template <typename H>
+    bool next_frozen(H& helper, key_type& ka, leafvalue_type& entry) {
+        int keylen = helper.frozen_next(frozen_, fi_, fkey_, foff_);
+        if (keylen < 0) {
+            frozen_ = nullptr;
+            return false;
+        }
+        emit_frozen(ka, entry, keylen);
+        return true;
+    }
+
+    void push_layer(node_base<P>* layer, int pathlen) {
+        node_stack_.push_back(root_);
+        node_stack_.push_back(n_);
+        // a compressed layer's path gets an empty frame per slice, so
+        // scan_up unshifts the key past it
+        for (; pathlen > 0; pathlen -= sizeof(ikey_type)) {
+            node_stack_.push_back(nullptr);
+            node_stack_.push_back(nullptr);
+        }
+        root_ = layer;
+    }
+
     template <typename PX> friend class basic_table;
 };
 
@@ -99,6 +137,19 @@ struct forward_scan_helper {
     int next(int ki) const {
         return ki + 1;
     }
+    template <typename B> int frozen_lower(const B* b, Str s,
+                                           bool emit_equal) const {
+        bool exact;
+        int i = b->lower_bound(s, exact);
+        return i + (exact && !emit_equal);
+    }
+    template <typename B> int frozen_first(const B*) const {
+        return 0;
+    }
+    template <typename B> int frozen_next(const B* b, int& i, char* buf,
+                                          uint32_t& off) const {
+        return ++i < b->size() ? b->decode(buf, off) : -1;
+    }
     template <typename N, typename K>
     N *advance(const N *n, const K &) const {
         return n->safe_next();
@@ -146,6 +197,19 @@ struct reverse_scan_helper {
     int next(int ki) const {
         return ki - 1;
     }
+    template <typename B> int frozen_lower(const B* b, Str s,
+                                           bool emit_equal) const {
+        bool exact;
+        int i = b->lower_bound(s, exact);
+        return i - !(exact && emit_equal);
+    }
+    template <typename B> int frozen_first(const B* b) const {
+        return b->size() - 1;
+    }
+    template <typename B> int frozen_next(const B* b, int& i, char* buf,
+                                          uint32_t& off) const {
+        return --i >= 0 ? b->seek(i, buf, off) : -1;
+    }
     void mark_key_complete() const {
         upper_bound_ = false;
     }
@@ -197,7 +261,7 @@ int scanstackelt<P>::find_initial(H& helper, key_type& ka, bool emit_equal,
 
     kx = helper.lower_with_position(ka, this);
     if (kx.p >= 0) {
-        keylenx = n_->keylenx_[kx.p];
+        keylenx = n_->keylenx(kx.p);
         fence();
         entry = n_->lv_[kx.p];
         entry.prefetch(keylenx);
@@ -215,11 +279,37 @@ int scanstackelt<P>::find_initial(H& helper, key_type& ka, bool emit_equal,
 
     ki_ = kx.i;
     if (kx.p >= 0) {
-        if (n_->keylenx_is_layer(keylenx)) {
-            node_stack_.push_back(root_);
-            node_stack_.push_back(n_);
-            root_ = entry.layer();
+        if (n_->keylenx_is_layer(keylenx) && !n_->keylenx_has_ksuf(keylenx)) {
+            push_layer(entry.layer(), 0);
             return scan_down;
+        } else if (n_->keylenx_is_layer(keylenx)) {
+            // compressed layer: descend by key if ka extends its path
+            Str ks = ka.suffix();
+            if (ks.len > suffix.len
+                && memcmp(ks.s, suffix.s, suffix.len) == 0) {
+                push_layer(entry.layer(), suffix.len);
+                ka.shift_by(suffix.len);
+                return scan_down;
+            }
+            // otherwise its keys lie all before or all after ka; they
+            // follow ka if ka is a prefix of the path
+            int ksuf_compare = suffix.compare(ks);
+            if (helper.initial_ksuf_match(ksuf_compare ? ksuf_compare : 1,
+                                          false)) {
+                int keylen = ka.assign_store_suffix(suffix);
+                ka.assign_store_length(keylen);
+                ka.shift_by(suffix.len);
+                helper.shift_clear(ka);
+                push_layer(entry.layer(), suffix.len);
+                return find_retry(helper, ka, ti);
+            }
+        } else if (n_->keylenx_is_frozen(keylenx)) {
+            // ka matched the slot, so it continues past the slice
+            frozen_ = entry.frozen();
+            fi_ = helper.frozen_lower(frozen_, ka.suffix(), emit_equal);
+            if (unsigned(fi_) < unsigned(frozen_->size()))
+                return emit_frozen(ka, entry, frozen_->seek(fi_, fkey_, foff_));
+            frozen_ = nullptr;
         } else if (n_->keylenx_has_ksuf(keylenx)) {
             int ksuf_compare = suffix.compare(ka.suffix());
             if (helper.initial_ksuf_match(ksuf_compare, emit_equal)) {
@@ -261,7 +351,7 @@ int scanstackelt<P>::find_next(H &helper, key_type &ka, leafvalue_type &entry)
     kp = this->kp();
     if (kp >= 0) {
         ikey_type ikey = n_->ikey0_[kp];
-        int keylenx = n_->keylenx_[kp];
+        int keylenx = n_->keylenx(kp);
         int keylen = keylenx;
         fence();
         entry = n_->lv_[kp];
@@ -280,10 +370,18 @@ int scanstackelt<P>::find_next(H &helper, key_type &ka, leafvalue_type &entry)
         ka.assign_store_ikey(ikey);
         helper.mark_key_complete();
         if (n_->keylenx_is_layer(keylenx)) {
-            node_stack_.push_back(root_);
-            node_stack_.push_back(n_);
-            root_ = entry.layer();
+            int pathlen = keylen - sizeof(ikey_type);
+            if (n_->keylenx_has_ksuf(keylenx)) {
+                ka.assign_store_length(keylen);
+                ka.shift_by(pathlen);
+            } else
+                pathlen = 0;
+            push_layer(entry.layer(), pathlen);
             return scan_down;
+        } else if (n_->keylenx_is_frozen(keylenx)) {
+            frozen_ = entry.frozen();
+            fi_ = helper.frozen_first(frozen_);
+            return emit_frozen(ka, entry, frozen_->seek(fi_, fkey_, foff_));
         } else {
             ka.assign_store_length(keylen);
             return scan_emit;
@@ -320,12 +418,17 @@ int basic_table<P>::scan(H helper,
         char s[MASSTREE_MAXKEYLEN];
     } keybuf;
     masstree_precondition(firstkey.len <= (int) sizeof(keybuf));
+    // an empty firstkey starts a scan at the beginning of the table
+    masstree_precondition(!leaf<P>::fixed_keys || firstkey.len == 0
+                          || firstkey.len == P::fixed_key_length);
+    keybuf.x[0] = 0;            // the first slice is read even if empty
     memcpy(keybuf.s, firstkey.s, firstkey.len);
     key_type ka(keybuf.s, firstkey.len);
 
     typedef scanstackelt<P> mystack_type;
     mystack_type stack;
     stack.root_ = root_;
+    stack.frozen_ = nullptr;
     leafvalue_type entry = leafvalue_type::make_empty();
 
     int scancount = 0;
@@ -345,6 +448,8 @@ int basic_table<P>::scan(H helper,
             ++scancount;
             if (!scanner.visit_value(ka, entry.value(), ti))
                 goto done;
+            if (stack.frozen_ && stack.next_frozen(helper, ka, entry))
+                break;
             stack.ki_ = helper.next(stack.ki_);
             state = stack.find_next(helper, ka, entry);
             break;
@@ -365,7 +470,7 @@ int basic_table<P>::scan(H helper,
                 stack.root_ = stack.node_stack_.back();
                 stack.node_stack_.pop_back();
                 ka.unshift();
-            } while (unlikely(ka.empty()));
+            } while (unlikely(!stack.n_) || unlikely(ka.empty()));
             stack.v_ = helper.stable(stack.n_, ka);
             stack.perm_ = stack.n_->permutation();
             stack.ki_ = helper.lower(ka, &stack);
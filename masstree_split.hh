@@ -40,9 +40,11 @@ leaf<P>::ikey_after_insert(const permuter_type& perm, int i,
     @post split_ikey is the first key in *@a nr
     @return split type
 
-    If @a p == this->size() and *this is the rightmost node in the layer,
-    then this code assumes we're inserting nodes in sequential order, and
-    the split does not move any keys.
+    If @a p == this->size(), *this is the rightmost node in the layer, and
+    no recent insert arrived out of order, then this code assumes we're
+    inserting nodes in sequential order, and the split does not move any
+    keys. Otherwise, if most recent inserts landed at one end of the node,
+    the split moves only a few keys to or from that end.
 
     The split type is 0 if @a ka went into *this, 1 if the @a ka went into
     *@a nr, and 2 for the sequential-order optimization (@a ka went into *@a
@@ -67,14 +69,18 @@ int leaf<P>::split_into(leaf<P>* nr, tcursor<P>* cursor,
     // pick initial insertion point
     permuter_type perml(this->permutation_);
     int width = perml.size();   // == this->width or this->width - 1
-    int mid = this->width / 2 + 1;
+    // a leaf whose slot 0 is reserved splits at width - 1 items
+    int mid = std::min(this->width / 2 + 1, width);
     int p = cursor->kx_.i;
     if (p == 0 && !this->prev_) {
         // reverse-sequential optimization
         mid = 1;
-    } else if (p == width && !this->next_.ptr) {
+    } else if (p == width && !this->next_.ptr && history_.sequential()) {
         // sequential optimization
         mid = width;
+    } else {
+        // almost-sorted inserts: keep the side they are leaving nearly full
+        mid = history_.split_point(p, width, mid);
     }
 
     // adjust insertion point to keep keys with the same ikey0 together
@@ -102,8 +108,8 @@ int leaf<P>::split_into(leaf<P>* nr, tcursor<P>* cursor,
         if (x == p) {
             nr->assign_initialize(x - mid, cursor->ka_, ti);
         } else {
-            nr->assign_initialize(x - mid, this, pv & 15, ti);
-            pv >>= 4;
+            nr->assign_initialize(x - mid, this, pv & permuter_type::slot_mask, ti);
+            pv >>= permuter_type::size_bits;
         }
     }
     permuter_type permr = permuter_type::make_sorted(width + 1 - mid);
@@ -111,6 +117,7 @@ int leaf<P>::split_into(leaf<P>* nr, tcursor<P>* cursor,
         permr.remove_to_back(p - mid);
     }
     nr->permutation_ = permr.value();
+    nr->history_ = history_;
     split_ikey = nr->ikey0_[0];
 
     // link `nr` across leaves
@@ -130,7 +137,8 @@ int internode<P>::split_into(internode<P>* nr, int p, ikey_type ka,
     // inserting "ka:value" at position "p" (0 <= p <= T::width).
     // The midpoint element of the result is stored in "split_ikey".
 
-    // Let mid = ceil(T::width / 2). After the split, the key at
+    // Let mid = ceil(T::width / 2), unless recent inserts were almost
+    // sorted (see insert_history). After the split, the key at
     // post-insertion position mid is stored in split_ikey. *this contains keys
     // [0,mid) and nr contains keys [mid+1,T::width+1).
     // If p < mid, then x goes into *this, pre-insertion item mid-1 goes into
@@ -141,8 +149,12 @@ int internode<P>::split_into(internode<P>* nr, int p, ikey_type ka,
     //   split_ikey, and the first element of nr is post-insertion item mid+1.
     masstree_precondition(!this->concurrent || (this->locked() && nr->locked()));
 
-    int mid = (split_type == 2 ? this->width : (this->width + 1) / 2);
+    // Unless sequential, leave both halves at least one key.
+    int mid = (split_type == 2 ? this->width
+               : std::min(history_.split_point(p, this->width, (this->width + 1) / 2),
+                          this->width - 1));
     nr->nkeys_ = this->width + 1 - (mid + 1);
+    nr->history_ = history_;
 
     if (p < mid) {
         nr->child_[0] = this->child_[mid];
@@ -182,6 +194,8 @@ bool tcursor<P>::make_split(threadinfo& ti)
     // full, or because we're trying to insert into position 0 (which holds
     // the ikey_bound). But in the latter case, perhaps we can rearrange the
     // permutation to do an insert instead.
+    if (n_->capacity() < n_->width)
+        return grow_layer(ti);
     if (n_->size() < n_->width) {
         permuter_type perm(n_->permutation_);
         perm.exchange(perm.size(), n_->width - 1);
@@ -229,6 +243,7 @@ bool tcursor<P>::make_split(threadinfo& ti)
             fence();
             n->set_parent(nn);
         } else {
+            p->history_.record(kp, p->size());
             if (p->size() >= p->width) {
                 next_child = internode_type::make(height + 1, ti);
                 next_child->assign_version(*p);
@@ -296,5 +311,51 @@ bool tcursor<P>::make_split(threadinfo& ti)
     return false;
 }
 
+/** @brief Replace the full small layer root this cursor holds with a
+    full-width leaf, then redo the insertion.
+
+    As elsewhere, the leaf holding the layer's slot is locked before the
+    layer root, so the small leaf is released first and the slot found
+    again from the top, as in gc_layer(). Readers that reach the small
+    leaf find it deleted, and its parent pointer leads them to the
+    replacement. */
+template <typename P>
+bool tcursor<P>::grow_layer(threadinfo& ti)
+{
+    leaf_type* small = n_;
+    Str prefix = ka_.prefix_string();
+    state_ = 0;
+    finish(0, ti);
+
+    tcursor<P> lp(root_, prefix.s, prefix.len);
+    lp.find_locked(ti);
+    if (lp.find_layer_slot() && lp.n_->lv_[lp.kx_.p].layer() == small) {
+        small->lock(*small, ti.lock_fence(tc_leaf_lock));
+        masstree_invariant(small->is_root() && !small->deleted());
+        leaf_type* nl = leaf_type::make(small->ksuf_used_capacity(),
+                                        small->phantom_epoch(), ti);
+        nl->next_.ptr = nl->prev_ = 0;
+        nl->ikey0_[0] = 0;
+        permuter_type sperm(small->permutation_);
+        for (int i = 0; i != sperm.size(); ++i)
+            nl->assign_initialize(i, small, sperm[i], ti);
+        nl->permutation_ = permuter_type::make_sorted(sperm.size());
+        nl->make_layer_root();
+        fence();
+        lp.n_->lv_[lp.kx_.p] = nl;
+        small->set_parent(nl);
+        fence();
+        small->mark_deleted();
+        small->mark_nonroot();
+        small->unlock();
+        small->deallocate_rcu(ti);
+    }
+    lp.n_->unlock();
+
+    ka_.unshift_all();
+    new_nodes_.clear();
+    return find_insert(ti);
+}
+
 } // namespace Masstree
 #endif
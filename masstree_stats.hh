@@ -16,6 +16,7 @@
 #ifndef MASSTREE_STATS_HH
 #define MASSTREE_STATS_HH
 #include "masstree.hh"
+#include "masstree_frozen.hh"
 #include "json.hh"
 
 namespace Masstree {
@@ -45,10 +46,19 @@ void node_json_stats(node_base<P>* n, lcdf::Json& j, int layer, int depth,
                 j["l1_size_sum"] += j["l1_size"].to_i();
                 j["l1_size"] = x;
                 j["l1_count"] += 1;
+                if (lf->has_ksuf(perm[i])) {
+                    j["compressed_layer"] += 1;
+                    active_ksuf_len += lf->ksuf(perm[i]).len;
+                }
+            } else if (lf->is_frozen(perm[i])) {
+                const frozen_layer<P>* fl = lf->lv_[perm[i]].frozen();
+                n += fl->size();
+                j["frozen"] += 1;
+                j["frozen_bytes"] += fl->allocated_size();
             } else {
                 ++n;
                 int l = sizeof(typename P::ikey_type) * layer
-                    + lf->keylenx_[perm[i]];
+                    + lf->keylenx(perm[i]);
                 if (lf->has_ksuf(perm[i])) {
                     size_t ksuf_len = lf->ksuf(perm[i]).len;
                     l += ksuf_len - 1;
@@ -61,11 +71,15 @@ void node_json_stats(node_base<P>* n, lcdf::Json& j, int layer, int depth,
         j["l1_size"] += n;
         j["key_by_layer"][layer] += n;
 
+        if (lf->capacity() < lf->width)
+            j["small_leaf"] += 1;
+        j["leaf_bytes"] += lf->allocated_size();
+
         // key suffix information
-        if (lf->allocated_size() != lf->min_allocated_size()
-            && lf->ksuf_external()) {
+        size_t min_size = lf->min_allocated_size(lf->capacity());
+        if (lf->allocated_size() != min_size && lf->ksuf_external()) {
             j["overridden_ksuf"] += 1;
-            j["overridden_ksuf_capacity"] += lf->allocated_size() - lf->min_allocated_size();
+            j["overridden_ksuf_capacity"] += lf->allocated_size() - min_size;
         }
         if (lf->ksuf_capacity()) {
             j["ksuf"] += 1;
@@ -84,7 +98,7 @@ void node_json_stats(node_base<P>* n, lcdf::Json& j, int layer, int depth,
         internode<P> *in = static_cast<internode<P> *>(n);
         for (int i = 0; i <= in->size(); ++i)
             if (in->child_[i])
-                node_json_stats(in->child_[i], j, layer, depth + 1, ti);
+                node_json_stats<P>(in->child_[i], j, layer, depth + 1, ti);
         j[&"l1_node_by_depth"[!layer * 3]][depth] += 1;
         j[&"l1_internode_by_size"[!layer * 3]][in->size()] += 1;
     }
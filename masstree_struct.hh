@@ -20,8 +20,22 @@
 #include "stringbag.hh"
 #include "mtcounters.hh"
 #include "timestamp.hh"
+#include "compact_region.hh"
 namespace Masstree {
 
+/** @brief The type of a node's links to other nodes.
+
+    With P::compressed_pointers, nodes are allocated from the
+    compact_region and link to each other with 32-bit offsets. */
+template <typename P, typename N>
+using node_pointer = typename mass::conditional<P::compressed_pointers,
+                                                compact_ptr<N>, N*>::type;
+
+template <typename P>
+constexpr memtag node_memtag(memtag tag) {
+    return memtag(tag | (P::compressed_pointers ? memtag_pool_compact : 0));
+}
+
 template <typename P>
 struct make_nodeversion {
     typedef nodeversion_parameters<typename P::nodeversion_value_type> parameters_type;
@@ -37,6 +51,67 @@ struct make_prefetcher {
                                        do_nothing>::type type;
 };
 
+/** @brief Where a node's recent inserts landed, for choosing split points.
+
+    Classifies each of a node's last eight inserts as an append, a
+    near-append (one position short of the high end), an insert within
+    one position of the low end, or other. A node split during a run of
+    almost-sorted inserts then keeps most of its keys on the side the run
+    is leaving, rather than leaving two half-empty nodes the run will
+    never revisit. */
+class insert_history {
+  public:
+    enum { other = 0, append = 1, near_append = 2, low = 3 };
+
+    insert_history()
+        : h_(0) {
+    }
+
+    /** @brief Record an insert at position @a p of a node with @a size
+        items. */
+    void record(int p, int size) {
+        int c = p >= size ? append : p + 1 == size ? near_append
+            : p <= 1 ? low : other;
+        h_ = (h_ << 2) | c;
+    }
+
+    /** @brief Return how many of the last eight inserts were of class
+        @a c. */
+    int count(int c) const {
+        int n = 0;
+        for (int i = 0; i != 16; i += 2)
+            n += ((h_ >> i) & 3) == c;
+        return n;
+    }
+
+    /** @brief Return true if recent inserts were appends in strict key
+        order, as opposed to merely almost sorted. */
+    bool sequential() const {
+        return count(near_append) == 0;
+    }
+
+    /** @brief Return the split point for inserting at position @a p into
+        a node with @a size items.
+        @param mid the default split point
+
+        Returns the position of the first of the size + 1 post-insertion
+        items that goes to the right, between 1 and @a size, so both sides
+        get at least one item. If @a p and at least six of the last eight
+        inserts are at the high end, about seven-eighths of the items stay
+        on the left; symmetrically for the low end. */
+    int split_point(int p, int size, int mid) const {
+        int n = size + 1;
+        if (p + 1 >= size && count(append) + count(near_append) >= 6)
+            mid = n - (n + 4) / 8;
+        else if (p <= 1 && count(low) >= 6)
+            mid = (n + 4) / 8;
+        return std::max(1, std::min(mid, size));
+    }
+
+  private:
+    uint16_t h_;
+};
+
 template <typename P>
 class node_base : public make_nodeversion<P>::type {
   public:
@@ -89,7 +164,7 @@ class node_base : public make_nodeversion<P>::type {
                                  threadinfo& ti) const;
 
     void prefetch_full() const {
-        for (int i = 0; i < std::min(16 * std::min(P::leaf_width, P::internode_width) + 1, 4 * 64); i += 64)
+        for (int i = 0; i < std::min(16 * std::min(P::leaf_width, P::internode_width) + 1, 8 * 64); i += 64)
             ::prefetch((const char *) this + i);
     }
 
@@ -107,10 +182,11 @@ class internode : public node_base<P> {
     typedef typename P::threadinfo_type threadinfo;
 
     uint8_t nkeys_;
+    insert_history history_;
     uint32_t height_;
     ikey_type ikey0_[width];
-    node_base<P>* child_[width + 1];
-    node_base<P>* parent_;
+    node_pointer<P, node_base<P> > child_[width + 1];
+    node_pointer<P, node_base<P> > parent_;
     kvtimestamp_t created_at_[P::debug_level > 0];
 
     internode(uint32_t height)
@@ -119,7 +195,7 @@ class internode : public node_base<P> {
 
     static internode<P>* make(uint32_t height, threadinfo& ti) {
         void* ptr = ti.pool_allocate(sizeof(internode<P>),
-                                     memtag_masstree_internode);
+                                     node_memtag<P>(memtag_masstree_internode));
         internode<P>* n = new(ptr) internode<P>(height);
         assert(n);
         if (P::debug_level > 0)
@@ -137,6 +213,9 @@ class internode : public node_base<P> {
     ikey_type ikey(int p) const {
         return ikey0_[p];
     }
+    const ikey_type* ikeys() const {
+        return ikey0_;
+    }
     int compare_key(ikey_type a, int bp) const {
         return ::compare(a, ikey(bp));
     }
@@ -147,17 +226,20 @@ class internode : public node_base<P> {
                                        threadinfo& ti) const;
 
     void prefetch() const {
-        for (int i = 64; i < std::min(16 * width + 1, 4 * 64); i += 64)
+        for (int i = 64; i < std::min(16 * width + 1, 8 * 64); i += 64)
             ::prefetch((const char *) this + i);
     }
+    inline void prefetch_child(int kp, ikey_type ikey) const;
 
     void print(FILE* f, const char* prefix, int depth, int kdepth) const;
 
     void deallocate(threadinfo& ti) {
-        ti.pool_deallocate(this, sizeof(*this), memtag_masstree_internode);
+        ti.pool_deallocate(this, sizeof(*this),
+                           node_memtag<P>(memtag_masstree_internode));
     }
     void deallocate_rcu(threadinfo& ti) {
-        ti.pool_deallocate_rcu(this, sizeof(*this), memtag_masstree_internode);
+        ti.pool_deallocate_rcu(this, sizeof(*this),
+                               node_memtag<P>(memtag_masstree_internode));
     }
 
   private:
@@ -176,12 +258,12 @@ class internode : public node_base<P> {
     }
     void shift_up(int p, int xp, int n) {
         memmove(ikey0_ + p, ikey0_ + xp, sizeof(ikey0_[0]) * n);
-        for (node_base<P> **a = child_ + p + n, **b = child_ + xp + n; n; --a, --b, --n)
+        for (auto *a = child_ + p + n, *b = child_ + xp + n; n; --a, --b, --n)
             *a = *b;
     }
     void shift_down(int p, int xp, int n) {
         memmove(ikey0_ + p, ikey0_ + xp, sizeof(ikey0_[0]) * n);
-        for (node_base<P> **a = child_ + p + 1, **b = child_ + xp + 1; n; ++a, ++b, --n)
+        for (auto *a = child_ + p + 1, *b = child_ + xp + 1; n; ++a, ++b, --n)
             *a = *b;
     }
 
@@ -189,6 +271,7 @@ class internode : public node_base<P> {
                    ikey_type& split_ikey, int split_type);
 
     template <typename PP> friend class tcursor;
+    template <typename PP> friend class bulk_loader;
 };
 
 template <typename P>
@@ -205,6 +288,9 @@ class leafvalue {
     leafvalue(node_base<P>* n) {
         u_.x = reinterpret_cast<uintptr_t>(n);
     }
+    leafvalue(frozen_layer<P>* f) {
+        u_.x = reinterpret_cast<uintptr_t>(f);
+    }
 
     static leafvalue<P> make_empty() {
         return leafvalue<P>(value_type());
@@ -228,12 +314,17 @@ class leafvalue {
     node_base<P>* layer() const {
         return reinterpret_cast<node_base<P>*>(u_.x);
     }
+    frozen_layer<P>* frozen() const {
+        return reinterpret_cast<frozen_layer<P>*>(u_.x);
+    }
 
     void prefetch(int keylenx) const {
-        if (!leaf<P>::keylenx_is_layer(keylenx))
-            prefetcher_type()(u_.v);
-        else
+        if (leaf<P>::keylenx_is_layer(keylenx))
             u_.n->prefetch_full();
+        else if (leaf<P>::keylenx_is_frozen(keylenx))
+            ::prefetch((const void*) u_.x);
+        else
+            prefetcher_type()(u_.v);
     }
 
   private:
@@ -260,46 +351,77 @@ class leaf : public node_base<P> {
     typedef typename P::phantom_epoch_type phantom_epoch_type;
     static constexpr int ksuf_keylenx = 64;
     static constexpr int layer_keylenx = 128;
+    // A layer slot with a key suffix is a compressed layer: the suffix
+    // holds whole slices that every key in the layer shares, so lookups
+    // skip the single-entry layers those slices would otherwise need.
+    static constexpr int layer_ksuf_keylenx = layer_keylenx + ksuf_keylenx;
+    // A frozen slot holds a frozen_layer, an immutable sorted block of
+    // the keys that extend the slot's ikey. It is not a layer, and has no
+    // suffix; ksuf_matches() reports frozen_match for it.
+    static constexpr int frozen_keylenx = layer_keylenx + 32;
+    static constexpr int frozen_match = -1;
+    // Fixed-length keys fit in one ikey, so they never have suffixes or
+    // layers, and leaves need not store key lengths. Every key must then
+    // be exactly P::fixed_key_length bytes long.
+    static constexpr bool fixed_keys = P::fixed_key_length != 0;
+    static_assert(!fixed_keys || P::fixed_key_length == sizeof(ikey_type),
+                  "fixed_key_length must equal sizeof(ikey_type)");
 
     enum {
         modstate_insert = 0, modstate_remove = 1, modstate_deleted_layer = 2
     };
 
+    // With leaf_layout_hot_cold, everything a key search reads (version,
+    // permutation, key lengths, ikeys) stays in the leading cache lines,
+    // and the values, suffixes and links start on a fresh line.
+    static constexpr bool hot_cold = P::leaf_layout == leaf_layout_hot_cold;
+    // New trie layer roots start with room for only small_width values;
+    // they are replaced with full-width leaves when they fill. The value
+    // array comes last so that a small leaf is simply a truncated one.
+    static constexpr int small_width =
+        P::small_leaf_width > 0 && P::small_leaf_width < width
+        ? P::small_leaf_width : width;
+    static_assert(P::small_leaf_width == 0 || P::small_leaf_width >= 2,
+                  "a new layer root holds two keys");
+
     int8_t extrasize64_;
     uint8_t modstate_;
-    uint8_t keylenx_[width];
+    uint8_t capacity_;
+    uint8_t keylenx_[fixed_keys ? 0 : width];
+    insert_history history_;
     typename permuter_type::storage_type permutation_;
     ikey_type ikey0_[width];
-    leafvalue_type lv_[width];
+    alignas(hot_cold ? CACHE_LINE_SIZE : alignof(external_ksuf_type*))
     external_ksuf_type* ksuf_;
-    union {
-        leaf<P>* ptr;
-        uintptr_t x;
+    struct {
+        node_pointer<P, leaf<P> > ptr;
     } next_;
-    leaf<P>* prev_;
-    node_base<P>* parent_;
+    node_pointer<P, leaf<P> > prev_;
+    node_pointer<P, node_base<P> > parent_;
     phantom_epoch_type phantom_epoch_[P::need_phantom_epoch];
     kvtimestamp_t created_at_[P::debug_level > 0];
-    internal_ksuf_type iksuf_[0];
+    leafvalue_type lv_[width];
 
-    leaf(size_t sz, phantom_epoch_type phantom_epoch)
-        : node_base<P>(true), modstate_(modstate_insert),
+    leaf(size_t sz, phantom_epoch_type phantom_epoch, int capacity)
+        : node_base<P>(true), modstate_(modstate_insert), capacity_(capacity),
           permutation_(permuter_type::make_empty()),
-          ksuf_(), parent_(), iksuf_{} {
+          ksuf_(), parent_() {
         masstree_precondition(sz % 64 == 0 && sz / 64 < 128);
-        extrasize64_ = (int(sz) >> 6) - ((int(sizeof(*this)) + 63) >> 6);
+        masstree_precondition(capacity > 0 && capacity <= width);
+        extrasize64_ = (int(sz) >> 6) - ((int(base_size(capacity)) + 63) >> 6);
         if (extrasize64_ > 0) {
-            new((void*) &iksuf_[0]) internal_ksuf_type(width, sz - sizeof(*this));
+            new((void*) &iksuf()) internal_ksuf_type(capacity, sz - base_size(capacity));
         }
         if (P::need_phantom_epoch) {
             phantom_epoch_[0] = phantom_epoch;
         }
     }
 
-    static leaf<P>* make(int ksufsize, phantom_epoch_type phantom_epoch, threadinfo& ti) {
-        size_t sz = iceil(sizeof(leaf<P>) + std::min(ksufsize, 128), 64);
-        void* ptr = ti.pool_allocate(sz, memtag_masstree_leaf);
-        leaf<P>* n = new(ptr) leaf<P>(sz, phantom_epoch);
+    static leaf<P>* make(int ksufsize, phantom_epoch_type phantom_epoch, threadinfo& ti,
+                         int capacity = width) {
+        size_t sz = iceil(base_size(capacity) + std::min(ksufsize, 128), 64);
+        void* ptr = ti.pool_allocate(sz, node_memtag<P>(memtag_masstree_leaf));
+        leaf<P>* n = new(ptr) leaf<P>(sz, phantom_epoch, capacity);
         assert(n);
         if (P::debug_level > 0) {
             n->created_at_[0] = ti.operation_timestamp();
@@ -307,19 +429,28 @@ class leaf : public node_base<P> {
         return n;
     }
     static leaf<P>* make_root(int ksufsize, leaf<P>* parent, threadinfo& ti) {
-        leaf<P>* n = make(ksufsize, parent ? parent->phantom_epoch() : phantom_epoch_type(), ti);
+        leaf<P>* n = make(ksufsize, parent ? parent->phantom_epoch() : phantom_epoch_type(), ti,
+                          parent ? small_width : width);
         n->next_.ptr = n->prev_ = 0;
         n->ikey0_[0] = 0; // to avoid undefined behavior
         n->make_layer_root();
         return n;
     }
 
-    static size_t min_allocated_size() {
-        return (sizeof(leaf<P>) + 63) & ~size_t(63);
+    /** @brief Return the bytes a leaf with room for @a capacity values
+        needs before its internal key suffixes. */
+    static constexpr size_t base_size(int capacity) {
+        return sizeof(leaf<P>) - (width - capacity) * sizeof(leafvalue_type);
+    }
+    static size_t min_allocated_size(int capacity = width) {
+        return (base_size(capacity) + 63) & ~size_t(63);
     }
     size_t allocated_size() const {
         int es = (extrasize64_ >= 0 ? extrasize64_ : -extrasize64_ - 1);
-        return (sizeof(*this) + es * 64 + 63) & ~size_t(63);
+        return (base_size(capacity_) + es * 64 + 63) & ~size_t(63);
+    }
+    int capacity() const {
+        return capacity_;
     }
     phantom_epoch_type phantom_epoch() const {
         return P::need_phantom_epoch ? phantom_epoch_[0] : phantom_epoch_type();
@@ -355,7 +486,7 @@ class leaf : public node_base<P> {
     }
 
     key_type get_key(int p) const {
-        int keylenx = keylenx_[p];
+        int keylenx = this->keylenx(p);
         if (!keylenx_has_ksuf(keylenx))
             return key_type(ikey0_[p], keylenx);
         else
@@ -364,10 +495,18 @@ class leaf : public node_base<P> {
     ikey_type ikey(int p) const {
         return ikey0_[p];
     }
+    const ikey_type* ikeys() const {
+        return ikey0_;
+    }
     ikey_type ikey_bound() const {
         return ikey0_[0];
     }
+    int keylenx(int p) const {
+        return fixed_keys ? P::fixed_key_length : keylenx_[p];
+    }
     int compare_key(const key_type& a, int bp) const {
+        if (fixed_keys)
+            return ::compare(a.ikey(), ikey(bp));
         return a.compare(ikey(bp), keylenx_[bp]);
     }
     inline int stable_last_key_compare(const key_type& k, nodeversion_type v,
@@ -377,28 +516,35 @@ class leaf : public node_base<P> {
                                    threadinfo& ti) const;
 
     static bool keylenx_is_layer(int keylenx) {
-        return keylenx > 127;
+        return !fixed_keys
+            && (keylenx & (layer_keylenx | 32)) == layer_keylenx;
+    }
+    static bool keylenx_is_frozen(int keylenx) {
+        return !fixed_keys && keylenx == frozen_keylenx;
     }
     static bool keylenx_has_ksuf(int keylenx) {
-        return keylenx == ksuf_keylenx;
+        return !fixed_keys && (keylenx & ksuf_keylenx);
     }
 
     bool is_layer(int p) const {
-        return keylenx_is_layer(keylenx_[p]);
+        return keylenx_is_layer(keylenx(p));
+    }
+    bool is_frozen(int p) const {
+        return keylenx_is_frozen(keylenx(p));
     }
     bool has_ksuf(int p) const {
-        return keylenx_has_ksuf(keylenx_[p]);
+        return keylenx_has_ksuf(keylenx(p));
     }
     Str ksuf(int p, int keylenx) const {
         (void) keylenx;
         masstree_precondition(keylenx_has_ksuf(keylenx));
-        return ksuf_ ? ksuf_->get(p) : iksuf_[0].get(p);
+        return ksuf_ ? ksuf_->get(p) : iksuf().get(p);
     }
     Str ksuf(int p) const {
-        return ksuf(p, keylenx_[p]);
+        return ksuf(p, keylenx(p));
     }
     bool ksuf_equals(int p, const key_type& ka) const {
-        return ksuf_equals(p, ka, keylenx_[p]);
+        return ksuf_equals(p, ka, keylenx(p));
     }
     bool ksuf_equals(int p, const key_type& ka, int keylenx) const {
         if (!keylenx_has_ksuf(keylenx))
@@ -408,18 +554,28 @@ class leaf : public node_base<P> {
             && string_slice<uintptr_t>::equals_sloppy(s.s, ka.suffix().s, s.len);
     }
     // Returns 1 if match & not layer, 0 if no match, <0 if match and layer
+    // (minus the number of key bytes the layer consumes), or frozen_match
+    // if the slot is frozen and might hold the key
     int ksuf_matches(int p, const key_type& ka) const {
+        if (fixed_keys)
+            return 1;
         int keylenx = keylenx_[p];
         if (keylenx < ksuf_keylenx)
             return 1;
         if (keylenx == layer_keylenx)
             return -(int) sizeof(ikey_type);
+        if (keylenx == frozen_keylenx)
+            return frozen_match;
         Str s = ksuf(p, keylenx);
+        if (keylenx == layer_ksuf_keylenx)
+            return ka.suffix_length() > s.len
+                && memcmp(ka.suffix().s, s.s, s.len) == 0
+                ? -(int) (sizeof(ikey_type) + s.len) : 0;
         return s.len == ka.suffix().len
             && string_slice<uintptr_t>::equals_sloppy(s.s, ka.suffix().s, s.len);
     }
     int ksuf_compare(int p, const key_type& ka) const {
-        int keylenx = keylenx_[p];
+        int keylenx = this->keylenx(p);
         if (!keylenx_has_ksuf(keylenx))
             return 0;
         return ksuf(p, keylenx).compare(ka.suffix());
@@ -429,7 +585,7 @@ class leaf : public node_base<P> {
         if (ksuf_)
             return ksuf_->used_capacity();
         else if (extrasize64_ > 0)
-            return iksuf_[0].used_capacity();
+            return iksuf().used_capacity();
         else
             return 0;
     }
@@ -437,7 +593,7 @@ class leaf : public node_base<P> {
         if (ksuf_)
             return ksuf_->capacity();
         else if (extrasize64_ > 0)
-            return iksuf_[0].capacity();
+            return iksuf().capacity();
         else
             return 0;
     }
@@ -448,30 +604,54 @@ class leaf : public node_base<P> {
         if (ksuf_)
             return ksuf_->get(p);
         else if (extrasize64_ > 0)
-            return iksuf_[0].get(p);
+            return iksuf().get(p);
         else
             return Str();
     }
 
+    internal_ksuf_type& iksuf() {
+        char* x = reinterpret_cast<char*>(this) + base_size(capacity_);
+        return *reinterpret_cast<internal_ksuf_type*>(x);
+    }
+    const internal_ksuf_type& iksuf() const {
+        const char* x = reinterpret_cast<const char*>(this) + base_size(capacity_);
+        return *reinterpret_cast<const internal_ksuf_type*>(x);
+    }
+
     bool deleted_layer() const {
         return modstate_ == modstate_deleted_layer;
     }
 
     void prefetch() const {
-        for (int i = 64; i < std::min(16 * width + 1, 4 * 64); i += 64)
+        int end = std::min(16 * width + 1, 8 * 64);
+        if (hot_cold)
+            end = (const char *) &ksuf_ - (const char *) this;
+        for (int i = 64; i < end; i += 64)
             ::prefetch((const char *) this + i);
         if (extrasize64_ > 0)
-            ::prefetch((const char *) &iksuf_[0]);
+            ::prefetch((const char *) &iksuf());
         else if (extrasize64_ < 0) {
             ::prefetch((const char *) ksuf_);
             ::prefetch((const char *) ksuf_ + CACHE_LINE_SIZE);
         }
     }
 
+    void prefetch_values() const {
+        ::prefetch((const char *) lv_);
+    }
+
     void print(FILE* f, const char* prefix, int depth, int kdepth) const;
 
     leaf<P>* safe_next() const {
-        return reinterpret_cast<leaf<P>*>(next_.x & ~(uintptr_t) 1);
+        leaf<P>* next = next_.ptr;
+        return reinterpret_cast<leaf<P>*>(reinterpret_cast<uintptr_t>(next) & ~(uintptr_t) 1);
+    }
+    /** @brief Return true iff this leaf covers @a ikey in its layer.
+        @pre This leaf's version is stable and not deleted. */
+    bool covers(ikey_type ikey) const {
+        leaf<P>* next;
+        return (!prev_ || compare(ikey, ikey_bound()) >= 0)
+            && (!(next = safe_next()) || compare(ikey, next->ikey_bound()) < 0);
     }
 
     void deallocate(threadinfo& ti) {
@@ -479,14 +659,18 @@ class leaf : public node_base<P> {
             ti.deallocate(ksuf_, ksuf_->capacity(),
                           memtag_masstree_ksuffixes);
         if (extrasize64_ != 0)
-            iksuf_[0].~stringbag();
-        ti.pool_deallocate(this, allocated_size(), memtag_masstree_leaf);
+            iksuf().~stringbag();
+        ti.pool_deallocate(this, allocated_size(),
+                           node_memtag<P>(memtag_masstree_leaf));
     }
     void deallocate_rcu(threadinfo& ti) {
+        if (P::leaf_model)
+            leaf_model<P>::note_freed(this);
         if (ksuf_)
             ti.deallocate_rcu(ksuf_, ksuf_->capacity(),
                               memtag_masstree_ksuffixes);
-        ti.pool_deallocate_rcu(this, allocated_size(), memtag_masstree_leaf);
+        ti.pool_deallocate_rcu(this, allocated_size(),
+                               node_memtag<P>(memtag_masstree_leaf));
     }
 
   private:
@@ -494,38 +678,47 @@ class leaf : public node_base<P> {
         modstate_ = modstate_deleted_layer;
     }
 
+    inline void assign_keylenx(int p, int keylenx) {
+        if (!fixed_keys)
+            keylenx_[p] = keylenx;
+    }
     inline void assign(int p, const key_type& ka, threadinfo& ti) {
         lv_[p] = leafvalue_type::make_empty();
         ikey0_[p] = ka.ikey();
-        if (!ka.has_suffix()) {
-            keylenx_[p] = ka.length();
+        if (fixed_keys || !ka.has_suffix()) {
+            assign_keylenx(p, ka.length());
         } else {
-            keylenx_[p] = ksuf_keylenx;
+            assign_keylenx(p, ksuf_keylenx);
             assign_ksuf(p, ka.suffix(), false, ti);
         }
     }
     inline void assign_initialize(int p, const key_type& ka, threadinfo& ti) {
         lv_[p] = leafvalue_type::make_empty();
         ikey0_[p] = ka.ikey();
-        if (!ka.has_suffix()) {
-            keylenx_[p] = ka.length();
+        if (fixed_keys || !ka.has_suffix()) {
+            assign_keylenx(p, ka.length());
         } else {
-            keylenx_[p] = ksuf_keylenx;
+            assign_keylenx(p, ksuf_keylenx);
             assign_ksuf(p, ka.suffix(), true, ti);
         }
     }
     inline void assign_initialize(int p, leaf<P>* x, int xp, threadinfo& ti) {
         lv_[p] = x->lv_[xp];
         ikey0_[p] = x->ikey0_[xp];
-        keylenx_[p] = x->keylenx_[xp];
+        assign_keylenx(p, x->keylenx(xp));
         if (x->has_ksuf(xp)) {
             assign_ksuf(p, x->ksuf(xp), true, ti);
         }
     }
-    inline void assign_initialize_for_layer(int p, const key_type& ka) {
-        assert(ka.has_suffix());
+    inline void assign_initialize_for_layer(int p, const key_type& ka,
+                                            threadinfo& ti) {
         ikey0_[p] = ka.ikey();
-        keylenx_[p] = layer_keylenx;
+        if (!ka.has_suffix())
+            assign_keylenx(p, layer_keylenx);
+        else {
+            assign_keylenx(p, layer_ksuf_keylenx);
+            assign_ksuf(p, ka.suffix(), true, ti);
+        }
     }
     void assign_ksuf(int p, Str s, bool initializing, threadinfo& ti);
 
@@ -535,6 +728,7 @@ class leaf : public node_base<P> {
                    threadinfo& ti);
 
     template <typename PP> friend class tcursor;
+    template <typename PP> friend class bulk_loader;
 };
 
 
@@ -625,6 +819,32 @@ leaf<P>::stable_last_key_compare(const key_type& k, nodeversion_type v,
     }
 }
 
+/** @brief Prefetch child @a kp, just chosen for @a ikey.
+
+    Called during descent before the child's version is read, so that
+    the child's lines load together. Children of height-1 internodes are
+    leaves, whose first value line is prefetched as well. With
+    descent_prefetch_neighbors, a key within one byte of a separator
+    also prefetches the child on the separator's other side, which a
+    scan from the key soon visits. Prefetches do not fault, so racing
+    updates can only waste them. */
+template <typename P>
+inline void internode<P>::prefetch_child(int kp, ikey_type ikey) const
+{
+    node_base<P>* child = child_[kp];
+    child->prefetch_full();
+    if (height_ == 1)
+        static_cast<leaf<P>*>(child)->prefetch_values();
+    if (P::descent_prefetch == descent_prefetch_neighbors) {
+        node_base<P>* neighbor = nullptr;
+        if (kp < nkeys_ && ikey0_[kp] - ikey < 256)
+            neighbor = child_[kp + 1];
+        else if (kp > 0 && ikey - ikey0_[kp - 1] < 256)
+            neighbor = child_[kp - 1];
+        if (neighbor)
+            neighbor->prefetch_full();
+    }
+}
 
 /** @brief Return the leaf in this tree layer responsible for @a ka.
 
@@ -638,6 +858,20 @@ inline leaf<P>* node_base<P>::reach_leaf(const key_type& ka,
     typename node_base<P>::nodeversion_type v[2];
     unsigned sense;
 
+    // Try the leaf this thread last reached from this root, if any. Each
+    // trie layer depth has its own finger. The leaf is usable if it is
+    // live and still covers ka.
+    int fi = std::min(ka.prefix_length() / key_type::ikey_size,
+                      int(threadinfo::nfingers) - 1);
+    if (P::use_finger) {
+        if (leaf<P>* lf = static_cast<leaf<P>*>(ti.finger(fi, this))) {
+            version = lf->stable_annotated(ti.stable_fence());
+            if (likely(!version.deleted()) && lf->covers(ka.ikey())) {
+                return lf;
+            }
+        }
+    }
+
     // Get a non-stale root.
     // Detect staleness by checking whether n has ever split.
     // The true root has never split.
@@ -662,6 +896,9 @@ inline leaf<P>* node_base<P>::reach_leaf(const key_type& ka,
         if (!n[sense ^ 1]) {
             goto retry;
         }
+        if (P::descent_prefetch != descent_prefetch_none) {
+            in->prefetch_child(kp, ka.ikey());
+        }
         v[sense ^ 1] = n[sense ^ 1]->stable_annotated(ti.stable_fence());
 
         if (likely(!in->has_changed(v[sense]))) {
@@ -681,7 +918,11 @@ inline leaf<P>* node_base<P>::reach_leaf(const key_type& ka,
     }
 
     version = v[sense];
-    return const_cast<leaf<P> *>(static_cast<const leaf<P> *>(n[sense]));
+    leaf<P>* lf = const_cast<leaf<P> *>(static_cast<const leaf<P> *>(n[sense]));
+    if (P::use_finger && !version.deleted()) {
+        ti.set_finger(fi, this, lf);
+    }
+    return lf;
 }
 
 /** @brief Return the leaf at or after *this responsible for @a ka.
@@ -727,7 +968,7 @@ leaf<P>* leaf<P>::advance_to_key(const key_type& ka, nodeversion_type& v,
 template <typename P>
 void leaf<P>::assign_ksuf(int p, Str s, bool initializing, threadinfo& ti) {
     if ((ksuf_ && ksuf_->assign(p, s))
-        || (extrasize64_ > 0 && iksuf_[0].assign(p, s)))
+        || (extrasize64_ > 0 && iksuf().assign(p, s)))
         return;
 
     external_ksuf_type* oksuf = ksuf_;
@@ -742,12 +983,12 @@ void leaf<P>::assign_ksuf(int p, Str s, bool initializing, threadinfo& ti) {
             csz += ksuf(mp).len;
     }
 
-    size_t sz = iceil_log2(external_ksuf_type::safe_size(width, csz + s.len));
+    size_t sz = iceil_log2(external_ksuf_type::safe_size(capacity_, csz + s.len));
     if (oksuf)
         sz = std::max(sz, oksuf->capacity());
 
     void* ptr = ti.allocate(sz, memtag_masstree_ksuffixes);
-    external_ksuf_type* nksuf = new(ptr) external_ksuf_type(width, sz);
+    external_ksuf_type* nksuf = new(ptr) external_ksuf_type(capacity_, sz);
     for (int i = 0; i < n; ++i) {
         int mp = initializing ? i : perm[i];
         if (mp != p && has_ksuf(mp)) {
@@ -779,7 +1020,7 @@ void leaf<P>::assign_ksuf(int p, Str s, bool initializing, threadinfo& ti) {
 
 template <typename P>
 inline basic_table<P>::basic_table()
-    : root_(0) {
+    : root_(0), model_(0) {
 }
 
 template <typename P>
@@ -798,5 +1039,10 @@ inline node_base<P>* basic_table<P>::fix_root() {
     return root;
 }
 
+template <typename P>
+inline const leaf_model<P>* basic_table<P>::model() const {
+    return model_;
+}
+
 } // namespace Masstree
 #endif
@@ -33,31 +33,33 @@ class unlocked_tcursor {
 
     inline unlocked_tcursor(const basic_table<P>& table, Str str)
         : ka_(str), lv_(leafvalue<P>::make_empty()),
-          root_(table.root()) {
+          root_(table.root()), model_(table.model()) {
     }
     inline unlocked_tcursor(basic_table<P>& table, Str str)
         : ka_(str), lv_(leafvalue<P>::make_empty()),
-          root_(table.fix_root()) {
+          root_(table.fix_root()), model_(table.model()) {
     }
     inline unlocked_tcursor(const basic_table<P>& table,
                             const char* s, int len)
         : ka_(s, len), lv_(leafvalue<P>::make_empty()),
-          root_(table.root()) {
+          root_(table.root()), model_(table.model()) {
     }
     inline unlocked_tcursor(basic_table<P>& table,
                             const char* s, int len)
         : ka_(s, len), lv_(leafvalue<P>::make_empty()),
-          root_(table.fix_root()) {
+          root_(table.fix_root()), model_(table.model()) {
     }
     inline unlocked_tcursor(const basic_table<P>& table,
                             const unsigned char* s, int len)
         : ka_(reinterpret_cast<const char*>(s), len),
-          lv_(leafvalue<P>::make_empty()), root_(table.root()) {
+          lv_(leafvalue<P>::make_empty()), root_(table.root()),
+          model_(table.model()) {
     }
     inline unlocked_tcursor(basic_table<P>& table,
                             const unsigned char* s, int len)
         : ka_(reinterpret_cast<const char*>(s), len),
-          lv_(leafvalue<P>::make_empty()), root_(table.fix_root()) {
+          lv_(leafvalue<P>::make_empty()), root_(table.fix_root()),
+          model_(table.model()) {
     }
 
     bool find_unlocked(threadinfo& ti);
@@ -74,6 +76,9 @@ class unlocked_tcursor {
     inline int compare_key(const key_type& a, int bp) const {
         return n_->compare_key(a, bp);
     }
+    inline const typename P::ikey_type* ikeys() const {
+        return n_->ikeys();
+    }
     inline nodeversion_value_type full_version_value() const {
         static_assert(int(nodeversion_type::traits_type::top_stable_bits) >= int(leaf<P>::permuter_type::size_bits), "not enough bits to add size to version");
         return (v_.version_value() << leaf<P>::permuter_type::size_bits) + perm_.size();
@@ -86,6 +91,52 @@ class unlocked_tcursor {
     permuter_type perm_;
     leafvalue<P> lv_;
     const node_base<P>* root_;
+    const leaf_model<P>* model_;
+};
+
+/** @brief Resumable lookup used by basic_table::multi_get.
+
+    A multi_get_cursor performs the same optimistic descent as
+    unlocked_tcursor::find_unlocked, but returns control after prefetching
+    each node on its path so that several lookups can overlap their cache
+    misses. */
+template <typename P>
+class multi_get_cursor {
+  public:
+    typedef typename P::value_type value_type;
+    typedef key<typename P::ikey_type> key_type;
+    typedef typename P::threadinfo_type threadinfo;
+    typedef typename node_base<P>::nodeversion_type nodeversion_type;
+
+    enum { group_size = 8 };    // lookups in flight at once
+
+    inline void start(const node_base<P>* root, Str key) {
+        masstree_precondition(!leaf<P>::fixed_keys
+                              || key.len == P::fixed_key_length);
+        ka_ = key_type(key);
+        root_ = root;
+        state_ = st_root;
+    }
+    bool step(threadinfo& ti);
+
+    inline bool found() const {
+        return match_ > 0;
+    }
+    inline value_type value() const {
+        return lv_.value();
+    }
+
+  private:
+    key_type ka_;
+    const node_base<P>* root_;
+    const node_base<P>* n_;
+    const node_base<P>* next_;
+    nodeversion_type v_;
+    leafvalue<P> lv_;
+    int state_;
+    int match_;
+
+    enum { st_root, st_child };
 };
 
 template <typename P>
@@ -154,6 +205,7 @@ class tcursor {
 
     inline bool find_locked(threadinfo& ti);
     inline bool find_insert(threadinfo& ti);
+    bool find_insert_next(Str key, threadinfo& ti);
 
     inline void finish(int answer, threadinfo& ti);
 
@@ -177,8 +229,11 @@ class tcursor {
         return root_;
     }
 
+    inline bool make_insert(threadinfo& ti);
     bool make_new_layer(threadinfo& ti);
     bool make_split(threadinfo& ti);
+    bool grow_layer(threadinfo& ti);
+    inline bool find_layer_slot();
     friend class leaf<P>;
     inline void finish_insert();
     inline bool finish_remove(threadinfo& ti);
@@ -192,9 +247,30 @@ class tcursor {
      *   rooted at "01234567", then @a prefix should equal "01234567". */
     static bool remove_leaf(leaf_type* leaf, node_type* root,
                             Str prefix, threadinfo& ti);
+    bool merge_leaf(threadinfo& ti);
+    static bool merge_into(leaf_type* l, leaf_type* r, node_type* root,
+                           threadinfo& ti);
+    static void balance_internode(internode_type* n, threadinfo& ti);
+
+    template <typename F>
+    bool remove_range_locked(Str last, F& f, lcdf::StringAccum& next,
+                             threadinfo& ti);
 
     bool gc_layer(threadinfo& ti);
     friend struct gc_layer_rcu_callback<P>;
+
+    struct freeze_state {
+        std::vector<std::pair<String, value_type> > entries;
+        std::vector<leaf_type*> leaves;
+        std::vector<node_type*> roots;
+        std::vector<frozen_layer<P>*> blocks;
+    };
+    static void freeze_collect(node_type* root, Str prefix, freeze_state& fs,
+                               threadinfo& ti);
+    static void freeze_free_internodes(node_type* n, threadinfo& ti);
+    int freeze_layer(threadinfo& ti);
+    void thaw_layer(threadinfo& ti);
+    friend class basic_table<P>;
 };
 
 template <typename P>
@@ -19,7 +19,9 @@
 enum memtag {
     // memtags are divided into a *type* and a *pool*.
     // The type is purely for debugging. The pool indicates the pool from
-    // which an allocation was taken.
+    // which an allocation was taken: its size class (a number of cache
+    // lines, or a value slab; see pool_depot), plus memtag_pool_compact
+    // for pools carved from the compact_region.
     memtag_none = 0x000,
     memtag_value = 0x100,
     memtag_limbo = 0x500,
@@ -27,6 +29,10 @@ enum memtag {
     memtag_masstree_internode = 0x1100,
     memtag_masstree_ksuffixes = 0x1200,
     memtag_masstree_gc = 0x1300,
+    memtag_masstree_model = 0x1400,
+    memtag_masstree_frozen = 0x1500,
+    memtag_pool_compact = 0x80,
+    memtag_pool_nlines_mask = 0x7F,
     memtag_pool_mask = 0xFF
 };
 
@@ -53,6 +59,8 @@ enum threadcounter {
     // end tc_stable constants
     tc_internode_lock,
     tc_leaf_lock,
+    tc_model_hit,
+    tc_model_miss,
     tc_max
 };
 
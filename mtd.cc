@@ -28,6 +28,7 @@
 #include <sys/select.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <limits.h>
 #if HAVE_SYS_EPOLL_H
 #include <sys/epoll.h>
@@ -60,6 +61,7 @@
 #include "masstree_insert.hh"
 #include "masstree_remove.hh"
 #include "masstree_scan.hh"
+#include "masstree_relocate.hh"
 #include "msgpack.hh"
 #include <algorithm>
 #include <deque>
@@ -101,6 +103,11 @@ volatile bool recovering = false; // so don't add log entries, and free old valu
 
 static double checkpoint_interval = 1000000;
 static kvepoch_t ckp_gen = 0; // recover from checkpoint
+static double ckp_fill = 0.85; // bulk-load fill factor; 0 means insert keys one by one
+static double relocate_rate = 0; // leaves visited per second; 0 means no relocation
+static double model_interval = 1; // seconds between leaf model checks; 0 means never rebuild
+static double pool_retain_mb = 64; // free pool memory kept resident; negative means never trim
+static bool reclaim_thread = false; // free limbo objects in a dedicated thread
 static ckstate *cks = NULL; // checkpoint status of all checkpointing threads
 static pthread_cond_t rec_cond;
 pthread_mutex_t rec_mu;
@@ -116,10 +123,25 @@ static void prepare_thread(threadinfo *ti);
 static int* tcp_thread_pipes;
 static void* tcp_threadfunc(void* ti);
 static void* udp_threadfunc(void* ti);
+static void* relocate_threadfunc(void* ti);
+static void* model_threadfunc(void* ti);
+static void* pool_trim_threadfunc(void*);
+static void* reclaim_threadfunc(void* ti);
 
 static void log_init();
 static void recover(threadinfo*);
-static kvepoch_t read_checkpoint(threadinfo*, const char *path);
+// State for loading checkpoint files bottom-up. The loader may refer to
+// key data from any file read so far, so files stay mapped until it
+// finishes.
+struct ckp_bulk_load {
+    Masstree::bulk_loader<Masstree::default_table::parameters_type> loader;
+    std::vector<Str> maps;
+    ckp_bulk_load(Masstree::default_table& table, double fill)
+        : loader(table.table(), fill) {
+    }
+};
+static kvepoch_t read_checkpoint(threadinfo*, const char *path,
+                                 ckp_bulk_load* bulk = nullptr);
 
 static void* conc_checkpointer(void* ti);
 static void recovercheckpoint(threadinfo* ti);
@@ -198,6 +220,9 @@ struct kvtest_client {
         quick_istr key(ikey, 10), expected(iexpected);
         get_check(key.string(), expected.string());
     }
+    void many_get_check(int, long [], long []) {
+        assert(0);
+    }
     void get_col_check(const Str &key, int col, const Str &expected);
     void get_col_check_key10(long ikey, int col, long iexpected) {
         quick_istr key(ikey, 10), expected(iexpected);
@@ -562,7 +587,8 @@ struct conninfo {
 enum { clp_val_suffixdouble = Clp_ValFirstUser };
 enum { opt_nolog = 1, opt_pin, opt_logdir, opt_port, opt_ckpdir, opt_duration,
        opt_test, opt_test_name, opt_threads, opt_cores,
-       opt_print, opt_norun, opt_checkpoint, opt_limit, opt_epoch_interval };
+       opt_print, opt_norun, opt_checkpoint, opt_limit, opt_epoch_interval,
+       opt_ckp_fill, opt_relocate_rate, opt_model_interval, opt_pool_retain, opt_reclaim_thread };
 static const Clp_Option options[] = {
     { "no-log", 0, opt_nolog, 0, 0 },
     { 0, 'n', opt_nolog, 0, 0 },
@@ -575,6 +601,11 @@ static const Clp_Option options[] = {
     { "ckpdir", 0, opt_ckpdir, Clp_ValString, 0 },
     { "ckdir", 0, opt_ckpdir, Clp_ValString, 0 },
     { "cd", 0, opt_ckpdir, Clp_ValString, 0 },
+    { "ckp-fill", 0, opt_ckp_fill, Clp_ValDouble, Clp_Negate },
+    { "relocate-rate", 0, opt_relocate_rate, Clp_ValDouble, 0 },
+    { "model-interval", 0, opt_model_interval, Clp_ValDouble, Clp_Negate },
+    { "pool-retain", 0, opt_pool_retain, Clp_ValDouble, Clp_Negate },
+    { "reclaim-thread", 0, opt_reclaim_thread, 0, Clp_Negate },
     { "port", 0, opt_port, Clp_ValInt, 0 },
     { "duration", 'd', opt_duration, Clp_ValDouble, 0 },
     { "limit", 'l', opt_limit, clp_val_suffixdouble, 0 },
@@ -636,6 +667,24 @@ main(int argc, char *argv[])
           else
               checkpoint_interval = 30;
           break;
+      case opt_ckp_fill:
+          if (clp->negated || clp->val.d <= 0)
+              ckp_fill = 0;
+          else
+              ckp_fill = std::min(clp->val.d, 1.0);
+          break;
+      case opt_relocate_rate:
+          relocate_rate = std::max(clp->val.d, 0.0);
+          break;
+      case opt_model_interval:
+          model_interval = clp->negated ? 0 : std::max(clp->val.d, 0.0);
+          break;
+      case opt_pool_retain:
+          pool_retain_mb = clp->negated ? -1 : std::max(clp->val.d, 0.0);
+          break;
+      case opt_reclaim_thread:
+          reclaim_thread = !clp->negated;
+          break;
       case opt_port:
           port = clp->val.i;
           break;
@@ -741,6 +790,13 @@ main(int argc, char *argv[])
   threadinfo *main_ti = threadinfo::make(threadinfo::TI_MAIN, -1);
   main_ti->pthread() = pthread_self();
 
+  // Reclamation thread, before any thread records RCU frees
+  if (reclaim_thread) {
+    threadinfo *ti = threadinfo::make(threadinfo::TI_RECLAIM, -1);
+    ret = pthread_create(&ti->pthread(), 0, reclaim_threadfunc, ti);
+    always_assert(ret == 0);
+  }
+
   initial_timestamp = timestamp();
   tree = new Masstree::default_table;
   tree->initialize(*main_ti);
@@ -767,6 +823,30 @@ main(int argc, char *argv[])
     always_assert(ret == 0);
   }
 
+  // Leaf relocation thread
+  if (relocate_rate > 0) {
+    threadinfo *ti = threadinfo::make(threadinfo::TI_PROCESS, udpthreads);
+    ret = pthread_create(&ti->pthread(), 0, relocate_threadfunc, ti);
+    always_assert(ret == 0);
+    printf("relocating %g leaves/s\n", relocate_rate);
+  }
+
+  // Leaf model maintenance thread
+  if (Masstree::default_table::parameters_type::leaf_model
+      && model_interval > 0) {
+    threadinfo *ti = threadinfo::make(threadinfo::TI_PROCESS, -1);
+    ret = pthread_create(&ti->pthread(), 0, model_threadfunc, ti);
+    always_assert(ret == 0);
+  }
+
+  // Pool trimming thread
+  if (pool_retain_mb >= 0) {
+    threadinfo::set_pool_retention(size_t(pool_retain_mb * (1 << 20)));
+    pthread_t tid;
+    ret = pthread_create(&tid, 0, pool_trim_threadfunc, 0);
+    always_assert(ret == 0);
+  }
+
   if (dotest) {
       if (strcmp(dotest, "palm") == 0) {
         runtest("palma", 1);
@@ -887,6 +967,8 @@ inline const char *threadtype(int type) {
       return "log";
     case threadinfo::TI_CHECKPOINT:
       return "checkpoint";
+    case threadinfo::TI_RECLAIM:
+      return "reclaim";
     default:
       always_assert(0 && "Unknown threadtype");
       break;
@@ -1177,6 +1259,65 @@ void* tcp_threadfunc(void* x) {
     return 0;
 }
 
+// copy leaves into key order, a few at a time, in a dedicated thread
+void* relocate_threadfunc(void* x) {
+    threadinfo* ti = reinterpret_cast<threadinfo*>(x);
+    ti->pthread() = pthread_self();
+    Masstree::leaf_relocator<Masstree::default_table::parameters_type> relocator(tree->table());
+    // up to 64 leaves per batch, fewer when the rate is lower
+    int batch = std::max(std::min(relocate_rate, 64.0), 1.0);
+    double delay = batch / relocate_rate;
+    struct timespec ts;
+    ts.tv_sec = (time_t) delay;
+    ts.tv_nsec = (long) ((delay - ts.tv_sec) * 1e9);
+    while (1) {
+        ti->rcu_start();
+        relocator.run(batch, *ti);
+        ti->rcu_stop();
+        nanosleep(&ts, 0);
+    }
+    return 0;
+}
+
+// rebuild an outdated or stale leaf model, in a dedicated thread
+void* model_threadfunc(void* x) {
+    threadinfo* ti = reinterpret_cast<threadinfo*>(x);
+    ti->pthread() = pthread_self();
+    struct timespec ts;
+    ts.tv_sec = (time_t) model_interval;
+    ts.tv_nsec = (long) ((model_interval - ts.tv_sec) * 1e9);
+    while (1) {
+        ti->rcu_start();
+        tree->table().maintain_model(*ti);
+        ti->rcu_stop();
+        nanosleep(&ts, 0);
+    }
+    return 0;
+}
+
+// return free pool chunks to the OS, in a dedicated thread
+void* pool_trim_threadfunc(void*) {
+    while (1) {
+        sleep(1);
+        threadinfo::trim_pools();
+    }
+    return 0;
+}
+
+// free other threads' limbo objects, in a dedicated thread
+void* reclaim_threadfunc(void* x) {
+    threadinfo* ti = reinterpret_cast<threadinfo*>(x);
+    ti->pthread() = pthread_self();
+    while (1) {
+        ti->rcu_start();
+        size_t n = ti->reclaim_limbo();
+        ti->rcu_stop();
+        if (!n)
+            usleep(1000);
+    }
+    return 0;
+}
+
 // serve a client udp socket, in a dedicated thread
 void* udp_threadfunc(void* x) {
   threadinfo* ti = reinterpret_cast<threadinfo*>(x);
@@ -1272,7 +1413,8 @@ void log_init() {
 // with any one point in time.
 // returns the timestamp of the first log record that needs
 // to come from the log.
-kvepoch_t read_checkpoint(threadinfo *ti, const char *path) {
+kvepoch_t read_checkpoint(threadinfo *ti, const char *path,
+                          ckp_bulk_load *bulk) {
     double t0 = now();
 
     int fd = open(path, 0);
@@ -1297,10 +1439,17 @@ kvepoch_t read_checkpoint(threadinfo *ti, const char *path) {
     printf("reading checkpoint with %" PRIu64 " nodes\n", n);
 
     // read data
-    for (uint64_t i = 0; i != n; ++i)
-        ckstate::insert(tree->table(), par, *ti);
+    if (bulk)
+        for (uint64_t i = 0; i != n; ++i)
+            ckstate::insert(bulk->loader, par, *ti);
+    else
+        for (uint64_t i = 0; i != n; ++i)
+            ckstate::insert(tree->table(), par, *ti);
 
-    munmap(p, sb.st_size);
+    if (bulk)
+        bulk->maps.push_back(Str(p, sb.st_size));
+    else
+        munmap(p, sb.st_size);
     double t1 = now();
     printf("%.1f MB, %.2f sec, %.1f MB/sec\n",
            sb.st_size / 1000000.0,
@@ -1330,11 +1479,27 @@ inactive(void)
 void recovercheckpoint(threadinfo *ti) {
     waituntilphase(REC_CKP);
     char path[256];
-    sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
-            ckpdirs[ti->index() % ckpdirs.size()],
-            ckp_gen.value(), ti->index());
-    kvepoch_t gen = read_checkpoint(ti, path);
-    always_assert(ckp_gen == gen);
+    if (ckp_fill <= 0) {
+        sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
+                ckpdirs[ti->index() % ckpdirs.size()],
+                ckp_gen.value(), ti->index());
+        kvepoch_t gen = read_checkpoint(ti, path);
+        always_assert(ckp_gen == gen);
+    } else if (ti->index() == 0) {
+        // Checkpoint files partition the key space in index order and
+        // each is written in key order, so one thread can build the whole
+        // tree bottom-up from them.
+        ckp_bulk_load bulk(*tree, ckp_fill);
+        for (int i = 0; i < nckthreads; ++i) {
+            sprintf(path, "%s/kvd-ckp-%" PRId64 "-%d",
+                    ckpdirs[i % ckpdirs.size()], ckp_gen.value(), i);
+            kvepoch_t gen = read_checkpoint(ti, path, &bulk);
+            always_assert(ckp_gen == gen);
+        }
+        bulk.loader.finish(*ti);
+        for (auto& m : bulk.maps)
+            munmap(const_cast<char*>(m.s), m.len);
+    }
     inactive();
 }
 
@@ -40,6 +40,11 @@
 #if HAVE_EXECINFO_H
 #include <execinfo.h>
 #endif
+#if HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 #if __linux__
 #include <asm-generic/mman.h>
 #endif
@@ -109,6 +114,36 @@ kvtimestamp_t initial_timestamp;
 
 static const char *threadcounter_names[(int) tc_max];
 
+// Pool memory allocated on, and memory still free on, each NUMA node.
+static Json numa_stats() {
+    Json j = Json::make_array();
+    for (int i = 0; i < threadinfo::numa_nodes(); ++i) {
+        Json n = Json().set("node", i)
+            .set("pool_bytes", pool_depot::chunks(i) * threadinfo::pool_chunk_size);
+#if HAVE_NUMA_H && HAVE_LIBNUMA
+        long long free;
+        if (numa_node_size64(i, &free) >= 0)
+            n.set("free_bytes", free);
+#endif
+        j.push_back(n);
+    }
+    return j;
+}
+
+static Json value_slab_stats() {
+    Json j = Json::make_array();
+    for (int c = pool_depot::max_nlines + 1; c <= pool_depot::nclasses; ++c) {
+        int pooltag = memtag_value + c;
+        if (size_t bytes = pool_depot::carved_bytes(pooltag)) {
+            size_t used = bytes - std::min(bytes, threadinfo::pool_free_bytes(pooltag));
+            j.push_back(Json().set("size", pool_depot::unit(pooltag))
+                        .set("bytes", bytes).set("used", used)
+                        .set("occupancy", double(used) / bytes));
+        }
+    }
+    return j;
+}
+
 /* running local tests */
 void test_timeout(int) {
     size_t n;
@@ -135,11 +170,13 @@ struct kvtest_client {
     using table_type = T;
 
     kvtest_client()
-        : limit_(test_limit), ncores_(udpthreads), kvo_() {
+        : limit_(test_limit), ncores_(udpthreads), kvo_(), perf_fd_(-1) {
     }
     ~kvtest_client() {
         if (kvo_)
             free_kvout(kvo_);
+        if (perf_fd_ >= 0)
+            close(perf_fd_);
     }
 
     int nthreads() const {
@@ -224,7 +261,7 @@ struct kvtest_client {
         get_col_check(key.string(), col, value.string());
     }
     void get_check_absent(Str key);
-    //void many_get_check(int nk, long ikey[], long iexpected[]);
+    void many_get_check(int nk, long ikey[], long iexpected[]);
 
     void scan_sync(Str firstkey, int n,
                    std::vector<Str>& keys, std::vector<Str>& values);
@@ -266,6 +303,7 @@ struct kvtest_client {
         put_col(key.string(), col, value.string());
     }
     void insert_check(Str key, Str value);
+    void put_sorted_key16(int nk, long ikey[], long ivalue[]);
 
     void remove(Str key);
     void remove(long ikey) {
@@ -292,6 +330,9 @@ struct kvtest_client {
     }
     void puts_done() {
     }
+    void build_model() {
+        table_->table().build_model(*ti_);
+    }
     void wait_all() {
     }
     void rcu_quiesce() {
@@ -300,6 +341,8 @@ struct kvtest_client {
             set_global_epoch(e);
         ti_->rcu_quiesce();
     }
+    void start_cache_misses();
+    int64_t cache_misses() const;
     String make_message(lcdf::StringAccum &sa) const;
     void notice(const char *fmt, ...);
     void fail(const char *fmt, ...);
@@ -315,6 +358,13 @@ struct kvtest_client {
         if (counters) {
             report_.set("counters", counters);
         }
+        if (ti_->index() == 0)
+            report_.set("value_slabs", value_slab_stats());
+        if (threadinfo::numa_nodes()) {
+            report_.set("numa_node", ti_->numa_node());
+            if (ti_->index() == 0)
+                report_.set("numa", numa_stats());
+        }
         if (!quiet) {
             fprintf(stderr, "%d: %s\n", ti_->index(), report_.unparse().c_str());
         }
@@ -330,6 +380,7 @@ struct kvtest_client {
     std::vector<uint64_t> scan_versions_;
     int ncores_;
     kvout *kvo_;
+    int perf_fd_;
 
   private:
     void output_scan(const Json& req, std::vector<Str>& keys, std::vector<Str>& values) const;
@@ -402,24 +453,27 @@ void kvtest_client<T>::get_check_absent(Str key) {
     }
 }
 
-/*template <typename T>
+template <typename T>
 void kvtest_client<T>::many_get_check(int nk, long ikey[], long iexpected[]) {
-    std::vector<quick_istr> ka(2*nk, quick_istr());
-    for(int i = 0; i < nk; i++){
-      ka[i].set(ikey[i]);
-      ka[i+nk].set(iexpected[i]);
-      q_[i].begin_get1(ka[i].string());
-    }
-    table_->many_get(q_, nk, *ti_);
-    for(int i = 0; i < nk; i++){
-      Str val = q_[i].get1_value();
-      if (ka[i+nk] != val){
-        printf("get(%ld) returned unexpected value %.*s (expected %ld)\n",
-             ikey[i], std::min(val.len, 40), val.s, iexpected[i]);
-        exit(1);
-      }
-    }
-}*/
+    std::vector<quick_istr> ka(nk);
+    std::vector<Str> keys(nk), vals(nk);
+    std::unique_ptr<bool[]> found(new bool[nk]);
+    for (int i = 0; i != nk; ++i) {
+        ka[i].set(ikey[i]);
+        keys[i] = ka[i].string();
+    }
+    q_[0].run_multi_get1(table_->table(), keys.data(), nk, 0,
+                         vals.data(), found.get(), *ti_);
+    for (int i = 0; i != nk; ++i) {
+        quick_istr expected(iexpected[i]);
+        if (unlikely(!found[i]))
+            fail("get(%ld) failed (expected %ld)\n", ikey[i], iexpected[i]);
+        else if (unlikely(expected != vals[i]))
+            fail("get(%ld) returned unexpected value %s (expected %ld)\n",
+                 ikey[i], String(vals[i]).substr(0, 40).printable().c_str(),
+                 iexpected[i]);
+    }
+}
 
 template <typename T>
 void kvtest_client<T>::scan_sync(Str firstkey, int n,
@@ -465,6 +519,20 @@ void kvtest_client<T>::put(Str key, Str value) {
     q_[0].run_replace(table_->table(), key, value, *ti_);
 }
 
+template <typename T>
+void kvtest_client<T>::put_sorted_key16(int nk, long ikey[], long ivalue[]) {
+    std::vector<quick_istr> ka(nk), va(nk);
+    std::vector<Str> keys(nk), values(nk);
+    for (int i = 0; i != nk; ++i) {
+        ka[i].set(ikey[i], 16);
+        va[i].set(ivalue[i]);
+        keys[i] = ka[i].string();
+        values[i] = va[i].string();
+    }
+    q_[0].run_replace_sorted(table_->table(), keys.data(), values.data(),
+                             nk, *ti_);
+}
+
 template <typename T>
 void kvtest_client<T>::insert_check(Str key, Str value) {
     if (unlikely(q_[0].run_replace(table_->table(), key, value, *ti_) != Inserted)) {
@@ -507,6 +575,36 @@ void kvtest_client<T>::remove_check(Str key) {
     }
 }
 
+/** @brief Start counting hardware cache misses on the calling thread.
+
+    Counting is best effort: cache_misses() returns -1 if the platform
+    does not provide the counter. */
+template <typename T>
+void kvtest_client<T>::start_cache_misses() {
+#if HAVE_LINUX_PERF_EVENT_H
+    if (perf_fd_ < 0) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        perf_fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    if (perf_fd_ >= 0)
+        ioctl(perf_fd_, PERF_EVENT_IOC_RESET, 0);
+#endif
+}
+
+template <typename T>
+int64_t kvtest_client<T>::cache_misses() const {
+    uint64_t count;
+    if (perf_fd_ >= 0 && read(perf_fd_, &count, sizeof(count)) == sizeof(count))
+        return count;
+    return -1;
+}
+
 template <typename T>
 String kvtest_client<T>::make_message(lcdf::StringAccum &sa) const {
     const char *begin = sa.begin();
@@ -566,11 +664,17 @@ static pthread_cond_t subtest_cond;
 #include "testrunner.hh"
 
 MAKE_TESTRUNNER(rw1, kvtest_rw1(client));
+MAKE_TESTRUNNER(rw1mget, kvtest_rw1mget(client));
+MAKE_TESTRUNNER(rw1miss, kvtest_rw1miss(client));
 // MAKE_TESTRUNNER(palma, kvtest_palma(client));
 // MAKE_TESTRUNNER(palmb, kvtest_palmb(client));
 MAKE_TESTRUNNER(rw1fixed, kvtest_rw1fixed(client));
 MAKE_TESTRUNNER(rw1long, kvtest_rw1long(client));
+MAKE_TESTRUNNER(keylen, kvtest_keylen(client));
 MAKE_TESTRUNNER(rw1puts, kvtest_rw1puts(client));
+MAKE_TESTRUNNER(wsorted, kvtest_wsorted(client));
+MAKE_TESTRUNNER(wappend, kvtest_wappend(client));
+MAKE_TESTRUNNER(rwmodel, kvtest_rwmodel(client));
 MAKE_TESTRUNNER(rw2, kvtest_rw2(client));
 MAKE_TESTRUNNER(rw2fixed, kvtest_rw2fixed(client));
 MAKE_TESTRUNNER(rw2g90, kvtest_rw2g90(client));
@@ -868,6 +972,8 @@ main(int argc, char *argv[])
     threadcounter_names[(int) tc_stable_leaf_split] = "stable_leaf_split";
     threadcounter_names[(int) tc_internode_lock] = "internode_lock_retry";
     threadcounter_names[(int) tc_leaf_lock] = "leaf_lock_retry";
+    threadcounter_names[(int) tc_model_hit] = "model_hit";
+    threadcounter_names[(int) tc_model_miss] = "model_miss";
 
     int ret, ntrials = 1, normtype = normtype_pertest, firstcore = -1, corestride = 1;
     std::vector<const char *> tests, treetypes;
@@ -338,7 +338,10 @@ template <> struct nodeversion_parameters<uint32_t> {
         isleaf_bit = (1U << 31),
         split_unlock_mask = ~(root_bit | unused1_bit | (vsplit_lowbit - 1)),
         unlock_mask = ~(unused1_bit | (vinsert_lowbit - 1)),
-        top_stable_bits = 4
+        // Full versions shift the version left to make room for the
+        // permutation size. The fifth bit lost is the split counter's
+        // topmost bit, which only makes wraparound a little sooner.
+        top_stable_bits = 5
     };
 
     typedef uint32_t value_type;
@@ -359,7 +362,7 @@ template <> struct nodeversion_parameters<uint64_t> {
         isleaf_bit = (1ULL << 63),
         split_unlock_mask = ~(root_bit | unused1_bit | (vsplit_lowbit - 1)),
         unlock_mask = ~(unused1_bit | (vinsert_lowbit - 1)),
-        top_stable_bits = 4
+        top_stable_bits = 5  // see nodeversion_parameters<uint32_t>
     };
 
     typedef uint64_t value_type;
@@ -0,0 +1,200 @@
+/* Masstree
+ * Eddie Kohler, Yandong Mao, Robert Morris
+ * Copyright (c) 2012-2016 President and Fellows of Harvard College
+ * Copyright (c) 2012-2016 Massachusetts Institute of Technology
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, subject to the conditions
+ * listed in the Masstree LICENSE file. These conditions include: you must
+ * preserve this copyright notice, and you cannot mention the copyright
+ * holders in advertising related to the Software without their permission.
+ * The Software is provided WITHOUT ANY WARRANTY, EXPRESS OR IMPLIED. This
+ * notice is a summary of the Masstree LICENSE file; the license in that file
+ * is legally binding.
+ */
+#ifndef POOL_DEPOT_HH
+#define POOL_DEPOT_HH 1
+#include "compiler.hh"
+#include "mtcounters.hh"
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/** @brief A global stock of free pool nodes, shared by all threads.
+
+    Each thread keeps its own free lists of pool nodes. A thread whose
+    list for some size grows past high_water() returns a batch of nodes
+    here, and a thread whose list runs dry takes a batch back before
+    carving a new chunk, so memory freed by one thread is reused by
+    others. A batch is a null-terminated free list of about batch_bytes
+    bytes whose first node also records the next batch and, in the
+    link's high bits, the batch's length. Each NUMA node and size
+    class (compact or not) has its own lock-free stack, so threads reuse
+    memory on their own node; the stack head carries a 16-bit generation
+    count in its high bits, which guards pops against ABA. Pool memory is never
+    unmapped (trimmed chunks are only madvised away), so a racing pop
+    may safely read a batch that another thread has just taken.
+
+    request_flush() asks every thread to move all of its free nodes
+    here at its next RCU quiescent point, so that threadinfo::trim_pools()
+    can find chunks whose nodes are all free.
+
+    A pool's class is the low bits of its memtag. Classes 1 through
+    max_nlines hold nodes of that many cache lines. The value classes
+    above them are slabs for row values, with sizes from 16 to
+    max_value_size bytes spaced about a quarter apart. */
+class pool_depot {
+  public:
+    enum { max_nlines = 20, nvalue_classes = 24,
+           nclasses = max_nlines + nvalue_classes, max_nodes = 16 };
+    static constexpr size_t batch_bytes = 32768;
+    static constexpr size_t max_value_size = 2048;
+
+    /** @brief Return the size of the objects in pool @a pooltag. */
+    static size_t unit(int pooltag) {
+        int c = pooltag & memtag_pool_nlines_mask;
+        assert(c > 0 && c <= nclasses);
+        if (c <= max_nlines)
+            return c * CACHE_LINE_SIZE;
+        c -= max_nlines + 1;
+        if (c < 8)
+            return (c + 1) * 16;
+        int b = 7 + (c - 8) / 4;
+        return (size_t(1) << b) + ((c - 8) % 4 + 1) * (size_t(1) << (b - 2));
+    }
+    /** @brief Return the value class for objects of @a sz bytes, or 0 if
+        @a sz is larger than max_value_size. */
+    static int value_class(size_t sz) {
+        if (sz > max_value_size)
+            return 0;
+        unsigned s = sz ? sz - 1 : 0;
+        if (s < 128)
+            return max_nlines + 1 + (s >> 4);
+        int b = 31 - __builtin_clz(s);
+        return max_nlines + 1 + 8 + (b - 7) * 4 + ((s >> (b - 2)) & 3);
+    }
+
+    /** @brief Return the number of objects in a batch for @a pooltag. */
+    static unsigned batch_size(int pooltag) {
+        return batch_bytes / unit(pooltag);
+    }
+    /** @brief Test whether a free list of @a count objects for
+        @a pooltag holds more than two batches. */
+    static bool high_water(int pooltag, unsigned count) {
+        return count * unit(pooltag) > 2 * batch_bytes;
+    }
+
+    /** @brief Add the @a n-node free list @a p to the stack for
+        @a pooltag on NUMA node @a node.
+        @pre @a n > 0 */
+    static void put(int node, int pooltag, void* p, unsigned n) {
+        batch* b = static_cast<batch*>(p);
+        assert(n && n <= (~ptr_mask >> 48)
+               && (reinterpret_cast<uintptr_t>(p) & ~ptr_mask) == 0);
+        bytes_[index(pooltag)].fetch_add(n * unit(pooltag), std::memory_order_relaxed);
+        std::atomic<uintptr_t>& h = head(node, pooltag);
+        uintptr_t x = h.load(std::memory_order_relaxed);
+        do {
+            b->next = (x & ptr_mask) | (uintptr_t(n) << 48);
+        } while (!h.compare_exchange_weak(x, bump(x, b),
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+    }
+    /** @brief Remove a free list from the stack for @a pooltag on NUMA
+        node @a node.
+
+        Returns null if the stack is empty; otherwise sets @a n to the
+        list's length. */
+    static void* take(int node, int pooltag, unsigned& n) {
+        std::atomic<uintptr_t>& h = head(node, pooltag);
+        uintptr_t x = h.load(std::memory_order_acquire);
+        batch* b;
+        do {
+            b = reinterpret_cast<batch*>(x & ptr_mask);
+            if (!b)
+                return nullptr;
+        } while (!h.compare_exchange_weak(x, bump(x, reinterpret_cast<batch*>(b->next & ptr_mask)),
+                                          std::memory_order_acquire,
+                                          std::memory_order_acquire));
+        n = b->next >> 48;
+        bytes_[index(pooltag)].fetch_sub(n * unit(pooltag), std::memory_order_relaxed);
+        return b;
+    }
+
+    /** @brief Return the number of bytes of free objects in the depot
+        for @a pooltag. */
+    static size_t free_bytes(int pooltag) {
+        return bytes_[index(pooltag)].load(std::memory_order_relaxed);
+    }
+    /** @brief Return the number of bytes of free objects in the depot. */
+    static size_t free_bytes() {
+        size_t n = 0;
+        for (auto& b : bytes_)
+            n += b.load(std::memory_order_relaxed);
+        return n;
+    }
+    /** @brief Account for @a delta bytes carved into pool @a pooltag
+        (negative when trimmed). */
+    static void note_carved(int pooltag, ptrdiff_t delta) {
+        carved_[index(pooltag)].fetch_add(delta, std::memory_order_relaxed);
+    }
+    /** @brief Return the number of bytes carved into pool @a pooltag. */
+    static size_t carved_bytes(int pooltag) {
+        return carved_[index(pooltag)].load(std::memory_order_relaxed);
+    }
+    static unsigned flush_generation() {
+        return flush_generation_.load(std::memory_order_relaxed);
+    }
+    /** @brief Ask all threads to return their free nodes to the depot. */
+    static void request_flush() {
+        flush_generation_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /** @brief Count a newly allocated pool chunk on NUMA node @a node. */
+    static void note_chunk(int node) {
+        chunks_[node].fetch_add(1, std::memory_order_relaxed);
+    }
+    /** @brief Return the number of pool chunks allocated so far on NUMA
+        node @a node. */
+    static size_t chunks(int node) {
+        return chunks_[node].load(std::memory_order_relaxed);
+    }
+    /** @brief Return the number of pool chunks allocated so far. */
+    static size_t chunks() {
+        size_t n = 0;
+        for (int i = 0; i != max_nodes; ++i)
+            n += chunks(i);
+        return n;
+    }
+
+  private:
+    struct batch {
+        void* next_free;        // the free list link; must come first
+        uintptr_t next;         // next batch | (length << 48)
+    };
+
+    static constexpr uintptr_t ptr_mask = (uintptr_t(1) << 48) - 1;
+
+    static std::atomic<uintptr_t> heads_[max_nodes][2 * nclasses];
+    static std::atomic<size_t> chunks_[max_nodes];
+    static std::atomic<size_t> bytes_[2 * nclasses];
+    static std::atomic<size_t> carved_[2 * nclasses];
+    static std::atomic<unsigned> flush_generation_;
+
+    static int index(int pooltag) {
+        int c = pooltag & memtag_pool_nlines_mask;
+        assert(c > 0 && c <= nclasses);
+        return (pooltag & memtag_pool_compact ? nclasses : 0) + c - 1;
+    }
+    static std::atomic<uintptr_t>& head(int node, int pooltag) {
+        assert(node >= 0 && node < max_nodes);
+        return heads_[node][index(pooltag)];
+    }
+    static uintptr_t bump(uintptr_t x, batch* b) {
+        return ((x | ptr_mask) + 1) | reinterpret_cast<uintptr_t>(b);
+    }
+};
+
+#endif
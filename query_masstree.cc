@@ -22,6 +22,9 @@
 #include "masstree_split.hh"
 #include "masstree_remove.hh"
 #include "masstree_scan.hh"
+#include "masstree_bulk.hh"
+#include "masstree_relocate.hh"
+#include "masstree_frozen.hh"
 #include "masstree_stats.hh"
 #include "masstree_print.hh"
 #include "query_masstree.hh"
@@ -31,6 +34,13 @@
 #include "stringbag.hh"
 #include "json.hh"
 #include "kvrow.hh"
+#include <set>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace Masstree {
 
@@ -46,7 +56,7 @@ static void treestats1(node_base<P>* n, unsigned height) {
         if (n->deleted())
             return;
         leaf<P> *lf = (leaf<P> *)n;
-        typename leaf<P>::permuter_type perm = lf->permutation_;
+        typename leaf<P>::permuter_type perm = lf->permutation();
         sz = perm.size();
         for (int idx = 0; idx < sz; ++idx) {
             int p = perm[idx];
@@ -65,7 +75,7 @@ static void treestats1(node_base<P>* n, unsigned height) {
         sz = in->size();
         for (int i = 0; i <= sz; ++i)
             if (in->child_[i])
-                treestats1(in->child_[i], height + 1);
+                treestats1<P>(in->child_[i], height + 1);
     }
     assert((size_t) sz < arraysize(fillcounts));
     fillcounts[sz] += 1;
@@ -329,6 +339,1019 @@ void query_table<P>::test(threadinfo& ti) {
     }
 
     // XXX destroy tree
+
+    test_bulk_load(ti);
+    test_merge(ti);
+    test_remove_range(ti);
+    test_small_leaves(ti);
+    test_compressed_layers(ti);
+    test_inline_values(ti);
+    test_leaf_model(ti);
+    test_relocate(ti);
+    test_adaptive_split(ti);
+    test_frozen(ti);
+    test_pool_depot(ti);
+    test_reclaimer(ti);
+}
+
+namespace {
+struct scan_counter {
+    String last_;
+    int n_ = 0;
+    int nleaves_ = 0;
+    bool reverse_ = false;
+    template <typename SS, typename K>
+    void visit_leaf(const SS&, const K&, threadinfo&) {
+        ++nleaves_;
+    }
+    bool visit_value(Str key, row_type*, threadinfo&) {
+        always_assert(n_ == 0 || (reverse_ ? key < last_ : last_ < key));
+        last_ = key;
+        ++n_;
+        return true;
+    }
+};
+
+// checks that a scan visits every key in kept, in order
+struct kept_scanner {
+    const std::vector<String>& kept_;
+    bool reverse_;
+    String last_;
+    int n_ = 0;
+    size_t nkept_ = 0;
+    kept_scanner(const std::vector<String>& kept, bool reverse)
+        : kept_(kept), reverse_(reverse) {
+    }
+    template <typename SS, typename K>
+    void visit_leaf(const SS&, const K&, threadinfo&) {
+    }
+    bool visit_value(Str key, row_type*, threadinfo&) {
+        always_assert(n_ == 0 || (reverse_ ? key < last_ : last_ < key));
+        last_ = key;
+        ++n_;
+        if (nkept_ != kept_.size()
+            && key == kept_[reverse_ ? kept_.size() - 1 - nkept_ : nkept_])
+            ++nkept_;
+        return true;
+    }
+};
+
+struct row_disposer {
+    void operator()(row_type*& value, threadinfo& ti) const {
+        if (!row_inline<row_type>::is_inline(value))
+            value->deallocate_rcu(ti);
+    }
+};
+}
+
+template <typename P>
+void query_table<P>::test_bulk_load(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+
+    // keys with shared slices, keysuffixes, and nested layers
+    std::vector<String> keys;
+    for (int i = 0; i < 30000; ++i) {
+        char buf[64];
+        int len = sprintf(buf, "%07d", (i * 7919) % 10007);
+        keys.push_back(String(buf, len));
+        if (i % 3 == 0)
+            keys.push_back(String(buf, len) + "x");
+        if (i % 5 == 0) {
+            keys.push_back(String(buf, len) + String('\0') + "suffix");
+            keys.push_back(String(buf, len) + String('\0') + "suffix"
+                           + String(i % 17));
+        }
+        if (i % 7 == 0) {
+            keys.push_back(String(buf, len) + "_slice_2_tail");
+            keys.push_back(String(buf, len) + "_slice_2_tail" + String(i));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    for (double fill : {1.0, 0.6, 0.1}) {
+        query_table<P> t;
+        t.initialize(ti);
+        std::vector<std::pair<Str, row_type*> > kv;
+        for (auto& k : keys)
+            kv.push_back(std::make_pair(Str(k), row_type::create1(k, 0, ti)));
+        t.table_.bulk_load(kv.begin(), kv.end(), fill, ti);
+
+        for (auto& k : keys)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == k);
+        always_assert(!q.run_get1(t.table_, Str("0000000\0suffi", 13), 0, val, ti));
+        scan_counter sc;
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == (int) keys.size());
+
+        // the loaded tree must support ordinary inserts and splits
+        for (size_t i = 0; i < keys.size(); i += 2) {
+            String k = keys[i] + "!";
+            q.run_replace(t.table_, k, k, ti);
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            always_assert(q.run_get1(t.table_, keys[i], 0, val, ti) && val == keys[i]);
+            String k = keys[i] + "!";
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) == (i % 2 == 0));
+        }
+        sc = scan_counter();
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == (int) (keys.size() + (keys.size() + 1) / 2));
+    }
+    fprintf(stderr, "bulk load OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_merge(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+
+    // random insertion order, with keysuffixes and layers
+    std::vector<String> keys;
+    for (int i = 0; i < 20000; ++i) {
+        char buf[64];
+        int len = sprintf(buf, "%07d", (i * 7919) % 20011);
+        if (i % 3 == 0)
+            len += sprintf(buf + len, "_merge_layer_%d", i % 11);
+        keys.push_back(String(buf, len));
+        q.run_replace(t.table_, keys.back(), keys.back(), ti);
+    }
+    scan_counter sc;
+    t.table_.scan("", true, sc, ti);
+    int full_leaves = sc.nleaves_;
+    auto internodes = [&] {
+        lcdf::Json j = t.json_stats(ti)["internode_by_size"];
+        int n = 0;
+        for (int i = 0; i != j.size(); ++i)
+            n += j[i].to_i();
+        return n;
+    };
+    int full_internodes = internodes();
+
+    // delete 15 of every 16 keys
+    std::vector<String> kept;
+    for (size_t i = 0; i < keys.size(); ++i)
+        if (i % 16 == 0)
+            kept.push_back(keys[i]);
+        else
+            always_assert(q.run_remove(t.table_, keys[i], ti));
+    std::sort(kept.begin(), kept.end());
+
+    for (size_t i = 0; i < keys.size(); ++i)
+        always_assert(q.run_get1(t.table_, keys[i], 0, val, ti) == (i % 16 == 0));
+    sc = scan_counter();
+    t.table_.scan("", true, sc, ti);
+    always_assert(sc.n_ == (int) kept.size());
+    // without merging, about half the leaves would survive (leaves
+    // narrower than 4 keys are never merged; they mostly empty out instead)
+    if (P::leaf_merge_size > 0)
+        always_assert(sc.nleaves_ < full_leaves / 4);
+    // without internode merging, over 90% of the internodes would survive
+    if (P::leaf_merge_size > 0 && P::internode_merge_size > 0)
+        always_assert(internodes() < full_internodes / 2);
+    sc = scan_counter();
+    sc.reverse_ = true;
+    t.table_.rscan(kept.back(), true, sc, ti);
+    always_assert(sc.n_ == (int) kept.size());
+
+    // the merged tree must support ordinary inserts and splits
+    for (size_t i = 0; i < keys.size(); i += 2)
+        q.run_replace(t.table_, keys[i], keys[i], ti);
+    for (size_t i = 0; i < keys.size(); ++i)
+        always_assert(q.run_get1(t.table_, keys[i], 0, val, ti) == (i % 2 == 0 || i % 16 == 0));
+
+    // readers and scanners running during the removes see every kept key
+    query_table<P> u;
+    u.initialize(ti);
+    keys.clear();
+    kept.clear();
+    for (int i = 0; i < 40000; ++i) {
+        char buf[64];
+        int len = sprintf(buf, "%07d", (i * 7919) % 40009);
+        keys.push_back(String(buf, len));
+        q.run_replace(u.table_, keys.back(), keys.back(), ti);
+        if (i % 16 == 0)
+            kept.push_back(keys.back());
+    }
+    std::sort(kept.begin(), kept.end());
+    std::atomic<bool> done(false);
+    auto reader = [&](threadinfo* rti, size_t i) {
+        query<row_type> rq;
+        Str rval;
+        for (; !done.load(); i += 7) {
+            const String& k = kept[i % kept.size()];
+            rti->rcu_start();
+            always_assert(rq.run_get1(u.table_, k, 0, rval, *rti) && rval == k);
+            rti->rcu_stop();
+        }
+    };
+    auto scanner = [&](threadinfo* sti, bool reverse) {
+        do {
+            kept_scanner ks(kept, reverse);
+            sti->rcu_start();
+            if (reverse)
+                u.table_.rscan("9999999", true, ks, *sti);
+            else
+                u.table_.scan("", true, ks, *sti);
+            sti->rcu_stop();
+            always_assert(ks.nkept_ == kept.size());
+        } while (!done.load());
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i != 4; ++i) {
+        threadinfo* xti = threadinfo::make(threadinfo::TI_PROCESS, -1);
+        if (i < 2)
+            threads.emplace_back(reader, xti, size_t(i));
+        else
+            threads.emplace_back(scanner, xti, i == 3);
+    }
+    for (size_t i = 0; i < keys.size(); ++i)
+        if (i % 16 != 0)
+            always_assert(q.run_remove(u.table_, keys[i], ti));
+    done = true;
+    for (auto& th : threads)
+        th.join();
+    sc = scan_counter();
+    u.table_.scan("", true, sc, ti);
+    always_assert(sc.n_ == (int) kept.size());
+    fprintf(stderr, "merge OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_remove_range(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+    row_disposer rd;
+
+    // 20 tenants with 8-byte prefixes, each its own trie layer, plus a
+    // key equal to each prefix and some short keys
+    std::set<String> model;
+    for (int i = 0; i < 10000; ++i) {
+        char buf[64];
+        int len;
+        if (i % 2)
+            len = sprintf(buf, "tnt%05d/row%05d", (i / 2) % 20, (i * 7) % 5003);
+        else if (i % 10 == 0)
+            len = sprintf(buf, "tnt%05d", (i / 10) % 20);
+        else
+            len = sprintf(buf, "%07d", i);
+        String key(buf, len);
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+    }
+
+    auto check = [&]() {
+        for (auto& k : model)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti));
+        scan_counter sc;
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == (int) model.size());
+    };
+    auto remove = [&](Str first, Str last) {
+        t.table_.remove_range(first, last, rd, ti);
+        for (auto it = model.lower_bound(String(first));
+             it != model.end() && *it < last; )
+            it = model.erase(it);
+        check();
+    };
+
+    // drop one whole tenant layer, then a run of adjacent tenants
+    remove("tnt00003", "tnt00004");
+    always_assert(!q.run_get1(t.table_, "tnt00003/row00007", 0, val, ti));
+    remove("tnt00010", "tnt00015");
+    // ranges that start and end inside layers
+    remove("tnt00005/row01000", "tnt00008/row02500");
+    remove("tnt00001/row00100", "tnt00001/row00200");
+    // short keys only, then everything
+    remove("0001000", "0006000");
+    remove("", "\377");
+    always_assert(model.empty());
+
+    // the emptied tree still works
+    q.run_replace(t.table_, "tnt00003/row00007", "x", ti);
+    always_assert(q.run_get1(t.table_, "tnt00003/row00007", 0, val, ti));
+    fprintf(stderr, "remove_range OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_small_leaves(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+
+    // 16-byte prefixes, so each prefix ends a trie layer for 8- and
+    // 16-byte ikeys alike; most prefixes hold two or three keys, every
+    // tenth grows past a small leaf
+    std::set<String> model;
+    for (int i = 0; i < 3000; ++i) {
+        int nkeys = i % 10 ? 2 + i % 2 : 40;
+        for (int k = 0; k < nkeys; ++k) {
+            char buf[64];
+            int len = sprintf(buf, "user%012d/field%d", (i * 7919) % 3001, k);
+            String key(buf, len);
+            model.insert(key);
+            q.run_replace(t.table_, key, key, ti);
+        }
+    }
+    auto check = [&]() {
+        for (auto& k : model)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == k);
+        scan_counter sc;
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == (int) model.size());
+    };
+    check();
+    if (leaf<P>::small_width < leaf<P>::width) {
+        lcdf::Json j = t.json_stats(ti);
+        always_assert(j["small_leaf"].to_i() >= 2700);
+    }
+
+    // free and reuse slots in small and grown leaves
+    for (auto it = model.begin(); it != model.end(); ) {
+        if (it->back() == '0') {
+            always_assert(q.run_remove(t.table_, *it, ti));
+            it = model.erase(it);
+        } else
+            ++it;
+    }
+    check();
+    for (int i = 0; i < 3000; i += 3) {
+        char buf[64];
+        int len = sprintf(buf, "user%012d/field%d", i, 0);
+        String key(buf, len);
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+    }
+    check();
+    fprintf(stderr, "small leaves OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_compressed_layers(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+    row_disposer rd;
+
+    // eight groups of keys behind 40-byte prefixes, which differ only in
+    // their first and last bytes; odd groups add keys that end inside the prefix, at slice
+    // boundaries, and that diverge from it partway
+    std::vector<String> keys;
+    for (int g = 0; g < 8; ++g) {
+        char buf[64];
+        int plen = sprintf(buf, "%c%-35s%04d", 'a' + g, "/compressed/layer/prefix", g);
+        String prefix(buf, plen);
+        for (int k = 0; k < (g < 2 ? 1 + g : 40 * g); ++k) {
+            int len = sprintf(buf + plen, "/k%05d", (k * 7919) % 10007);
+            keys.push_back(String(buf, plen + len));
+        }
+        if (g % 2) {
+            for (int len : {8, 12, 16, 24, 32, 36, 39, 40})
+                keys.push_back(prefix.substr(0, len));
+            keys.push_back(prefix.substr(0, 12) + "!" + prefix.substr(13));
+            keys.push_back(prefix.substr(0, 27) + "~/k" + String(g));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    std::set<String> model;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        const String& key = keys[(i * 7919) % keys.size()];
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+    }
+    always_assert(model.size() == keys.size());
+
+    auto check = [&](query_table<P>& t) {
+        for (auto& k : keys)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) == model.count(k));
+        scan_counter sc;
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == (int) model.size());
+        // scans that start inside, before, after, and past compressed paths
+        for (size_t i = 0; i < keys.size(); i += 3)
+            for (String k : {keys[i], keys[i].substr(0, keys[i].length() - 1),
+                             keys[i] + "\377", keys[i].substr(0, 20) + "~",
+                             keys[i].substr(0, 8 * (i % 5 + 1))}) {
+                sc = scan_counter();
+                t.table_.scan(k, true, sc, ti);
+                always_assert(sc.n_ == (int) std::distance(model.lower_bound(k), model.end()));
+                sc = scan_counter();
+                sc.reverse_ = true;
+                t.table_.rscan(k, true, sc, ti);
+                always_assert(sc.n_ == (int) std::distance(model.begin(), model.upper_bound(k)));
+            }
+    };
+    check(t);
+    always_assert(t.json_stats(ti)["compressed_layer"].to_i() > 0);
+
+    // remove keys one by one, then ranges that cut into compressed paths
+    for (size_t i = 0; i < keys.size(); i += 4)
+        if (model.erase(keys[i]))
+            always_assert(q.run_remove(t.table_, keys[i], ti));
+    check(t);
+    auto remove = [&](Str first, Str last) {
+        t.table_.remove_range(first, last, rd, ti);
+        for (auto it = model.lower_bound(String(first));
+             it != model.end() && *it < last; )
+            it = model.erase(it);
+        check(t);
+    };
+    String prefix = keys.back().substr(1, 35);
+    remove("e" + prefix + "0004", "e" + prefix + "0005");
+    remove("f" + prefix.substr(0, 20), "g" + prefix + "0006/k05");
+    remove("a" + prefix.substr(0, 10), "c" + prefix + "0002/k05");
+
+    // the bulk loader folds single-entry layers into compressed paths
+    query_table<P> bt;
+    bt.initialize(ti);
+    std::vector<std::pair<Str, row_type*> > kv;
+    for (auto& k : model)
+        kv.push_back(std::make_pair(Str(k), row_type::create1(k, 0, ti)));
+    bt.table_.bulk_load(kv.begin(), kv.end(), 1.0, ti);
+    check(bt);
+    always_assert(bt.json_stats(ti)["compressed_layer"].to_i() > 0);
+    for (auto& k : keys) {
+        String nk = k + "/new";
+        model.insert(nk);
+        q.run_replace(bt.table_, nk, nk, ti);
+    }
+    check(bt);
+    fprintf(stderr, "compressed layers OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_inline_values(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+    row_disposer rd;
+
+    // even keys get values short enough to store inline
+    auto make_value = [](int i, int gen) {
+        char buf[64];
+        int len = i % 2 ? sprintf(buf, "value%04d/%08d", gen, i)
+            : sprintf(buf, "%d", i * 7 + gen);
+        return String(buf, len);
+    };
+    std::map<String, String> model;
+    uint64_t alloc_before = ti.counter(tc_alloc_value);
+    for (int i = 0; i < 4000; i += 2) {
+        char buf[32];
+        String key(buf, sprintf(buf, "inline%06d", i));
+        model[key] = make_value(i, 0);
+        q.run_replace(t.table_, key, model[key], ti);
+    }
+    if (row_inline<row_type>::enabled)
+        always_assert(ti.counter(tc_alloc_value) == alloc_before);
+    for (int i = 1; i < 4000; i += 2) {
+        char buf[32];
+        String key(buf, sprintf(buf, "inline%06d", i));
+        model[key] = make_value(i, 0);
+        q.run_replace(t.table_, key, model[key], ti);
+    }
+
+    auto check = [&]() {
+        std::vector<Str> keys;
+        for (auto& kv : model) {
+            always_assert(q.run_get1(t.table_, kv.first, 0, val, ti)
+                          && val == kv.second);
+            keys.push_back(kv.first);
+        }
+        std::vector<Str> vals(keys.size());
+        std::unique_ptr<bool[]> found(new bool[keys.size()]);
+        always_assert(q.run_multi_get1(t.table_, keys.data(), keys.size(), 0,
+                                       vals.data(), found.get(), ti)
+                      == (int) keys.size());
+        auto it = model.begin();
+        for (size_t i = 0; i != keys.size(); ++i, ++it)
+            always_assert(vals[i] == it->second);
+
+        lcdf::Json req = lcdf::Json::array(0, 0, "", 100000);
+        q.run_scan(t.table_, req, ti);
+        always_assert(req.size() == 2 + 2 * (int) model.size());
+        it = model.begin();
+        for (int i = 2; i != req.size(); i += 2, ++it)
+            always_assert(req[i].as_s() == it->first
+                          && req[i + 1].as_s() == it->second);
+    };
+    check();
+
+    // grow some inline values past the slot, shrink some rows into it
+    for (int i = 0; i < 4000; i += 3) {
+        char buf[32];
+        String key(buf, sprintf(buf, "inline%06d", i));
+        model[key] = make_value(i + 1, 1);
+        lcdf::Json put[2] = {0, model[key]};
+        q.run_put(t.table_, key, &put[0], &put[2], ti);
+    }
+    check();
+
+    // writing another column promotes an inline value to a row
+    {
+        String key("inline000004");
+        lcdf::Json put[2] = {1, "x"};
+        q.run_put(t.table_, key, &put[0], &put[2], ti);
+        lcdf::Json req = lcdf::Json::array(0, 0, key);
+        q.run_get(t.table_, req, ti);
+        always_assert(req.size() >= 3);
+        q.run_replace(t.table_, key, model[key], ti);
+    }
+    check();
+
+    for (int i = 0; i < 4000; i += 5) {
+        char buf[32];
+        String key(buf, sprintf(buf, "inline%06d", i));
+        always_assert(q.run_remove(t.table_, key, ti) == model.count(key));
+        model.erase(key);
+    }
+    t.table_.remove_range("inline001000", "inline002000", rd, ti);
+    model.erase(model.lower_bound("inline001000"),
+                model.lower_bound("inline002000"));
+    check();
+    fprintf(stderr, "inline values OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_leaf_model(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+
+    // big-endian integer keys: a dense run, as in a time-ordered ID
+    // table, then a sparser run far above it
+    auto make_key = [](int i, int delta = 0) {
+        uint64_t x = i < 20000 ? (uint64_t(1) << 40) + 3 * i
+            : (uint64_t(1) << 50) + 1000 * uint64_t(i) * i;
+        x = host_to_net_order(x + delta);
+        return String((const char*) &x, 8);
+    };
+    std::vector<String> keys;
+    for (int i = 0; i < 24000; ++i) {
+        keys.push_back(make_key(i));
+        q.run_replace(t.table_, keys.back(), keys.back(), ti);
+    }
+    auto check = [&]() {
+        for (auto& k : keys)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == k);
+    };
+    // number of keys whose leaf the model finds directly
+    auto nfound = [&]() {
+        typename leaf<P>::nodeversion_type v;
+        size_t n = 0;
+        for (auto& k : keys)
+            n += t.table_.model()->find(key<typename P::ikey_type>(k), v, ti) != nullptr;
+        return n;
+    };
+    always_assert(!t.table_.model());
+    check();
+
+    always_assert(t.table_.maintain_model(ti) == P::leaf_model);
+    check();
+    if (P::leaf_model) {
+        const leaf_model<P>* m = t.table_.model();
+        always_assert(m && m->size() > 500 && m->nsegments() < m->size() / 10);
+        always_assert(nfound() == keys.size());
+        always_assert(!m->outdated() && !t.table_.maintain_model(ti));
+    }
+
+    // splits leave the model usable; keys that moved fall back, and the
+    // misses mark the model outdated
+    for (int i = 0; i < 20000; i += 2) {
+        String k = make_key(i, 1);
+        q.run_replace(t.table_, k, k, ti);
+    }
+    check();
+    if (P::leaf_model) {
+        size_t n = nfound();
+        always_assert(n > 0 && n < keys.size());
+        always_assert(t.table_.model()->outdated()
+                      && !t.table_.model()->stale());
+        always_assert(t.table_.maintain_model(ti));
+        always_assert(nfound() == keys.size());
+    }
+
+    // freeing another table's leaves leaves this model alone
+    query_table<P> u;
+    u.initialize(ti);
+    for (int i = 0; i < 2000; ++i) {
+        String k = make_key(i);
+        q.run_replace(u.table_, k, k, ti);
+    }
+    u.table_.build_model(ti);
+    for (int i = 0; i < 2000; ++i)
+        always_assert(q.run_remove(u.table_, make_key(i), ti));
+    if (P::leaf_model)
+        always_assert(u.table_.model()->stale()
+                      && !t.table_.model()->outdated());
+    u.table_.destroy(ti);
+
+    // freeing one of its leaves makes the model stale until it is rebuilt
+    for (int i = 1000; i < 3000; ++i) {
+        always_assert(q.run_remove(t.table_, keys[i], ti));
+        q.run_remove(t.table_, make_key(i, 1), ti);
+    }
+    keys.erase(keys.begin() + 1000, keys.begin() + 3000);
+    check();
+    if (P::leaf_model) {
+        always_assert(t.table_.model()->stale() && nfound() == 0);
+        always_assert(t.table_.maintain_model(ti));
+        always_assert(!t.table_.model()->stale() && nfound() == keys.size());
+    }
+    check();
+
+    t.table_.destroy(ti);
+    fprintf(stderr, "leaf model OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_relocate(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+
+    // keys inserted out of order, so splits scatter the leaves
+    std::set<String> model;
+    for (int i = 0; i < 20000; ++i) {
+        char buf[64];
+        int len = sprintf(buf, "%07d", (i * 7919) % 20011);
+        String key(buf, len);
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+    }
+    auto check = [&]() {
+        for (auto& k : model)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == k);
+        scan_counter sc;
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == (int) model.size());
+    };
+    // number of first-layer leaves not allocated right after their
+    // predecessor
+    auto nbreaks = [&]() {
+        typename leaf<P>::nodeversion_type v;
+        leaf<P>* lf = t.table_.fix_root()->reach_leaf(key<typename P::ikey_type>(Str()), v, ti);
+        int n = 0;
+        for (leaf<P>* next; (next = lf->safe_next()); lf = next) {
+            size_t sz = iceil(lf->allocated_size() + memdebug_size, CACHE_LINE_SIZE);
+            n += (const char*) next != (const char*) lf + sz;
+        }
+        return n;
+    };
+    auto relocate_pass = [&](leaf_relocator<P>& r) {
+        uint64_t passes = r.passes();
+        int n = 0;
+        while (r.passes() == passes)
+            n += r.run(50, ti);
+        return n;
+    };
+    check();
+    always_assert(nbreaks() > 100);
+
+    // one pass lays the leaves out in key order; the leftmost leaf stays
+    // put, and the sequential chunk may end partway through
+    leaf_relocator<P> r(t.table_);
+    always_assert(relocate_pass(r) > 100);
+    check();
+    always_assert(nbreaks() <= 3);
+    always_assert(relocate_pass(r) <= 2);
+
+    // relocated leaves split and shrink like any other
+    for (auto it = model.begin(); it != model.end(); ) {
+        if (it->back() % 3 == 0) {
+            always_assert(q.run_remove(t.table_, *it, ti));
+            it = model.erase(it);
+        } else
+            ++it;
+    }
+    for (int i = 20011; i < 30000; i += 3) {
+        char buf[64];
+        int len = sprintf(buf, "%07d", i);
+        String key(buf, len);
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+    }
+    check();
+
+    // long keys: the pass descends into each trie layer
+    for (int i = 0; i < 10000; ++i) {
+        char buf[64];
+        int len = sprintf(buf, "tnt%05d/row%05d", (i * 13) % 40, (i * 7) % 5003);
+        String key(buf, len);
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+    }
+    always_assert(relocate_pass(r) > 0);
+    check();
+    relocate_pass(r);
+    check();
+
+    t.table_.destroy(ti);
+    fprintf(stderr, "relocate OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_adaptive_split(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+
+    // Insert big-endian event IDs in the order given by @a id and return
+    // the average fraction of each first-layer leaf in use.
+    auto fill = [&](int n, auto id) {
+        query_table<P> t;
+        t.initialize(ti);
+        std::vector<String> keys;
+        for (int i = 0; i < n; ++i) {
+            uint64_t x = host_to_net_order(uint64_t(1000 + id(i)));
+            keys.push_back(String((const char*) &x, 8));
+            q.run_replace(t.table_, keys.back(), keys.back(), ti);
+        }
+        for (auto& k : keys)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == k);
+        scan_counter sc;
+        t.table_.scan("", true, sc, ti);
+        always_assert(sc.n_ == n);
+
+        typename leaf<P>::nodeversion_type v;
+        leaf<P>* lf = t.table_.fix_root()->reach_leaf(key<typename P::ikey_type>(Str()), v, ti);
+        int nleaves = 0;
+        for (; lf; lf = lf->safe_next())
+            ++nleaves;
+        t.table_.destroy(ti);
+        return n / double(nleaves * leaf<P>::width);
+    };
+
+    // almost sorted: every fifth ID arrives after the two that follow it
+    auto jitter = [](int i) {
+        return i % 5 == 0 ? i + 2 : i % 5 <= 2 ? i - 1 : i;
+    };
+    double forward = fill(30000, jitter);
+    double backward = fill(30000, [&](int i) { return 30000 - jitter(i); });
+    // strictly sorted input still packs leaves full
+    double sorted = fill(30000, [](int i) { return i; });
+    // random order splits at the midpoint as before
+    double random = fill(30000, [](int i) { return (i * 7919) % 30011; });
+    // (narrow leaves cannot reach these fill factors)
+    if (leaf<P>::width >= 8)
+        always_assert(forward > 0.85 && backward > 0.85 && sorted > 0.95
+                      && random > 0.6);
+
+    // in narrow nodes, every history still leaves both halves nonempty
+    for (int pos : {16, 15, 0, 8}) {   // append, near append, low, other
+        insert_history h;
+        for (int i = 0; i != 8; ++i)
+            h.record(pos, 16);
+        for (int size = 2; size <= 4; ++size)
+            for (int p = 0; p <= size; ++p) {
+                int mid = h.split_point(p, size, size / 2 + 1);
+                always_assert(mid >= 1 && mid <= size);
+            }
+    }
+    fprintf(stderr, "adaptive split OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_frozen(threadinfo& ti) {
+    query<row_type> q;
+    Str val;
+    query_table<P> t;
+    t.initialize(ti);
+    row_disposer rd;
+    const int ikey_size = sizeof(typename P::ikey_type);
+
+    // 12 tenants behind one-slice prefixes; tenant 2 has a second level of
+    // prefixes, and tenant 6's keys share a compressed path
+    auto tenant = [&](int i) {
+        char buf[64];
+        return String(buf, sprintf(buf, "tnt%0*d", ikey_size - 3, i));
+    };
+    auto sub = [&](int i) {
+        char buf[64];
+        return tenant(2) + String(buf, sprintf(buf, "/sub%0*d", ikey_size - 4, i));
+    };
+    String shared = String("/shared//shared/").substr(0, ikey_size);
+    std::set<String> model;
+    for (int i = 0; i < 24000; ++i) {
+        char buf[64];
+        int n = i % 12;
+        String key;
+        if (n == 2)
+            key = sub((i / 12) % 20) + String(buf, sprintf(buf, "/item%03d", (i * 7) % 101));
+        else if (n == 6)
+            key = tenant(n) + shared + String(buf, sprintf(buf, "row%05d", (i * 7) % 5003));
+        else
+            key = tenant(n) + String(buf, sprintf(buf, "/row%05d", (i * 7) % 5003));
+        model.insert(key);
+        q.run_replace(t.table_, key, key, ti);
+        if (i % 100 == 0) {
+            key = i % 200 ? tenant(n) : String(buf, sprintf(buf, "%07d", n));
+            model.insert(key);
+            q.run_replace(t.table_, key, key, ti);
+        }
+    }
+
+    auto check = [&]() {
+        for (auto& k : model)
+            always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == k);
+        always_assert(!q.run_get1(t.table_, tenant(3) + "/row99999", 0, val, ti));
+        always_assert(!q.run_get1(t.table_, tenant(3) + "/", 0, val, ti));
+        std::vector<String> keys(model.begin(), model.end());
+        std::vector<Str> strs(keys.begin(), keys.end());
+        std::vector<row_type*> values(strs.size());
+        std::unique_ptr<bool[]> found(new bool[strs.size()]);
+        always_assert(t.table_.multi_get(strs.data(), strs.size(), values.data(),
+                                         found.get(), ti) == (int) strs.size());
+        // scans from before, inside, and after tenants
+        for (size_t i = 0; i < keys.size(); i += 97)
+            for (String k : {keys[i], keys[i] + "!", keys[i].substr(0, ikey_size + 1),
+                             keys[i].substr(0, ikey_size), keys[i].substr(0, ikey_size - 1)}) {
+                scan_counter sc;
+                t.table_.scan(k, true, sc, ti);
+                always_assert(sc.n_ == (int) std::distance(model.lower_bound(k), model.end()));
+                sc = scan_counter();
+                t.table_.scan(k, false, sc, ti);
+                always_assert(sc.n_ == (int) std::distance(model.upper_bound(k), model.end()));
+                sc = scan_counter();
+                sc.reverse_ = true;
+                t.table_.rscan(k, true, sc, ti);
+                always_assert(sc.n_ == (int) std::distance(model.begin(), model.upper_bound(k)));
+            }
+    };
+    // number of keys that extend prefix
+    auto count = [&](const String& prefix) {
+        int n = 0;
+        for (auto it = model.upper_bound(prefix);
+             it != model.end() && it->starts_with(prefix); ++it)
+            ++n;
+        return n;
+    };
+    check();
+    lcdf::Json j = t.json_stats(ti);
+    long before = j["leaf_bytes"].to_i();
+
+    // freeze a nested layer, then merge it into its tenant's block
+    always_assert(t.table_.freeze(sub(3), ti) == count(sub(3)));
+    check();
+    for (int n = 0; n < 12; ++n)
+        always_assert(t.table_.freeze(tenant(n), ti) == count(tenant(n)));
+    always_assert(t.table_.freeze(tenant(4), ti) == 0);
+    always_assert(t.table_.freeze(tenant(99), ti) == 0);
+    check();
+    j = t.json_stats(ti);
+    always_assert(j["frozen"].to_i() == 12);
+    always_assert(j["size"].to_i() == (long) model.size());
+    always_assert((j["leaf_bytes"].to_i() + j["frozen_bytes"].to_i()) * 3 < before);
+
+    // writes thaw one tenant each
+    String k = tenant(3) + "/row00007";
+    q.run_replace(t.table_, k, "x", ti);
+    always_assert(q.run_get1(t.table_, k, 0, val, ti) && val == "x");
+    q.run_replace(t.table_, k, k, ti);
+    model.insert(k);
+    k = *model.upper_bound(tenant(6));
+    always_assert(q.run_remove(t.table_, k, ti));
+    model.erase(k);
+    check();
+    always_assert(t.json_stats(ti)["frozen"].to_i() == 10);
+
+    // remove_range across frozen tenants, then refreeze what is left
+    auto remove = [&](Str first, Str last) {
+        t.table_.remove_range(first, last, rd, ti);
+        for (auto it = model.lower_bound(String(first));
+             it != model.end() && *it < last; )
+            it = model.erase(it);
+        check();
+    };
+    remove(tenant(4) + "/row01000", tenant(5) + "/row02000");
+    remove(tenant(7), tenant(9));
+    remove(tenant(10) + "/row00100", tenant(10) + "/row00200");
+    always_assert(t.table_.freeze(tenant(4), ti) == count(tenant(4)));
+    always_assert(t.table_.freeze(tenant(7), ti) == 0);
+    check();
+
+    t.table_.destroy(ti);
+    fprintf(stderr, "frozen OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_pool_depot(threadinfo& ti) {
+    // One thread allocates leaves, another frees them, as with a queue.
+    // The freed leaves must come back to the allocating thread through
+    // the depot rather than as new chunks. Each round moves whole
+    // batches, so the consumer keeps the same surplus after every round.
+    static threadinfo* consumer = threadinfo::make(threadinfo::TI_PROCESS, -1);
+    std::vector<void*> nodes;
+    size_t chunks = 0;
+    int nlines = (sizeof(leaf<P>) + memdebug_size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    unsigned per_round = 400 * pool_depot::batch_size(nlines);
+    for (int round = 0; round != 10; ++round) {
+        for (unsigned i = 0; i != per_round; ++i)
+            nodes.push_back(ti.pool_allocate(sizeof(leaf<P>), memtag_masstree_leaf));
+        for (void* p : nodes)
+            consumer->pool_deallocate(p, sizeof(leaf<P>), memtag_masstree_leaf);
+        nodes.clear();
+        if (round == 1)
+            chunks = pool_depot::chunks();
+    }
+    always_assert(pool_depot::chunks() == chunks);
+
+    // Once they are all free, trimming releases their chunks, and later
+    // allocations reuse the released chunks.
+    for (int i = 0; i != 100000; ++i)
+        nodes.push_back(ti.pool_allocate(sizeof(leaf<P>), memtag_masstree_leaf));
+    for (void* p : nodes)
+        consumer->pool_deallocate(p, sizeof(leaf<P>), memtag_masstree_leaf);
+    ti.flush_pools();
+    consumer->flush_pools();
+    threadinfo::set_pool_retention(0);
+    always_assert(threadinfo::trim_pools() >= nodes.size() * sizeof(leaf<P>) / 2);
+    always_assert(threadinfo::trim_pools() == 0);
+    chunks = pool_depot::chunks();
+    for (void*& p : nodes)
+        p = ti.pool_allocate(sizeof(leaf<P>), memtag_masstree_leaf);
+    always_assert(pool_depot::chunks() == chunks);
+    for (void* p : nodes)
+        ti.pool_deallocate(p, sizeof(leaf<P>), memtag_masstree_leaf);
+    threadinfo::set_pool_retention(64 << 20);
+
+    // Each value size maps to the smallest slab that holds it, and the
+    // slab's occupancy counts what is allocated from it.
+    for (size_t sz = 1; sz <= pool_depot::max_value_size; ++sz) {
+        int c = pool_depot::value_class(sz);
+        always_assert(pool_depot::unit(c) >= sz
+                      && (c == pool_depot::max_nlines + 1
+                          || pool_depot::unit(c - 1) < sz));
+    }
+    always_assert(pool_depot::value_class(pool_depot::max_value_size + 1) == 0);
+    auto slab_used = [](int pooltag) {
+        return pool_depot::carved_bytes(pooltag) - threadinfo::pool_free_bytes(pooltag);
+    };
+    int pooltag = threadinfo::value_pooltag(100);
+    size_t used = slab_used(pooltag);
+    for (int i = 0; i != 10000; ++i)
+        nodes[i] = ti.allocate(100, memtag_value);
+    always_assert(slab_used(pooltag) == used + 10000 * pool_depot::unit(pooltag));
+    for (int i = 0; i != 10000; ++i)
+        consumer->deallocate(nodes[i], 100, memtag_value);
+    always_assert(slab_used(pooltag) == used);
+    fprintf(stderr, "pool depot OK\n");
+}
+
+template <typename P>
+void query_table<P>::test_reclaimer(threadinfo&) {
+    // Once a reclaimer exists, a thread's RCU frees go to it in limbo
+    // groups, and the thread's own quiescent points free nothing. The
+    // reclaimer is process-wide and permanent, so the test makes it in a
+    // child process, leaving the tests that follow unaffected.
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    always_assert(pid >= 0);
+    if (pid == 0) {
+        threadinfo* worker = threadinfo::make(threadinfo::TI_PROCESS, -1);
+        enum { n = 1000, sz = 100 };
+        int pooltag = threadinfo::value_pooltag(sz);
+        std::vector<void*> values;
+        for (int i = 0; i != n; ++i)
+            values.push_back(worker->allocate(sz, memtag_value));
+        threadinfo* reclaimer = threadinfo::make(threadinfo::TI_RECLAIM, -1);
+        always_assert(threadinfo::reclaimer() == reclaimer);
+        size_t free_bytes = threadinfo::pool_free_bytes(pooltag);
+
+        worker->rcu_start();
+        for (void* p : values)
+            worker->deallocate_rcu(p, sz, memtag_value);
+        worker->rcu_stop();
+        // advance the epoch as mtd's timer does; no thread is in an RCU
+        // epoch, so every object is now free to go
+        globalepoch.store(globalepoch.load() + 2);
+        active_epoch.store(threadinfo::min_active_epoch());
+        worker->rcu_quiesce();
+        worker->rcu_stop();
+        always_assert(threadinfo::pool_free_bytes(pooltag) == free_bytes);
+
+        reclaimer->rcu_start();
+        always_assert(reclaimer->reclaim_limbo() == n);
+        reclaimer->rcu_stop();
+        always_assert(threadinfo::pool_free_bytes(pooltag)
+                      == free_bytes + n * pool_depot::unit(pooltag));
+        always_assert(reclaimer->reclaim_limbo() == 0);
+        _exit(0);
+    }
+    int status;
+    always_assert(waitpid(pid, &status, 0) == pid);
+    always_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    fprintf(stderr, "reclaimer OK\n");
 }
 
 template <typename P>
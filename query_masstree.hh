@@ -62,6 +62,18 @@ class query_table {
     void print(FILE* f) const;
 
     static void test(threadinfo& ti);
+    static void test_bulk_load(threadinfo& ti);
+    static void test_merge(threadinfo& ti);
+    static void test_remove_range(threadinfo& ti);
+    static void test_small_leaves(threadinfo& ti);
+    static void test_compressed_layers(threadinfo& ti);
+    static void test_inline_values(threadinfo& ti);
+    static void test_leaf_model(threadinfo& ti);
+    static void test_relocate(threadinfo& ti);
+    static void test_adaptive_split(threadinfo& ti);
+    static void test_frozen(threadinfo& ti);
+    static void test_pool_depot(threadinfo& ti);
+    static void test_reclaimer(threadinfo& ti);
 
     static const char* name() {
         return "mb";
@@ -71,9 +83,17 @@ class query_table {
     basic_table<P> table_;
 };
 
-struct default_query_table_params : public nodeparams<15, 15> {
+struct default_query_table_params : public nodeparams<MASSTREE_LEAF_WIDTH, MASSTREE_INTERNODE_WIDTH> {
+    static constexpr int bound_method = MASSTREE_BOUND_METHOD;
+    static constexpr int leaf_layout = MASSTREE_LEAF_LAYOUT;
+    static constexpr int descent_prefetch = MASSTREE_DESCENT_PREFETCH;
+    static constexpr bool use_finger = true;
+    static constexpr int small_leaf_width = 3;
+    static constexpr bool compressed_pointers = MASSTREE_COMPRESSED_POINTERS;
+    static constexpr bool leaf_model = MASSTREE_LEAF_MODEL;
+    typedef MASSTREE_IKEY_TYPE ikey_type;
     typedef row_type* value_type;
-    typedef value_print<value_type> value_print_type;
+    typedef row_print<row_type> value_print_type;
     typedef ::threadinfo threadinfo_type;
 };
 
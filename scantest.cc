@@ -3,7 +3,8 @@
 using namespace Masstree;
 
 kvepoch_t global_log_epoch = 0;
-volatile mrcu_epoch_type globalepoch = 1; // global epoch, updated by main thread regularly
+relaxed_atomic<mrcu_epoch_type> globalepoch(1);     // global epoch, updated by main thread regularly
+relaxed_atomic<mrcu_epoch_type> active_epoch(1);
 volatile bool recovering = false; // so don't add log entries, and free old value immediately
 kvtimestamp_t initial_timestamp;
 
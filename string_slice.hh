@@ -45,7 +45,7 @@ template <typename T> struct string_slice {
         }
 #if HAVE_UNALIGNED_ACCESS
         if (len >= size) {
-            return *reinterpret_cast<const T *>(s);
+            return read_in_host_order<T>(s);
         }
 #endif
         union_type u(0);
@@ -77,12 +77,12 @@ template <typename T> struct string_slice {
         }
 #if HAVE_UNALIGNED_ACCESS
         if (len >= size) {
-            return *reinterpret_cast<const T *>(s);
+            return read_in_host_order<T>(s);
         }
 # if WORDS_BIGENDIAN
-        return *reinterpret_cast<const T *>(s) & (~T(0) << (8 * (size - len)));
+        return read_in_host_order<T>(s) & (~T(0) << (8 * (size - len)));
 # elif WORDS_BIGENDIAN_SET
-        return *reinterpret_cast<const T *>(s - (size - len)) >> (8 * (size - len));
+        return read_in_host_order<T>(s - (size - len)) >> (8 * (size - len));
 # else
 #  error "WORDS_BIGENDIAN has not been set!"
 # endif
@@ -151,8 +151,7 @@ template <typename T> struct string_slice {
 #if HAVE_UNALIGNED_ACCESS
         if (len <= size) {
             typename mass::make_unsigned<T>::type delta
-                = *reinterpret_cast<const T*>(a)
-                  ^ *reinterpret_cast<const T*>(b);
+                = read_in_host_order<T>(a) ^ read_in_host_order<T>(b);
             if (unlikely(len <= 0)) {
                 return true;
             }
@@ -20,6 +20,7 @@
 #include <algorithm>
 #include <sys/time.h>
 #include <assert.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
@@ -27,6 +28,7 @@
 #include "kvrandom.hh"
 #include "string_slice.hh"
 #include "kpermuter.hh"
+#include "ksearch.hh"
 #include "value_bag.hh"
 #include "value_string.hh"
 #include "json.hh"
@@ -177,6 +179,147 @@ void test_kpermuter() {
     assert(ka.size() == 2 && ka[0] == 1 && ka[1] == 2 && ka.back() == 0);
 }
 
+#if HAVE_WIDE_KPERMUTER
+template <int W>
+void test_wide_kpermuter_one() {
+    typedef kpermuter<W> permuter_type;
+    permuter_type k = permuter_type::make_empty();
+    assert(k.size() == 0 && k[0] == W - 1 && k.back() == 0);
+    int i = k.insert_from_back(0);
+    assert(k.size() == 1 && i == 0 && k[0] == 0 && k[1] == W - 1);
+    i = k.insert_from_back(0);
+    assert(k.size() == 2 && i == 1 && k[0] == 1 && k[1] == 0);
+
+    // check against a model permutation
+    int model[W];
+    for (int j = 0; j != W; ++j)
+        model[j] = k[j];
+    int n = 2;
+    kvrandom_lcg_nr r;
+    for (int round = 0; round != 100000; ++round) {
+        int op = r() % 4;
+        if (op == 0 && n < W) {
+            int pos = r() % (n + 1);
+            int v = model[W - 1];
+            memmove(&model[pos + 1], &model[pos], sizeof(int) * (W - 1 - pos));
+            model[pos] = v;
+            ++n;
+            i = k.insert_from_back(pos);
+            assert(i == v);
+        } else if (op == 1 && n > 0) {
+            int pos = r() % n;
+            int v = model[pos];
+            memmove(&model[pos], &model[pos + 1], sizeof(int) * (n - 1 - pos));
+            model[n - 1] = v;
+            --n;
+            k.remove(pos);
+        } else if (op == 2 && n > 0) {
+            int pos = r() % n;
+            int v = model[pos];
+            memmove(&model[pos], &model[pos + 1], sizeof(int) * (W - 1 - pos));
+            model[W - 1] = v;
+            --n;
+            k.remove_to_back(pos);
+        } else if (op == 3) {
+            int a = r() % W, b = r() % W;
+            std::swap(model[a], model[b]);
+            k.exchange(a, b);
+        }
+        assert(k.size() == n);
+        for (int j = 0; j != W; ++j)
+            assert(k[j] == model[j]);
+    }
+    assert(k.unparse().find_left('?') < 0);
+
+    for (n = 0; n <= W; ++n) {
+        k = permuter_type::make_sorted(n);
+        assert(k.size() == n);
+        for (int j = 0; j != n; ++j)
+            assert(k[j] == j);
+        for (int j = n; j != W; ++j)
+            assert(k[j] == W - 1 - (j - n));
+    }
+}
+
+void test_wide_kpermuter() {
+    test_wide_kpermuter_one<23>();
+    test_wide_kpermuter_one<24>();
+
+    typename kpermuter<23>::storage_type s(kpermuter<23>::make_sorted(5));
+    kpermuter<23> k(s);
+    assert(k.size() == 5 && k[4] == 4 && k[5] == 22);
+    s = kpermuter<23>::make_empty();
+    assert(kpermuter<23>(s).size() == 0 && s != typename kpermuter<23>::storage_type(k.value()));
+}
+#endif
+
+struct fake_search_leaf {
+    typedef kpermuter<15> permuter_type;
+    uint64_t ikey0_[15];
+    permuter_type::value_type permutation_;
+    permuter_type permutation() const {
+        return permuter_type(permutation_);
+    }
+    const uint64_t* ikeys() const {
+        return ikey0_;
+    }
+    int compare_key(uint64_t a, int bp) const {
+        return ::compare(a, ikey0_[bp]);
+    }
+};
+
+struct fake_search_internode {
+    int nkeys_;
+    uint64_t ikey0_[15];
+    int size() const {
+        return nkeys_;
+    }
+    const uint64_t* ikeys() const {
+        return ikey0_;
+    }
+    int compare_key(uint64_t a, int bp) const {
+        return ::compare(a, ikey0_[bp]);
+    }
+};
+
+void test_key_bound_simd() {
+    kvrandom_lcg_nr r;
+    r.seed(3013);
+    for (int trial = 0; trial < 10000; ++trial) {
+        // leaf: keys stored in random slots, unused slots hold garbage
+        fake_search_leaf lf;
+        typedef fake_search_leaf::permuter_type permuter_type;
+        permuter_type perm = permuter_type::make_empty();
+        for (int i = 0; i < 15; ++i)
+            lf.ikey0_[i] = uint64_t(r()) << (r() % 33);
+        int n = r() % 16;
+        uint64_t k = 0;
+        for (int i = 0; i < n; ++i) {
+            k += 1 + (r() % 3 ? r() % 4 : uint64_t(r()) << 27);
+            int pos = perm.insert_from_back(i);
+            lf.ikey0_[pos] = k;
+        }
+        lf.permutation_ = perm.value();
+        fake_search_internode in;
+        in.nkeys_ = n;
+        for (int i = 0; i < 15; ++i)
+            in.ikey0_[i] = lf.ikey0_[perm[i]];
+        for (int j = 0; j < 20; ++j) {
+            uint64_t x = (j == 0 ? 0 : j == 1 ? ~uint64_t(0)
+                          : n && j < 10 ? lf.ikey0_[perm[r() % n]] + (r() % 3) - 1
+                          : uint64_t(r()) << (r() % 33));
+            key_indexed_position bx = key_bound_binary::lower(x, lf),
+                sx = key_bound_simd::lower(x, lf);
+            assert(bx.i == sx.i && bx.p == sx.p);
+            assert(key_bound_binary::upper(x, lf) == key_bound_simd::upper(x, lf));
+            bx = key_bound_binary::lower(x, in);
+            sx = key_bound_simd::lower(x, in);
+            assert(bx.i == sx.i && bx.p == sx.p);
+            assert(key_bound_binary::upper(x, in) == key_bound_simd::upper(x, in));
+        }
+    }
+}
+
 void test_string_slice() {
     typedef string_slice<uint32_t> ss_type;
     assert(ss_type::make("a", 1) == ss_type::make("aaa", 1));
@@ -188,6 +331,22 @@ void test_string_slice() {
     assert(ss_type::make_comparable("abce", 4) > ss_type::make_comparable("abcd", 4));
     assert(ss_type::equals_sloppy("0123abcdef" + 4, "abcdeabcd5" + 5, 4));
     assert(!ss_type::equals_sloppy("0123abcdef" + 4, "abcdeabcd5" + 5, 5));
+#ifdef __SIZEOF_INT128__
+    typedef string_slice<unsigned __int128> ss128_type;
+    const char* longstr = "_0123456789abcdefghij";
+    assert(ss128_type::make_comparable(longstr + 1, 16)
+           < ss128_type::make_comparable("0123456789abcdeg", 16));
+    assert(ss128_type::make_comparable("0123456789abcdeg", 16)
+           > ss128_type::make_comparable("0123456789abcdef", 16));
+    assert(ss128_type::make_comparable("01234567", 8)
+           < ss128_type::make_comparable("012345670", 9));
+    assert(ss128_type::make_comparable_sloppy(longstr + 1 + 16, 4)
+           == ss128_type::make_comparable("ghij", 4));
+    char buf[16];
+    assert(ss128_type::unparse_comparable(buf, 16, ss128_type::make_comparable(longstr + 1, 16)) == 16
+           && memcmp(buf, longstr + 1, 16) == 0);
+    assert(ctz((unsigned __int128) 1 << 100) == 100);
+#endif
     assert(String("12345").find_right("") == 5);
     assert(String("12345").find_right("5") == 4);
     assert(String("12345").find_right("23") == 1);
@@ -459,6 +618,10 @@ int main(int, char *[])
     assert(ifloor_log2(3) == 2);
     //time_keyslice<uint64_t>();
     test_kpermuter();
+#if HAVE_WIDE_KPERMUTER
+    test_wide_kpermuter();
+#endif
+    test_key_bound_simd();
     test_string_slice();
     test_string_bag();
     test_json();
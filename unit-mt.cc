@@ -4,6 +4,9 @@
 #include <thread>
 
 #include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "compiler.hh"
@@ -31,6 +34,7 @@ class MasstreeWrapper {
 public:
     static constexpr uint64_t insert_bound = 0xfffff; //0xffffff;
     struct table_params : public Masstree::nodeparams<15,15> {
+        static constexpr int fixed_key_length = 8;
         typedef uint64_t value_type;
         typedef Masstree::value_print<value_type> value_print_type;
         typedef threadinfo threadinfo_type;
@@ -148,12 +152,66 @@ public:
         }
     }
 
+    // Fixed-length keys store no lengths, so a key of any other length
+    // would alias an 8-byte key. The lookup, insert and scan entry points
+    // reject such keys with a precondition.
+    void key_length_test() {
+#if FORCE_ENABLE_ASSERTIONS || (!defined(ENABLE_PRECONDITIONS) && ENABLE_ASSERTIONS) || ENABLE_PRECONDITIONS
+        char buf[12] = {0};
+        always_assert(!precondition_fails([&] {
+            unlocked_cursor_type lp(table_, Str(buf, 8));
+            lp.find_unlocked(*ti);
+        }));
+        for (int len : {3, 12}) {
+            Str key(buf, len);
+            always_assert(precondition_fails([&] {
+                unlocked_cursor_type lp(table_, key);
+                lp.find_unlocked(*ti);
+            }));
+            always_assert(precondition_fails([&] {
+                cursor_type lp(table_, key);
+                lp.find_insert(*ti);
+            }));
+            always_assert(precondition_fails([&] {
+                null_scanner scanner;
+                table_.scan(key, true, scanner, *ti);
+            }));
+        }
+#endif
+    }
+
 private:
     table_type table_;
     uint64_t key_gen_;
     static bool stopping;
     static uint32_t printing;
 
+    struct null_scanner {
+        template <typename SS, typename K>
+        void visit_leaf(const SS&, const K&, threadinfo&) {
+        }
+        bool visit_value(Str, uint64_t, threadinfo&) {
+            return false;
+        }
+    };
+
+    // Run f in a child process; return true iff it aborts.
+    template <typename F>
+    static bool precondition_fails(F f) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            // keep the expected failure message out of the test output
+            if (!freopen("/dev/null", "w", stderr))
+                _exit(1);
+            f();
+            _exit(0);
+        }
+        int status;
+        always_assert(pid > 0 && waitpid(pid, &status, 0) == pid);
+        return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+    }
+
     static inline Str make_key(uint64_t int_key, uint64_t& key_buf) {
         key_buf = __builtin_bswap64(int_key);
         return Str((const char *)&key_buf, sizeof(key_buf));
@@ -164,8 +222,8 @@ __thread typename MasstreeWrapper::table_params::threadinfo_type* MasstreeWrappe
 bool MasstreeWrapper::stopping = false;
 uint32_t MasstreeWrapper::printing = 0;
 
-volatile mrcu_epoch_type active_epoch = 1;
-volatile uint64_t globalepoch = 1;
+relaxed_atomic<mrcu_epoch_type> active_epoch(1);
+relaxed_atomic<mrcu_epoch_type> globalepoch(1);
 volatile bool recovering = false;
 
 void test_thread(MasstreeWrapper* mt, int thread_id) {
@@ -175,6 +233,9 @@ void test_thread(MasstreeWrapper* mt, int thread_id) {
 
 int main() {
     auto mt = new MasstreeWrapper();
+    std::cout << "key_length_test..." << std::endl;
+    mt->key_length_test();
+
     mt->keygen_reset();
     std::cout << "insert_remove_test..." << std::endl;
 
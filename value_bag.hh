@@ -45,6 +45,7 @@ class value_bag {
     inline int ncol() const;
     inline O column_length(int i) const;
     inline Str col(int i) const;
+    static inline Str inline_col(Str value, int i);
 
     inline Str row_string() const;
 
@@ -117,6 +118,11 @@ inline lcdf::Str value_bag<O>::col(int i) const {
         return Str();
 }
 
+template <typename O>
+inline lcdf::Str value_bag<O>::inline_col(Str value, int i) {
+    return i == 0 ? value : Str();
+}
+
 template <typename O>
 inline lcdf::Str value_bag<O>::row_string() const {
     return Str(d_.s_, d_.pos_[d_.ncol_]);
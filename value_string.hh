@@ -32,6 +32,7 @@ class value_string {
     inline size_t size() const;
     inline int ncol() const;
     inline Str col(index_type idx) const;
+    static inline Str inline_col(Str value, index_type idx);
 
     template <typename ALLOC>
     inline void deallocate(ALLOC& ti);
@@ -113,6 +114,16 @@ inline lcdf::Str value_string::col(index_type idx) const {
     }
 }
 
+inline lcdf::Str value_string::inline_col(Str value, index_type idx) {
+    if (idx == 0)
+        return value;
+    else {
+        unsigned vallen = value.length();
+        unsigned off = std::min(vallen, index_offset(idx));
+        return Str(value.data() + off, std::min(vallen - off, index_length(idx)));
+    }
+}
+
 template <typename ALLOC>
 inline void value_string::deallocate(ALLOC& ti) {
     ti.deallocate(this, size(), memtag_value);
@@ -75,6 +75,7 @@ class value_versioned_array {
     inline kvtimestamp_t timestamp() const;
     inline int ncol() const;
     inline Str col(int i) const;
+    static inline Str inline_col(Str value, int i);
 
     void deallocate(threadinfo &ti);
     void deallocate_rcu(threadinfo &ti);
@@ -150,6 +151,10 @@ inline Str value_versioned_array::col(int i) const {
         return Str();
 }
 
+inline Str value_versioned_array::inline_col(Str value, int i) {
+    return i == 0 ? value : Str();
+}
+
 inline size_t value_versioned_array::shallow_size(int ncol) {
     return sizeof(value_versioned_array) + ncol * sizeof(lcdf::inline_string*);
 }